@@ -0,0 +1,322 @@
+//assets.c
+// index of static web files. Read-only files come from "www" partition image
+// built by tools/mkwww.py and mapped to memory, so they are sent straight from flash.
+// Files on storage are described by manifest.json of tools/webpack.py
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "cJSON.h"
+#include "storage.h"
+#include "assets.h"
+
+static const char *TAG = "ASSETS";
+
+#define MANIFEST        "/web/manifest.json" // relative to storage mount point, as loadTextFile expects
+#define MAX_HDR         128
+#define WWW_PARTITION   "www"
+#define WWW_MAGIC       0x31575757 // "WWW1"
+#define WWW_IMMUTABLE   0x01
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t size;
+    uint32_t reserved;
+} wwwHeader_t;
+
+typedef struct {
+    uint32_t path;      // offsets from image start
+    uint32_t data;
+    uint32_t size;
+    uint32_t gzData;    // 0 without gzip variant
+    uint32_t gzSize;
+    uint32_t flags;
+    char etag[24];
+} wwwEntry_t;
+
+typedef struct {
+    char *path;
+    char etag[20];
+    uint32_t size;
+    bool gzip;
+    bool immutable;
+} manifestEntry_t;
+
+typedef struct {
+    const char *ext;
+    const char *type;
+} contentType_t;
+
+// sorted by extension
+static const contentType_t contentTypes[] = {
+    {"css",   "text/css"},
+    {"gif",   "image/gif"},
+    {"htm",   "text/html"},
+    {"html",  "text/html"},
+    {"ico",   "image/x-icon"},
+    {"jpeg",  "image/jpeg"},
+    {"jpg",   "image/jpeg"},
+    {"js",    "application/javascript"},
+    {"json",  "application/json; charset=utf-8"},
+    {"map",   "application/json"},
+    {"pdf",   "application/pdf"},
+    {"png",   "image/png"},
+    {"svg",   "image/svg+xml"},
+    {"txt",   "text/plain"},
+    {"woff",  "font/woff"},
+    {"woff2", "font/woff2"}
+};
+
+static manifestEntry_t *assets = NULL;
+static uint16_t assetsQty = 0;
+static const char *image = NULL;
+static const wwwEntry_t *imageEntries = NULL;
+static uint32_t imageQty = 0;
+
+static int compareType(const void *key, const void *item) {
+    return strcasecmp((const char*)key, ((const contentType_t*)item)->ext);
+}
+
+const char *getContentType(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if ((ext == NULL) || (strchr(ext, '/') != NULL))
+        return "text/plain";
+    const contentType_t *type = bsearch(ext + 1, contentTypes, sizeof(contentTypes)/sizeof(contentTypes[0]),
+                                        sizeof(contentType_t), compareType);
+    return type != NULL ? type->type : "text/plain";
+}
+
+static int compareAsset(const void *a, const void *b) {
+    return strcmp(((const manifestEntry_t*)a)->path, ((const manifestEntry_t*)b)->path);
+}
+
+static int compareImageEntry(const void *key, const void *item) {
+    return strcmp((const char*)key, image + ((const wwwEntry_t*)item)->path);
+}
+
+esp_err_t initAssets() {
+    // image stays mapped for the whole run
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, WWW_PARTITION);
+    if (partition == NULL) {
+        ESP_LOGI(TAG, "No %s partition", WWW_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+    const void *ptr;
+    spi_flash_mmap_handle_t handle;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &ptr, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Can't map %s partition %s", WWW_PARTITION, esp_err_to_name(err));
+        return err;
+    }
+    const wwwHeader_t *header = ptr;
+    if ((header->magic != WWW_MAGIC) || (header->size > partition->size) ||
+        (sizeof(wwwHeader_t) + header->count * sizeof(wwwEntry_t) > header->size)) {
+        ESP_LOGE(TAG, "Wrong web image");
+        spi_flash_munmap(handle);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // entries pointing outside of image are never served
+    const wwwEntry_t *entries = (const wwwEntry_t*)(header + 1);
+    for (uint32_t i=0; i<header->count; i++) {
+        if ((entries[i].path >= header->size) || (entries[i].data + entries[i].size > header->size) ||
+            (entries[i].gzData + entries[i].gzSize > header->size) || (entries[i].etag[sizeof(entries[i].etag)-1] != 0)) {
+            ESP_LOGE(TAG, "Wrong web image entry %d", i);
+            spi_flash_munmap(handle);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    image = ptr;
+    imageEntries = entries;
+    imageQty = header->count;
+    ESP_LOGI(TAG, "Web image %d files, %d bytes", imageQty, header->size);
+    return ESP_OK;
+}
+
+static void freeAssets() {
+    for (uint16_t i=0; i<assetsQty; i++)
+        free(assets[i].path);
+    free(assets);
+    assets = NULL;
+    assetsQty = 0;
+}
+
+esp_err_t assetsLoad() {
+    // on start and when manifest is uploaded, both in httpd task
+    char *data = NULL;
+    freeAssets();
+    if (loadTextFile(MANIFEST, &data) != ESP_OK) {
+        ESP_LOGI(TAG, "No manifest, files are served as is");
+        return ESP_ERR_NOT_FOUND;
+    }
+    cJSON *jManifest = cJSON_Parse(data);
+    free(data);
+    if (!cJSON_IsArray(jManifest)) {
+        ESP_LOGE(TAG, "Wrong manifest");
+        cJSON_Delete(jManifest);
+        return ESP_FAIL;
+    }
+    assets = calloc(cJSON_GetArraySize(jManifest), sizeof(manifestEntry_t));
+    if (assets == NULL) {
+        cJSON_Delete(jManifest);
+        return ESP_ERR_NO_MEM;
+    }
+    cJSON *item;
+    cJSON_ArrayForEach(item, jManifest) {
+        if (!cJSON_IsString(cJSON_GetObjectItem(item, "path")) || !cJSON_IsString(cJSON_GetObjectItem(item, "etag")))
+            continue;
+        manifestEntry_t *asset = &assets[assetsQty];
+        asset->path = strdup(cJSON_GetObjectItem(item, "path")->valuestring);
+        if (asset->path == NULL)
+            break;
+        snprintf(asset->etag, sizeof(asset->etag), "\"%.16s\"", cJSON_GetObjectItem(item, "etag")->valuestring);
+        asset->size = cJSON_IsNumber(cJSON_GetObjectItem(item, "size")) ? cJSON_GetObjectItem(item, "size")->valueint : 0;
+        asset->gzip = cJSON_IsTrue(cJSON_GetObjectItem(item, "gzip"));
+        asset->immutable = cJSON_IsTrue(cJSON_GetObjectItem(item, "immutable"));
+        assetsQty++;
+    }
+    cJSON_Delete(jManifest);
+    qsort(assets, assetsQty, sizeof(manifestEntry_t), compareAsset);
+    ESP_LOGI(TAG, "%d assets in manifest", assetsQty);
+    return ESP_OK;
+}
+
+bool assetsFind(const char *uri, asset_t *asset) {
+    // image first, storage keeps mutable files only
+    memset(asset, 0, sizeof(asset_t));
+    asset->type = getContentType(uri);
+    const wwwEntry_t *entry = NULL;
+    if (imageQty > 0)
+        entry = bsearch(uri, imageEntries, imageQty, sizeof(wwwEntry_t), compareImageEntry);
+    if (entry != NULL) {
+        asset->etag = entry->etag;
+        asset->data = image + entry->data;
+        asset->size = entry->size;
+        asset->gzip = entry->gzData != 0;
+        asset->gzData = image + entry->gzData;
+        asset->gzSize = entry->gzSize;
+        asset->immutable = entry->flags & WWW_IMMUTABLE;
+        return true;
+    }
+    if (assetsQty == 0)
+        return false;
+    manifestEntry_t key = {.path = (char*)uri};
+    manifestEntry_t *found = bsearch(&key, assets, assetsQty, sizeof(manifestEntry_t), compareAsset);
+    if (found == NULL)
+        return false;
+    asset->etag = found->etag;
+    asset->size = found->size;
+    asset->gzip = found->gzip;
+    asset->immutable = found->immutable;
+    return true;
+}
+
+bool isAssetNotModified(httpd_req_t *req, const asset_t *asset) {
+    char value[MAX_HDR];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK)
+        return false;
+    return strstr(value, asset->etag) != NULL;
+}
+
+bool isGzipAccepted(httpd_req_t *req) {
+    char value[MAX_HDR];
+    if (httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, sizeof(value)) != ESP_OK)
+        return false;
+    return strstr(value, "gzip") != NULL;
+}
+
+static const char *getCacheControl(const asset_t *asset) {
+    // hashed names never change, others are revalidated with ETag
+    return asset->immutable ? "public, max-age=31536000, immutable" : "no-cache";
+}
+
+void setAssetHeaders(httpd_req_t *req, const asset_t *asset, bool gzip) {
+    // values have to live until response is sent, asset strings do
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    httpd_resp_set_hdr(req, "Cache-Control", getCacheControl(asset));
+    if (gzip)
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+}
+
+static void formatHttpDate(uint32_t time, char *buf, size_t size) {
+    time_t value = time;
+    struct tm timeinfo;
+    gmtime_r(&value, &timeinfo);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+}
+
+int formatAssetHeaders(char *buf, size_t size, const asset_t *asset, bool gzip) {
+    // same headers as raw lines, for responses written without httpd, etag and mtime are optional
+    char date[32];
+    int len = snprintf(buf, size, "Content-Type: %s\r\nAccept-Ranges: bytes\r\n", asset->type);
+    if ((asset->etag != NULL) && (len < size))
+        len += snprintf(buf + len, size - len, "ETag: %s\r\nVary: Accept-Encoding\r\nCache-Control: %s\r\n",
+                        asset->etag, getCacheControl(asset));
+    if ((asset->mtime != 0) && (len < size)) {
+        formatHttpDate(asset->mtime, date, sizeof(date));
+        len += snprintf(buf + len, size - len, "Last-Modified: %s\r\n", date);
+    }
+    if (gzip && (len < size))
+        len += snprintf(buf + len, size - len, "Content-Encoding: gzip\r\n");
+    return len;
+}
+
+static bool isIfRangeMatch(httpd_req_t *req, const asset_t *asset) {
+    // strong etag or exact Last-Modified, range of changed file is not sent
+    char value[MAX_HDR];
+    char date[32];
+    if (httpd_req_get_hdr_value_str(req, "If-Range", value, sizeof(value)) != ESP_OK)
+        return true;
+    if (value[0] == '"')
+        return (asset->etag != NULL) && !strcmp(value, asset->etag);
+    if (asset->mtime == 0)
+        return false;
+    formatHttpDate(asset->mtime, date, sizeof(date));
+    return !strcmp(value, date);
+}
+
+uint16_t getAssetRange(httpd_req_t *req, const asset_t *asset, size_t size, size_t *offset, size_t *len) {
+    // status of response: 200 for whole file, 206 for range, 416 when range is out of file.
+    // Single range only, anything else gets whole file
+    char value[MAX_HDR];
+    char *pos, *end;
+    size_t first, last;
+    *offset = 0;
+    *len = size;
+    if ((httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK) ||
+        strncmp(value, "bytes=", 6) || (strchr(value, ',') != NULL) || !isIfRangeMatch(req, asset))
+        return 200;
+    pos = value + 6;
+    if (*pos == '-') {
+        // last n bytes
+        size_t suffix = strtoul(pos + 1, &end, 10);
+        if ((end == pos + 1) || (*end != 0))
+            return 200;
+        if ((suffix == 0) || (size == 0))
+            return 416;
+        first = suffix < size ? size - suffix : 0;
+        last = size - 1;
+    } else {
+        first = strtoul(pos, &end, 10);
+        if ((end == pos) || (*end != '-'))
+            return 200;
+        pos = end + 1;
+        last = size - 1;
+        if (*pos != 0) {
+            last = strtoul(pos, &end, 10);
+            if ((*end != 0) || (last < first))
+                return 200;
+            if (last >= size)
+                last = size - 1;
+        }
+        if (first >= size)
+            return 416;
+    }
+    *offset = first;
+    *len = last - first + 1;
+    return 206;
+}
@@ -0,0 +1,27 @@
+//assets.h
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_http_server.h"
+
+// web asset from www image (tools/mkwww.py) or manifest.json of tools/webpack.py
+typedef struct {
+    const char *type;
+    const char *etag;       // strong, quoted
+    const char *data;       // mapped flash, NULL for files on storage
+    const char *gzData;
+    uint32_t size;
+    uint32_t gzSize;
+    uint32_t mtime;         // epoch, 0 when unknown
+    bool gzip;              // gzip variant exists, "<path>.gz" on storage
+    bool immutable;         // hashed file name, cached forever
+} asset_t;
+
+esp_err_t initAssets();
+esp_err_t assetsLoad();
+bool assetsFind(const char *uri, asset_t *asset);
+const char *getContentType(const char *filename);
+bool isAssetNotModified(httpd_req_t *req, const asset_t *asset);
+bool isGzipAccepted(httpd_req_t *req);
+void setAssetHeaders(httpd_req_t *req, const asset_t *asset, bool gzip);
+int formatAssetHeaders(char *buf, size_t size, const asset_t *asset, bool gzip);
+uint16_t getAssetRange(httpd_req_t *req, const asset_t *asset, size_t size, size_t *offset, size_t *len);
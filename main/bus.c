@@ -0,0 +1,91 @@
+//bus.c
+// in-process bus of sensor readings. Every subscriber has own queue,
+// producers never block, full queue is handled by subscriber overflow policy
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "bus.h"
+#include "json.h"
+
+static const char *TAG = "BUS";
+
+#define MAX_SUBSCRIBERS 6
+
+struct busSubscriber {
+    const char *name;
+    QueueHandle_t queue;
+    busOverflow_t overflow;
+    uint32_t delivered;
+    uint32_t dropped;
+};
+
+static busSubscriber_t subscribers[MAX_SUBSCRIBERS];
+static uint8_t subscribersQty = 0;
+static uint32_t published = 0;
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+
+busSubscriber_t *busSubscribe(const char *name, uint8_t depth, busOverflow_t overflow) {
+    // on init only, before producers start
+    if (subscribersQty >= MAX_SUBSCRIBERS) {
+        ESP_LOGE(TAG, "No room for subscriber %s", name);
+        return NULL;
+    }
+    busSubscriber_t *sub = &subscribers[subscribersQty];
+    sub->queue = xQueueCreate(depth, sizeof(reading_t));
+    if (sub->queue == NULL) {
+        ESP_LOGE(TAG, "Can't create queue for subscriber %s", name);
+        return NULL;
+    }
+    sub->name = name;
+    sub->overflow = overflow;
+    sub->delivered = 0;
+    sub->dropped = 0;
+    subscribersQty++;
+    return sub;
+}
+
+void busPublish(const reading_t *reading) {
+    // several producers, counters are updated under spinlock
+    bool delivered[MAX_SUBSCRIBERS];
+    bool dropped[MAX_SUBSCRIBERS];
+    for (uint8_t i=0; i<subscribersQty; i++) {
+        busSubscriber_t *sub = &subscribers[i];
+        delivered[i] = xQueueSend(sub->queue, reading, 0) == pdTRUE;
+        dropped[i] = !delivered[i];
+        if (dropped[i] && (sub->overflow == BUS_DROP_OLDEST)) {
+            reading_t old;
+            xQueueReceive(sub->queue, &old, 0);
+            delivered[i] = xQueueSend(sub->queue, reading, 0) == pdTRUE;
+        }
+    }
+    portENTER_CRITICAL(&statsMux);
+    published++;
+    for (uint8_t i=0; i<subscribersQty; i++) {
+        subscribers[i].delivered += delivered[i];
+        subscribers[i].dropped += dropped[i];
+    }
+    portEXIT_CRITICAL(&statsMux);
+}
+
+bool busReceive(busSubscriber_t *sub, reading_t *reading, TickType_t wait) {
+    return xQueueReceive(sub->queue, reading, wait) == pdTRUE;
+}
+
+void writeBusStats(jsonWriter_t *w) {
+    jsonObject(w);
+    jsonKey(w, "published");
+    jsonInt(w, published);
+    for (uint8_t i=0; i<subscribersQty; i++) {
+        jsonKey(w, subscribers[i].name);
+        jsonObject(w);
+        jsonKey(w, "delivered");
+        jsonInt(w, subscribers[i].delivered);
+        jsonKey(w, "dropped");
+        jsonInt(w, subscribers[i].dropped);
+        jsonKey(w, "waiting");
+        jsonInt(w, uxQueueMessagesWaiting(subscribers[i].queue));
+        jsonObjectEnd(w);
+    }
+    jsonObjectEnd(w);
+}
@@ -0,0 +1,39 @@
+//bus.h
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+typedef enum {
+    READING_TEMPERATURE = 0,
+    READING_PRESSURE,
+    READING_WATER
+} readingKind_t;
+
+#define READING_GOOD        0
+#define READING_BAD         1
+
+#define READING_CYCLE_END   0x01 // last reading of sampling cycle
+
+typedef struct {
+    uint64_t id;        // rom code for 1-wire sensors, 0 for single sensors
+    int32_t value;      // fixed point, value / 10^decimals
+    uint32_t time;      // epoch
+    uint8_t kind;
+    uint8_t decimals;
+    uint8_t quality;
+    uint8_t flags;
+} reading_t;
+
+typedef enum {
+    BUS_DROP_NEWEST = 0,    // new reading is dropped when subscriber queue is full
+    BUS_DROP_OLDEST         // oldest unread reading is dropped
+} busOverflow_t;
+
+typedef struct busSubscriber busSubscriber_t;
+
+busSubscriber_t *busSubscribe(const char *name, uint8_t depth, busOverflow_t overflow);
+void busPublish(const reading_t *reading);
+bool busReceive(busSubscriber_t *sub, reading_t *reading, TickType_t wait);
+struct jsonWriter;
+void writeBusStats(struct jsonWriter *w);
@@ -0,0 +1,104 @@
+//cbor.c
+#include <string.h>
+#include "cbor.h"
+
+#define MT_UINT     0x00
+#define MT_NINT     0x20
+#define MT_BYTES    0x40
+#define MT_TEXT     0x60
+#define MT_ARRAY    0x80
+#define MT_MAP      0xA0
+#define MT_SIMPLE   0xE0
+
+void cborInit(cborWriter_t *w, uint8_t *buf, size_t size) {
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->overflow = false;
+}
+
+static void put(cborWriter_t *w, const void *data, size_t len) {
+    if (w->overflow || (w->len + len > w->size)) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(&w->buf[w->len], data, len);
+    w->len += len;
+}
+
+static void putHead(cborWriter_t *w, uint8_t major, uint64_t value) {
+    // shortest form of argument
+    uint8_t head[9];
+    uint8_t len;
+    if (value < 24) {
+        head[0] = major | value;
+        len = 1;
+    } else if (value <= 0xFF) {
+        head[0] = major | 24;
+        len = 2;
+    } else if (value <= 0xFFFF) {
+        head[0] = major | 25;
+        len = 3;
+    } else if (value <= 0xFFFFFFFF) {
+        head[0] = major | 26;
+        len = 5;
+    } else {
+        head[0] = major | 27;
+        len = 9;
+    }
+    for (uint8_t i=1; i<len; i++)
+        head[i] = value >> (8 * (len - 1 - i));
+    put(w, head, len);
+}
+
+void cborUint(cborWriter_t *w, uint64_t value) {
+    putHead(w, MT_UINT, value);
+}
+
+void cborInt(cborWriter_t *w, int64_t value) {
+    if (value >= 0)
+        putHead(w, MT_UINT, value);
+    else
+        putHead(w, MT_NINT, -1 - value);
+}
+
+void cborText(cborWriter_t *w, const char *text) {
+    size_t len = strlen(text);
+    putHead(w, MT_TEXT, len);
+    put(w, text, len);
+}
+
+void cborBytes(cborWriter_t *w, const uint8_t *data, size_t len) {
+    putHead(w, MT_BYTES, len);
+    put(w, data, len);
+}
+
+void cborArray(cborWriter_t *w, size_t qty) {
+    putHead(w, MT_ARRAY, qty);
+}
+
+void cborMap(cborWriter_t *w, size_t qty) {
+    // qty of pairs
+    putHead(w, MT_MAP, qty);
+}
+
+void cborFloat(cborWriter_t *w, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t data[5] = {MT_SIMPLE | 26, bits >> 24, bits >> 16, bits >> 8, bits};
+    put(w, data, sizeof(data));
+}
+
+void cborBool(cborWriter_t *w, bool value) {
+    uint8_t data = MT_SIMPLE | (value ? 21 : 20);
+    put(w, &data, 1);
+}
+
+void cborNull(cborWriter_t *w) {
+    uint8_t data = MT_SIMPLE | 22;
+    put(w, &data, 1);
+}
+
+bool cborOverflow(cborWriter_t *w) {
+    return w->overflow;
+}
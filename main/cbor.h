@@ -0,0 +1,25 @@
+//cbor.h
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// streaming CBOR (RFC 8949) encoder into caller buffer, no allocations.
+// On overflow writer stops and cborOverflow() is true
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} cborWriter_t;
+
+void cborInit(cborWriter_t *w, uint8_t *buf, size_t size);
+void cborUint(cborWriter_t *w, uint64_t value);
+void cborInt(cborWriter_t *w, int64_t value);
+void cborText(cborWriter_t *w, const char *text);
+void cborBytes(cborWriter_t *w, const uint8_t *data, size_t len);
+void cborArray(cborWriter_t *w, size_t qty);
+void cborMap(cborWriter_t *w, size_t qty);
+void cborFloat(cborWriter_t *w, float value);
+void cborBool(cborWriter_t *w, bool value);
+void cborNull(cborWriter_t *w);
+bool cborOverflow(cborWriter_t *w);
@@ -0,0 +1,75 @@
+//chunkWriter.c
+// receiver of upload or download fills chunks, writer task writes them to flash meanwhile
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "chunkWriter.h"
+
+static void chunkWriterTask(void *pvParameter) {
+    // writes filled chunks and gives them back, after error chunks are only returned
+    chunkWriter_t *writer = pvParameter;
+    chunk_t chunk;
+    while ((xQueueReceive(writer->filled, &chunk, portMAX_DELAY) == pdTRUE) && (chunk.len > 0)) {
+        if (writer->err == ESP_OK)
+            writer->err = writer->write(writer->ctx, &chunk);
+        xQueueSend(writer->free, &chunk, portMAX_DELAY);
+    }
+    xSemaphoreGive(writer->done);
+    vTaskDelete(NULL);
+}
+
+static void freeWriter(chunkWriter_t *writer) {
+    if (writer->done != NULL)
+        vSemaphoreDelete(writer->done);
+    if (writer->free != NULL)
+        vQueueDelete(writer->free);
+    if (writer->filled != NULL)
+        vQueueDelete(writer->filled);
+    free(writer->buf);
+}
+
+esp_err_t chunkWriterStart(chunkWriter_t *writer, const char *name, size_t chunkSize, chunkWrite_t write, void *ctx) {
+    memset(writer, 0, sizeof(chunkWriter_t));
+    writer->write = write;
+    writer->ctx = ctx;
+    writer->buf = malloc(chunkSize * CHUNK_WRITER_CHUNKS);
+    // end marker always fits filled queue
+    writer->filled = xQueueCreate(CHUNK_WRITER_CHUNKS + 1, sizeof(chunk_t));
+    writer->free = xQueueCreate(CHUNK_WRITER_CHUNKS, sizeof(chunk_t));
+    writer->done = xSemaphoreCreateBinary();
+    if ((writer->buf == NULL) || (writer->filled == NULL) || (writer->free == NULL) || (writer->done == NULL)) {
+        freeWriter(writer);
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint8_t i=0; i<CHUNK_WRITER_CHUNKS; i++) {
+        chunk_t chunk = {.data = writer->buf + i * chunkSize, .len = 0};
+        xQueueSend(writer->free, &chunk, 0);
+    }
+    if (xTaskCreate(&chunkWriterTask, name, 3072, writer, 5, NULL) != pdPASS) {
+        freeWriter(writer);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+bool chunkWriterGet(chunkWriter_t *writer, chunk_t *chunk) {
+    // empty chunk, false when writer failed and data is not needed any more
+    xQueueReceive(writer->free, chunk, portMAX_DELAY);
+    chunk->len = 0;
+    return writer->err == ESP_OK;
+}
+
+void chunkWriterPut(chunkWriter_t *writer, const chunk_t *chunk) {
+    xQueueSend(writer->filled, chunk, portMAX_DELAY);
+}
+
+esp_err_t chunkWriterFinish(chunkWriter_t *writer) {
+    // waits for queued chunks, frees writer and returns first write error
+    chunk_t end = {.data = NULL, .len = 0};
+    xQueueSend(writer->filled, &end, portMAX_DELAY);
+    xSemaphoreTake(writer->done, portMAX_DELAY);
+    esp_err_t err = writer->err;
+    freeWriter(writer);
+    return err;
+}
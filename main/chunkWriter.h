@@ -0,0 +1,35 @@
+//chunkWriter.h
+// included by .c files only
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+// double buffer: caller fills one chunk while writer task passes the other one to write callback
+#define CHUNK_WRITER_CHUNKS     2
+
+typedef struct {
+    char *data;
+    size_t len;
+} chunk_t;
+
+// error stops writing, the rest of chunks are only returned
+typedef esp_err_t (*chunkWrite_t)(void *ctx, const chunk_t *chunk);
+
+typedef struct {
+    QueueHandle_t filled;   // to writer task
+    QueueHandle_t free;     // back to caller
+    SemaphoreHandle_t done;
+    char *buf;
+    chunkWrite_t write;
+    void *ctx;
+    volatile esp_err_t err; // first error of write callback
+} chunkWriter_t;
+
+esp_err_t chunkWriterStart(chunkWriter_t *writer, const char *name, size_t chunkSize, chunkWrite_t write, void *ctx);
+bool chunkWriterGet(chunkWriter_t *writer, chunk_t *chunk);
+// chunk is not empty, empty one ends writing
+void chunkWriterPut(chunkWriter_t *writer, const chunk_t *chunk);
+esp_err_t chunkWriterFinish(chunkWriter_t *writer);
@@ -8,6 +8,9 @@
 #include "freertos/semphr.h"
 #include "ota.h"
 #include "core.h"
+#include "routes.h"
+#include "seqlock.h"
+#include "json.h"
 #include "driver/gpio.h"
 #include "mqtt.h"
 #include "driver/rmt.h"
@@ -15,11 +18,29 @@
 #include "esp_sntp.h"
 #include "driver/adc.h"
 #include "network.h"
+#include "scheduler.h"
+#include "executor.h"
+#include "mqttQueue.h"
+#include "mqttRouter.h"
+#include "cbor.h"
+#include "policy.h"
+#include "bus.h"
+#include "topics.h"
+#include "live.h"
+#include "state.h"
+#include "transfer.h"
+#include "esp_timer.h"
 
 static const char *TAG = "CORE";
 static cJSON *networkConfig;
 static cJSON *jTemperatures;
 static cJSON *jScheduler;
+// config trees are replaced as a whole under domain lock by httpd task. Readers in httpd task walk them
+// without locks, readers in other tasks hold domain lock while walking temperatures and scheduler.
+// Replaced tree is freed on the next replace of the same domain. Network config is read by getters
+// only, they hold networkLock and return copies, so replaced network tree is freed at once
+static cJSON *retiredTemperatures, *retiredScheduler;
+static SemaphoreHandle_t networkLock, temperaturesLock, schedulerLock;
 
 //network config defaults
 #define DEF_IP          "192.168.99.9"
@@ -41,15 +62,68 @@ static cJSON *jScheduler;
 #define OW      14
 #define ADC     36
 
+#define MAX_SENSORS     16
+
 #define  setbit(var, bit)    ((var) |= (1 << (bit)))
 #define  clrbit(var, bit)    ((var) &= ~(1 << (bit)))
 
+#define DEF_KEYFRAME    10 // sampling cycles
+#define MQTT_JSON_SIZE  2048
+
+typedef struct {
+    uint64_t rom;
+    uint8_t id;         // position in temperatures config
+    topicHandle_t topic;
+    policyState_t policy; // last forwarded value in tenths of degree
+    uint32_t version;   // incremented when value is forwarded by policy
+    uint32_t sentVersion;
+} sensor_t;
+
+typedef struct {
+    uint64_t rom;
+    int32_t value;      // tenths of degree
+    uint32_t time;      // epoch
+} tempValue_t;
+
+typedef struct {
+    tempValue_t items[MAX_SENSORS];
+    uint8_t qty;
+} tempValues_t;
+
+typedef struct {
+    int32_t value;
+    uint32_t time;      // epoch of last change
+    uint8_t decimals;
+    bool valid;
+} levelValue_t;
+
 bool reboot = false;
-SemaphoreHandle_t sem_busy = NULL;
-void processScheduler();
+// publisher task only
+static sensor_t sensors[MAX_SENSORS];
+static uint8_t sensorsQty = 0;
+static volatile bool sensorsReset = false;
+// last temperatures, written by snapshot task only
+static tempValues_t tempValues;
+static seqlock_t tempValuesLock;
+// last water and pressure, written by snapshot task only
+static levelValue_t waterLevel, pressureLevel;
+static seqlock_t levelsLock;
+static policy_t temperaturePolicy, pressurePolicy, waterPolicy;
+static busSubscriber_t *publisherSub, *snapshotSub, *loggerSub;
+void mqttScheduler();
+static void writeTemperatures(jsonWriter_t *w);
+static void writeState(jsonWriter_t *w);
+
+static void replaceConfig(cJSON **current, cJSON **retired, cJSON *tree) {
+    // domain lock is held by caller
+    cJSON *old = *current;
+    __atomic_store_n(current, tree, __ATOMIC_RELEASE);
+    cJSON_Delete(*retired);
+    *retired = old;
+}
 
-esp_err_t createNetworkConfig() {
-    networkConfig = cJSON_CreateObject();    
+static cJSON *createNetworkConfig() {
+    cJSON *networkConfig = cJSON_CreateObject();    
     
     cJSON *eth = cJSON_CreateObject();
     cJSON_AddItemToObject(eth, "enabled", cJSON_CreateBool(false));
@@ -97,7 +171,7 @@ esp_err_t createNetworkConfig() {
     cJSON_AddItemToObject(networkConfig, "rlog", rlog);
     // cJSON_Delete(rlog);
 
-    return ESP_OK;
+    return networkConfig;
 }
 
 esp_err_t saveNetworkConfig() {
@@ -121,8 +195,8 @@ esp_err_t loadNetworkConfig() {
     } else {
         ESP_LOGI(TAG, "can't read networkConfig. creating default config");
         cJSON_Delete(networkConfig);
-        if (createNetworkConfig() == ESP_OK)
-            saveNetworkConfig();        
+        networkConfig = createNetworkConfig();
+        saveNetworkConfig();        
     }
     free(buffer);
     return ESP_OK;
@@ -191,36 +265,73 @@ esp_err_t loadConfig() {
     return ESP_FAIL;
 }
 
+static cJSON *getNetworkItem(const char* parentName, const char* name) {
+    // caller holds networkLock
+    return cJSON_GetObjectItem(parentName != NULL ? cJSON_GetObjectItem(networkConfig, parentName) : networkConfig, name);
+}
+
 uint16_t getNetworkConfigValueInt(const char* name) {
-    if (!cJSON_IsNumber(cJSON_GetObjectItem(networkConfig, name)))    
-        return 0;
-    return cJSON_GetObjectItem(networkConfig, name)->valueint;
+    return getNetworkConfigValueInt2(NULL, name);
 }
 
 bool getNetworkConfigValueBool(const char* name) {
-    return cJSON_IsTrue(cJSON_GetObjectItem(networkConfig, name));
+    return getNetworkConfigValueBool2(NULL, name);
 }
 
 char *getNetworkConfigValueString(const char* name) {
-    if (!cJSON_IsString(cJSON_GetObjectItem(networkConfig, name)))    
-        return NULL;
-    return cJSON_GetObjectItem(networkConfig, name)->valuestring;
+    return getNetworkConfigValueString2(NULL, name);
 }
 
 uint16_t getNetworkConfigValueInt2(const char* parentName, const char* name) {
-    if (!cJSON_IsNumber(cJSON_GetObjectItem(cJSON_GetObjectItem(networkConfig, parentName), name)))
-        return 0;
-    return cJSON_GetObjectItem(cJSON_GetObjectItem(networkConfig, parentName), name)->valueint;
+    xSemaphoreTake(networkLock, portMAX_DELAY);
+    cJSON *item = getNetworkItem(parentName, name);
+    uint16_t res = cJSON_IsNumber(item) ? item->valueint : 0;
+    xSemaphoreGive(networkLock);
+    return res;
 }
 
 bool getNetworkConfigValueBool2(const char* parentName, const char* name) {
-    return cJSON_IsTrue(cJSON_GetObjectItem(cJSON_GetObjectItem(networkConfig, parentName), name));
+    xSemaphoreTake(networkLock, portMAX_DELAY);
+    bool res = cJSON_IsTrue(getNetworkItem(parentName, name));
+    xSemaphoreGive(networkLock);
+    return res;
 }
 
 char *getNetworkConfigValueString2(const char* parentName, const char* name) {
-    if (!cJSON_IsString(cJSON_GetObjectItem(cJSON_GetObjectItem(networkConfig, parentName), name)))
-        return NULL;
-    return cJSON_GetObjectItem(cJSON_GetObjectItem(networkConfig, parentName), name)->valuestring;
+    // copy, caller frees
+    xSemaphoreTake(networkLock, portMAX_DELAY);
+    cJSON *item = getNetworkItem(parentName, name);
+    char *res = cJSON_IsString(item) ? strdup(item->valuestring) : NULL;
+    xSemaphoreGive(networkLock);
+    return res;
+}
+
+cJSON *getNetworkConfigValueArray2(const char* parentName, const char* name) {
+    // copy, caller deletes
+    xSemaphoreTake(networkLock, portMAX_DELAY);
+    cJSON *item = getNetworkItem(parentName, name);
+    cJSON *res = cJSON_IsArray(item) ? cJSON_Duplicate(item, true) : NULL;
+    xSemaphoreGive(networkLock);
+    return res;
+}
+
+cJSON *getNetworkConfigValueObject2(const char* parentName, const char* name) {
+    // copy, caller deletes
+    xSemaphoreTake(networkLock, portMAX_DELAY);
+    cJSON *item = getNetworkItem(parentName, name);
+    cJSON *res = cJSON_IsObject(item) ? cJSON_Duplicate(item, true) : NULL;
+    xSemaphoreGive(networkLock);
+    return res;
+}
+
+cJSON *lockSchedulerConfig() {
+    // tree is not replaced until unlockSchedulerConfig
+    xSemaphoreTake(schedulerLock, portMAX_DELAY);
+    return jScheduler;
+}
+
+void unlockSchedulerConfig() {
+    xSemaphoreGive(schedulerLock);
 }
 
 void setErrorTextJson(char **response, const char *text, ...) {
@@ -271,18 +382,8 @@ void setText(char **response, const char *text, ...) {
     ESP_LOGI(TAG, "%s", dest);
 }
 
-esp_err_t getNetworkConfig(char **response) {
-    ESP_LOGI(TAG, "getNetworkConfig");
-    if (!cJSON_IsObject(networkConfig) && !cJSON_IsArray(networkConfig)) {      
-        setErrorText(response, "networkConfig is not a json");
-        return ESP_FAIL;
-    }    
-    *response = cJSON_Print(networkConfig);
-    return ESP_OK;    
-}
-
-esp_err_t setNetworkConfig(char **response, char *content) {
-    cJSON *parent = cJSON_Parse(content);
+esp_err_t setNetworkConfig(char **response, cJSON *parent) {
+    // takes parsed body
     if(!cJSON_IsObject(parent))
     {
         setErrorText(response, "Is not a JSON object");
@@ -290,17 +391,27 @@ esp_err_t setNetworkConfig(char **response, char *content) {
         return ESP_FAIL;
     }
         
+    xSemaphoreTake(networkLock, portMAX_DELAY);
     cJSON_Delete(networkConfig);
-    networkConfig = parent;    
+    networkConfig = parent;
     saveNetworkConfig();
+    xSemaphoreGive(networkLock);
+    // hostname and latest topics could be changed
+    sensorsReset = true;
+    stateChanged(STATE_CONFIG);
+    liveNotify("config", "network");
     setTextJson(response, "OK");
     return ESP_OK;
 }
 
 esp_err_t factoryReset() {
+    xSemaphoreTake(networkLock, portMAX_DELAY);
     cJSON_Delete(networkConfig);
-    createNetworkConfig();    
+    networkConfig = createNetworkConfig();
     saveNetworkConfig();      
+    xSemaphoreGive(networkLock);
+    sensorsReset = true;
+    stateChanged(STATE_CONFIG);
     return ESP_OK;
 }
 
@@ -311,142 +422,235 @@ esp_err_t setFactoryReset(char **response) {
     return ESP_OK;  
 }
 
-esp_err_t getDeviceInfo(char **response) {
-    //ESP_LOGI(TAG, "getStatus");
-    cJSON *status = cJSON_CreateObject();    
-    char *uptime = getUpTime();
-    char *curdate = getCurrentDateTime("%d.%m.%Y %H:%M:%S");
-    char *hostname = getNetworkConfigValueString("hostname");
-    char *version = getCurrentVersion();
-    char *ethip = getETHIPStr();
-    char *wifiip = getWIFIIPStr();
-    cJSON_AddItemToObject(status, "freememory", cJSON_CreateNumber(esp_get_free_heap_size()));
-    cJSON_AddItemToObject(status, "uptime", cJSON_CreateString(uptime));
-    cJSON_AddItemToObject(status, "curdate", cJSON_CreateString(curdate));
-    cJSON_AddItemToObject(status, "devicename", cJSON_CreateString(hostname));
-    cJSON_AddItemToObject(status, "version", cJSON_CreateString(version));
-    cJSON_AddItemToObject(status, "rssi", cJSON_CreateNumber(getRSSI()));
-    cJSON_AddItemToObject(status, "ethip", cJSON_CreateString(ethip));
-    cJSON_AddItemToObject(status, "wifiip", cJSON_CreateString(wifiip));        
-    *response = cJSON_Print(status);
-    free(uptime);
-    free(curdate);  
-    free(version);
-    free(ethip);
-    free(wifiip);
-    cJSON_Delete(status);
-    return ESP_OK;    
+static void writeString(jsonWriter_t *w, const char *key, char *value) {
+    // takes allocated value
+    jsonKey(w, key);
+    jsonString(w, value);
+    free(value);
 }
 
-esp_err_t getTemperatures(char **response) {    
-    *response = cJSON_Print(jTemperatures);
-    return ESP_OK;    
+static void writeDeviceInfo(jsonWriter_t *w) {
+    jsonObject(w);
+    jsonKey(w, "freememory");
+    jsonInt(w, esp_get_free_heap_size());
+    writeString(w, "uptime", getUpTime());
+    writeString(w, "curdate", getCurrentDateTime("%d.%m.%Y %H:%M:%S"));
+    writeString(w, "devicename", getNetworkConfigValueString("hostname"));
+    writeString(w, "version", getCurrentVersion());
+    jsonKey(w, "rssi");
+    jsonInt(w, getRSSI());
+    writeString(w, "ethip", getETHIPStr());
+    writeString(w, "wifiip", getWIFIIPStr());
+    jsonKey(w, "mqtt");
+    writeMQTTQueueStats(w);
+    jsonKey(w, "mqttOut");
+    writeMQTTStats(w);
+    jsonKey(w, "mqttIn");
+    writeMQTTRouterStats(w);
+    jsonKey(w, "policy");
+    writePolicyStats(w);
+    jsonKey(w, "bus");
+    writeBusStats(w);
+    jsonKey(w, "live");
+    writeLiveStats(w);
+    jsonKey(w, "transfers");
+    writeTransferStats(w);
+    jsonObjectEnd(w);
 }
 
-esp_err_t setTemperatures(char **response, char *content) {
-    cJSON *parent = cJSON_Parse(content);
-    
+static bool isSensorConfig(cJSON *item) {
+    // address is 16 hex digits of rom
+    cJSON *address = cJSON_GetObjectItem(item, "address");
+    return cJSON_IsObject(item) && cJSON_IsString(address) && (strlen(address->valuestring) == 16) &&
+           (strspn(address->valuestring, "0123456789abcdefABCDEF") == 16);
+}
+
+esp_err_t setTemperatures(char **response, cJSON *parent) {
+    cJSON *item;
     if(!cJSON_IsArray(parent)) {
         setErrorTextJson(response, "Is not a JSON array");    
         cJSON_Delete(parent);
         return ESP_FAIL;
     }       
-    cJSON_Delete(jTemperatures);
-    jTemperatures = parent;    
+    cJSON_ArrayForEach(item, parent) {
+        if (!isSensorConfig(item)) {
+            setErrorTextJson(response, "Sensor without address");
+            cJSON_Delete(parent);
+            return ESP_FAIL;
+        }
+    }
+
+    xSemaphoreTake(temperaturesLock, portMAX_DELAY);
+    replaceConfig(&jTemperatures, &retiredTemperatures, parent);
+    // names could be changed, publisher task rebuilds topics and registers sensors again
+    sensorsReset = true;
     saveTemperatures();
+    xSemaphoreGive(temperaturesLock);
+    stateChanged(STATE_SENSORS);
+    liveNotify("config", "temperatures");
     setTextJson(response, "OK");    
     return ESP_OK;
 }
 
-esp_err_t uiRouter(httpd_req_t *req) {
-    char *uri = getClearURI(req->uri);
-    char *response = NULL;
-    esp_err_t err = ESP_ERR_NOT_FOUND;
-    char *content = NULL;
-    
-    if ((!strcmp(uri, "/ui/status")) && (req->method == HTTP_GET)) {
-        httpd_resp_set_type(req, "application/json");
-        // err = getStatus(&response);            
-    } else if (!strcmp(uri, "/service/config/network")) {
-        if (req->method == HTTP_GET) {
-            httpd_resp_set_type(req, "application/json");
-            err = getNetworkConfig(&response);
-        } else if (req->method == HTTP_POST) {
-            httpd_resp_set_type(req, "application/json");
-            err = getContent(&content, req);
-            if (err == ESP_OK) {
-                err = setNetworkConfig(&response, content);    
-            }
-        }        
-    } else if ((!strcmp(uri, "/service/config/factoryReset")) && (req->method == HTTP_POST)) {
-        if (getParamValue(req, "reset") != NULL) {
-            err = setFactoryReset(&response);
-        } else {
-            err = ESP_FAIL;
-            setErrorText(&response, "No reset");            
-        }        
-    } else if ((!strcmp(uri, "/service/reboot")) && (req->method == HTTP_POST)) {
-        // TODO : create deffered task for reboot
-        if (getParamValue(req, "reboot") != NULL) {
-            ESP_LOGW(TAG, "Reebot!!!");
-            //esp_restart();
-            reboot = true;
-            setTextJson(&response, "Reboot OK");
-            err = ESP_OK;
-        } else {
-            err = ESP_FAIL;
-            setErrorText(&response, "No reboot");            
-        }        
-    } else if ((!strcmp(uri, "/service/upgrade")) && (req->method == HTTP_POST)) {
-        startOTA();        
-        setTextJson(&response, "OTA OK");
-        err = ESP_OK;        
-    } else if ((!strcmp(uri, "/ui/deviceInfo")) && (req->method == HTTP_GET)) {
-        httpd_resp_set_type(req, "application/json");
-        err = getDeviceInfo(&response); 
-    } else if ((!strcmp(uri, "/ui/feed")) && (req->method == HTTP_POST)) {
-        httpd_resp_set_type(req, "application/json");        
-//        err = feed();
-        setTextJson(&response, "Feed OK");    
-    } else if (!strcmp(uri, "/service/config/temperatures")) {
-        httpd_resp_set_type(req, "application/json");
-        if (req->method == HTTP_GET) {            
-            err = getTemperatures(&response);
-        } else if (req->method == HTTP_POST) {            
-            err = getContent(&content, req);
-            if (err == ESP_OK) {
-                err = setTemperatures(&response, content);    
-            }
-        }   
-    }
-    // check result
-    if (err == ESP_OK) {
-        httpd_resp_set_status(req, "200");        
-    } else if (err == ESP_ERR_NOT_FOUND) {
-        httpd_resp_set_status(req, "404");        
-        setErrorText(&response, "Method not found!");        
-        //httpd_resp_send(req, "Not found!"); //req->uri, strlen(req->uri));
-    } else {
-        httpd_resp_set_status(req, "400");
+esp_err_t setScheduler(char **response, cJSON *parent) {
+    cJSON *item;
+    if(!cJSON_IsArray(parent)) {
+        setErrorTextJson(response, "Is not a JSON array");    
+        cJSON_Delete(parent);
+        return ESP_FAIL;
+    }       
+    cJSON_ArrayForEach(item, parent) {
+        if (!cJSON_IsObject(item)) {
+            setErrorTextJson(response, "Schedule is not a JSON object");
+            cJSON_Delete(parent);
+            return ESP_FAIL;
+        }
     }
-    if (response != NULL) {
-        httpd_resp_send(req, response, -1);
-        free(response);
-    }   
-    if (content != NULL)
-        free(content);
-    free(uri);
 
+    xSemaphoreTake(schedulerLock, portMAX_DELAY);
+    replaceConfig(&jScheduler, &retiredScheduler, parent);
+    saveScheduler();
+    xSemaphoreGive(schedulerLock);
+    schedulerRebuild();
+    stateChanged(STATE_SCHEDULER);
+    liveNotify("config", "scheduler");
+    setTextJson(response, "OK");    
+    return ESP_OK;
+}
+
+static esp_err_t routeNetworkGet(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    jsonCJSON(w, networkConfig);
     return ESP_OK;
 }
 
-SemaphoreHandle_t getSemaphore() {
-    return sem_busy;
+static esp_err_t routeNetworkSet(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    return setNetworkConfig(response, body);
 }
 
-esp_err_t createSemaphore() {
-    sem_busy = xSemaphoreCreateMutex();
-    if (sem_busy == NULL)
+static esp_err_t routeFactoryReset(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    if (getQueryValue(query, "reset") == NULL) {
+        setErrorText(response, "No reset");
+        return ESP_FAIL;
+    }
+    return setFactoryReset(response);
+}
+
+static esp_err_t routeReboot(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    // TODO : create deffered task for reboot
+    if (getQueryValue(query, "reboot") == NULL) {
+        setErrorText(response, "No reboot");
+        return ESP_FAIL;
+    }
+    ESP_LOGW(TAG, "Reebot!!!");
+    reboot = true;
+    setTextJson(response, "Reboot OK");
+    return ESP_OK;
+}
+
+void scheduleReboot() {
+    // service task restarts in few seconds, response is sent meanwhile
+    reboot = true;
+}
+
+static esp_err_t routeOTAGet(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    writeOTAProgress(w);
+    return ESP_OK;
+}
+
+static esp_err_t routeUpgrade(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    if (startOTA(0) != ESP_OK) {
+        setErrorTextJson(response, "OTA already running");
+        return ESP_FAIL;
+    }
+    setTextJson(response, "OTA OK");
+    return ESP_OK;
+}
+
+static esp_err_t routeDeviceInfo(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    writeDeviceInfo(w);
+    return ESP_OK;
+}
+
+static esp_err_t routeFeed(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    esp_err_t err = feed("web");
+    if (err == ESP_OK)
+        setTextJson(response, "Feed OK");    
+    else
+        setErrorTextJson(response, "Feed queue is full");
+    return err;
+}
+
+static esp_err_t routeActions(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    return getActionsLog(response);
+}
+
+static esp_err_t routeBenchmark(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    const char *iterations = getQueryValue(query, "n");
+    if (mqttBenchmark(w, (iterations != NULL) && atoi(iterations) > 0 ? atoi(iterations) : 1000) != ESP_OK) {
+        // nothing is written yet, status is not sent
+        httpd_resp_set_status(req, HTTPD_400);
+        jsonObject(w);
+        jsonKey(w, "error");
+        jsonString(w, "Topic benchmark is not registered or not in mqtt latest");
+        jsonObjectEnd(w);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t routeTemperaturesGet(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    writeTemperatures(w);
+    return ESP_OK;
+}
+
+static esp_err_t routeTemperaturesSet(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    return setTemperatures(response, body);
+}
+
+static esp_err_t routeSchedulerGet(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    jsonCJSON(w, jScheduler);
+    return ESP_OK;
+}
+
+static esp_err_t routeStateGet(httpd_req_t *req, const query_t *query, jsonWriter_t *w) {
+    writeState(w);
+    return ESP_OK;
+}
+
+static esp_err_t routeSchedulerSet(httpd_req_t *req, const query_t *query, cJSON *body, char **response) {
+    return setScheduler(response, body);
+}
+
+#define JSON "application/json"
+
+// sorted by path and method
+static const route_t uiRoutes[] = {
+    {"/service/benchmark/mqtt",      HTTP_GET,  0,                              JSON, NULL, routeBenchmark},
+    {"/service/config/factoryReset", HTTP_POST, ROUTE_MUTATES,                  NULL, routeFactoryReset},
+    {"/service/config/network",      HTTP_GET,  0,                              JSON, NULL, routeNetworkGet, STATE_CONFIG},
+    {"/service/config/network",      HTTP_POST, ROUTE_MUTATES | ROUTE_CONTENT,  JSON, routeNetworkSet},
+    {"/service/config/scheduler",    HTTP_GET,  0,                              JSON, NULL, routeSchedulerGet, STATE_SCHEDULER},
+    {"/service/config/scheduler",    HTTP_POST, ROUTE_MUTATES | ROUTE_CONTENT,  JSON, routeSchedulerSet},
+    {"/service/config/temperatures", HTTP_GET,  0,                              JSON, NULL, routeTemperaturesGet, STATE_SENSORS},
+    {"/service/config/temperatures", HTTP_POST, ROUTE_MUTATES | ROUTE_CONTENT,  JSON, routeTemperaturesSet},
+    {"/service/ota",                 HTTP_GET,  0,                              JSON, NULL, routeOTAGet},
+    {"/service/reboot",              HTTP_POST, ROUTE_MUTATES,                  NULL, routeReboot},
+    {"/service/upgrade",             HTTP_POST, ROUTE_MUTATES,                  NULL, routeUpgrade},
+    {"/ui/actions",                  HTTP_GET,  0,                              JSON, routeActions},
+    {"/ui/deviceInfo",               HTTP_GET,  0,                              JSON, NULL, routeDeviceInfo},
+    {"/ui/feed",                     HTTP_POST, ROUTE_MUTATES,                  JSON, routeFeed},
+    {"/ui/state",                    HTTP_GET,  0,                              JSON, NULL, routeStateGet, STATE_ALL},
+};
+
+esp_err_t initRoutes() {
+    return registerRoutes(uiRoutes, sizeof(uiRoutes)/sizeof(uiRoutes[0]));
+}
+
+esp_err_t createLocks() {
+    // writers of config domains and network config getters
+    networkLock = xSemaphoreCreateMutex();
+    temperaturesLock = xSemaphoreCreateMutex();
+    schedulerLock = xSemaphoreCreateMutex();
+    if ((networkLock == NULL) || (temperaturesLock == NULL) || (schedulerLock == NULL))
         return ESP_FAIL;
     return ESP_OK;
 }
@@ -461,7 +665,7 @@ void serviceTask(void *pvParameter) {
         if (cnt++>=60) {
             cnt = 0;
             ESP_LOGI(TAG, "Actual free memory is %d", esp_get_free_heap_size());            
-            processScheduler();
+            mqttScheduler();
         }
         // every 1 second     
         if ((minMem > 0) && (esp_get_free_heap_size() < minMem)) {
@@ -483,171 +687,528 @@ void initServiceTask() {
     xTaskCreate(&serviceTask, "serviceTask", 4096, NULL, 5, NULL);
 }
 
-double roundF(float x) {
-    double x10 = 10.0 * x;
-    return (round(x10)/10.0);
-}
-
-void setTemperature(char* adr, float value) {  
-    char *date = getCurrentDateTime("%Y-%m-%dT%H:%M:%SZ");  
-    bool found = false;
-    float tmpValue = value;
-    char *tmpName = NULL;
-    cJSON *childTemp = jTemperatures->child;
-    while (childTemp) {
-        if (cJSON_IsString(cJSON_GetObjectItem(childTemp, "address")) &&
-            !strcmp(cJSON_GetObjectItem(childTemp, "address")->valuestring, adr)) {
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childTemp, "value"))) {
-                tmpValue = cJSON_GetObjectItem(childTemp, "address")->valuedouble;
-                tmpName = cJSON_GetObjectItem(childTemp, "name")->valuestring;
-                cJSON_ReplaceItemInObject(childTemp, "value", cJSON_CreateNumber(roundF(value)));                
-            } else {
-                cJSON_AddItemToObject(childTemp, "value", cJSON_CreateNumber(roundF(value)));
-            }
-            if (cJSON_IsString(cJSON_GetObjectItem(childTemp, "date")))
-                cJSON_ReplaceItemInObject(childTemp, "date", cJSON_CreateString(date));
-            else
-                cJSON_AddItemToObject(childTemp, "date", cJSON_CreateString(date));
-            found = true;
-            break;                
+static void addressFromRom(uint64_t rom, char *adr) {
+    // same as owb_string_from_rom_code
+    sprintf(adr, "%016llx", rom);
+}
+
+static void getTempValues(tempValues_t *values) {
+    uint32_t seq;
+    do {
+        seq = seqlockReadBegin(&tempValuesLock);
+        memcpy(values, &tempValues, sizeof(tempValues_t));
+    } while (seqlockReadRetry(&tempValuesLock, seq));
+}
+
+static cJSON *findSensorConfig(cJSON *config, uint64_t rom, uint8_t *pos) {
+    char adr[17];
+    addressFromRom(rom, adr);
+    cJSON *item;
+    *pos = 0;
+    cJSON_ArrayForEach(item, config) {
+        if (cJSON_IsString(cJSON_GetObjectItem(item, "address")) &&
+            !strcmp(cJSON_GetObjectItem(item, "address")->valuestring, adr))
+            return item;
+        (*pos)++;
+    }
+    return NULL;
+}
+
+static bool getSensorId(cJSON *config, const tempValues_t *values, uint64_t rom, uint8_t *id) {
+    // position in config, sensors missing in config follow it in order of appearance
+    uint8_t pos;
+    if (findSensorConfig(config, rom, id) != NULL)
+        return true;
+    for (uint8_t i=0; i<values->qty; i++) {
+        if (values->items[i].rom == rom)
+            return true;
+        if (findSensorConfig(config, values->items[i].rom, &pos) == NULL)
+            (*id)++;
+    }
+    return false;
+}
+
+static sensor_t *getSensor(uint64_t rom) {
+    for (uint8_t i=0; i<sensorsQty; i++) {
+        if (sensors[i].rom == rom)
+            return &sensors[i];
+    }
+    if (sensorsQty >= MAX_SENSORS)
+        return NULL;
+    // new sensor, take name and deadband from config
+    tempValues_t values;
+    uint8_t id, pos;
+    char adr[17];
+    getTempValues(&values);
+    xSemaphoreTake(temperaturesLock, portMAX_DELAY);
+    cJSON *config = jTemperatures;
+    if (!getSensorId(config, &values, rom, &id)) {
+        xSemaphoreGive(temperaturesLock);
+        return NULL;
+    }
+    addressFromRom(rom, adr);
+    cJSON *item = findSensorConfig(config, rom, &pos);
+    const char *name = cJSON_IsString(cJSON_GetObjectItem(item, "name")) ? cJSON_GetObjectItem(item, "name")->valuestring : adr;
+    sensor_t *sensor = &sensors[sensorsQty];
+    memset(sensor, 0, sizeof(sensor_t));
+    sensor->rom = rom;
+    sensor->id = id;
+    sensor->topic = topicRegister("temperature/", name);
+    policyStateInit(&sensor->policy);
+    // degrees in config, overrides policy deadband
+    if (cJSON_IsNumber(cJSON_GetObjectItem(item, "deadband")))
+        sensor->policy.deadband = lround(cJSON_GetObjectItem(item, "deadband")->valuedouble * 10);
+    xSemaphoreGive(temperaturesLock);
+    sensorsQty++;
+    return sensor;
+}
+
+static void updateSnapshot(const reading_t *reading) {
+    uint8_t i;
+    for (i=0; i<tempValues.qty; i++) {
+        if (tempValues.items[i].rom == reading->id)
+            break;
+    }
+    if (i >= MAX_SENSORS)
+        return;
+    seqlockWriteBegin(&tempValuesLock);
+    tempValues.items[i].rom = reading->id;
+    tempValues.items[i].value = reading->value;
+    tempValues.items[i].time = reading->time;
+    if (i == tempValues.qty)
+        tempValues.qty++;
+    seqlockWriteEnd(&tempValuesLock);
+}
+
+static void writeTempValue(jsonWriter_t *w, const tempValue_t *value) {
+    char date[21];
+    struct tm timeinfo;
+    time_t valueTime = value->time;
+    localtime_r(&valueTime, &timeinfo);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &timeinfo);
+    jsonKey(w, "value");
+    jsonFixed(w, value->value, 1);
+    jsonKey(w, "date");
+    jsonString(w, date);
+}
+
+static void writeTemperatures(jsonWriter_t *w) {
+    // temperatures config with last values, for web and mqtt
+    tempValues_t values;
+    char adr[17];
+    uint8_t pos;
+    getTempValues(&values);
+    xSemaphoreTake(temperaturesLock, portMAX_DELAY);
+    cJSON *config = jTemperatures;
+    jsonArray(w);
+    cJSON *item;
+    cJSON_ArrayForEach(item, config) {
+        const tempValue_t *value = NULL;
+        for (uint8_t i=0; i<values.qty; i++) {
+            addressFromRom(values.items[i].rom, adr);
+            if (cJSON_IsString(cJSON_GetObjectItem(item, "address")) &&
+                !strcmp(cJSON_GetObjectItem(item, "address")->valuestring, adr))
+                value = &values.items[i];
+        }
+        jsonObject(w);
+        cJSON *field;
+        cJSON_ArrayForEach(field, item) {
+            if ((value != NULL) && (!strcmp(field->string, "value") || !strcmp(field->string, "date")))
+                continue;
+            jsonKey(w, field->string);
+            jsonCJSON(w, field);
         }
-        childTemp = childTemp->next;
+        if (value != NULL)
+            writeTempValue(w, value);
+        jsonObjectEnd(w);
     }
-    if (!found) {
-        // add new item
-        cJSON *newItem = cJSON_CreateObject();
-        cJSON_AddItemToObject(newItem, "date", cJSON_CreateString(date));
-        cJSON_AddItemToObject(newItem, "value", cJSON_CreateNumber(roundF(value)));
-        cJSON_AddItemToObject(newItem, "address", cJSON_CreateString(adr));
-        cJSON_AddItemToObject(newItem, "name", cJSON_CreateString(adr));
-        cJSON_AddItemToArray(jTemperatures, newItem);
-        //tmpName = adr;
+    // sensors missing in config
+    for (uint8_t i=0; i<values.qty; i++) {
+        if (findSensorConfig(config, values.items[i].rom, &pos) != NULL)
+            continue;
+        addressFromRom(values.items[i].rom, adr);
+        jsonObject(w);
+        jsonKey(w, "address");
+        jsonString(w, adr);
+        jsonKey(w, "name");
+        jsonString(w, adr);
+        writeTempValue(w, &values.items[i]);
+        jsonObjectEnd(w);
+    }
+    jsonArrayEnd(w);
+    xSemaphoreGive(temperaturesLock);
+}
+
+static void publishTemperature(const reading_t *reading) {
+    sensor_t *sensor = getSensor(reading->id);
+    if ((sensor == NULL) || !policyCheck(&temperaturePolicy, &sensor->policy, reading->value))
+        return;
+    sensor->version++;
+    // in batch mode changes go with the next delta message
+    if (!getNetworkConfigValueBool2("temperature", "batch") && (sensor->topic != TOPIC_NONE))
+        mqttPublishFixed(MQTT_STATE, sensor->topic, reading->value, 1);
+}
+
+/*
+    CBOR payloads, schema 1. Keys are integers
+    info:         {0: 1, 1: epoch, 2: uptime sec, 3: free memory, 4: rssi, 5: version}
+    temperatures: {0: 1, 1: epoch, 2: [[sensor id, value * 10], ...]}
+    sensor id is position of sensor in temperatures config
+*/
+#define CBOR_SCHEMA     1
+
+static size_t encodeInfoCBOR(uint8_t *buf, size_t size) {
+    cborWriter_t w;
+    char *version = getCurrentVersion();
+    cborInit(&w, buf, size);
+    cborMap(&w, 6);
+    cborUint(&w, 0);
+    cborUint(&w, CBOR_SCHEMA);
+    cborUint(&w, 1);
+    cborUint(&w, time(NULL));
+    cborUint(&w, 2);
+    cborUint(&w, esp_timer_get_time() / 1000000);
+    cborUint(&w, 3);
+    cborUint(&w, esp_get_free_heap_size());
+    cborUint(&w, 4);
+    cborInt(&w, getRSSI());
+    cborUint(&w, 5);
+    cborText(&w, version != NULL ? version : "");
+    free(version);
+    return cborOverflow(&w) ? 0 : w.len;
+}
+
+static size_t encodeTemperaturesCBOR(uint8_t *buf, size_t size) {
+    cborWriter_t w;
+    tempValues_t values;
+    uint8_t id;
+    getTempValues(&values);
+    cborInit(&w, buf, size);
+    cborMap(&w, 3);
+    cborUint(&w, 0);
+    cborUint(&w, CBOR_SCHEMA);
+    cborUint(&w, 1);
+    cborUint(&w, time(NULL));
+    cborUint(&w, 2);
+    cborArray(&w, values.qty);
+    xSemaphoreTake(temperaturesLock, portMAX_DELAY);
+    for (uint8_t i=0; i<values.qty; i++) {
+        getSensorId(jTemperatures, &values, values.items[i].rom, &id);
+        cborArray(&w, 2);
+        cborUint(&w, id);
+        cborInt(&w, values.items[i].value);
     }
-    free(date);
+    xSemaphoreGive(temperaturesLock);
+    return cborOverflow(&w) ? 0 : w.len;
+}
+
+void initTemperaturePolicy() {
+    policyInit(&temperaturePolicy, "temperature", 10, 0);
+}
 
-    // if changed publish
-    if (tmpValue != value && tmpName != NULL) {
-        char topic[100];
-        strcpy(topic, getNetworkConfigValueString("hostname"));
-        strcat(topic, "/temperature/");
-        strcat(topic, tmpName);
-        mqttPublishF(topic, value);        
+static size_t encodeBatch(bool cbor, bool keyframe, uint32_t seq, uint8_t *buf, size_t size) {
+    // changed sensors only, or all for keyframe
+    //   cbor: {0: 1, 1: epoch, 2: [[sensor id, value * 10], ...], 3: seq, 4: keyframe}
+    //   json: {"seq":1,"key":true,"time":epoch,"t":[[sensor id,21.5],...]}
+    uint8_t qty = 0;
+    for (uint8_t i=0; i<sensorsQty; i++) {
+        if (keyframe || (sensors[i].version != sensors[i].sentVersion))
+            qty++;
     }
+    if (!keyframe && (qty == 0))
+        return 0;
+    cborWriter_t w;
+    jsonWriter_t jw;
+    if (cbor) {
+        cborInit(&w, buf, size);
+        cborMap(&w, 5);
+        cborUint(&w, 0);
+        cborUint(&w, CBOR_SCHEMA);
+        cborUint(&w, 1);
+        cborUint(&w, time(NULL));
+        cborUint(&w, 3);
+        cborUint(&w, seq);
+        cborUint(&w, 4);
+        cborBool(&w, keyframe);
+        cborUint(&w, 2);
+        cborArray(&w, qty);
+    } else {
+        jsonInit(&jw, (char*)buf, size, NULL, NULL);
+        jsonObject(&jw);
+        jsonKey(&jw, "seq");
+        jsonInt(&jw, seq);
+        jsonKey(&jw, "key");
+        jsonBool(&jw, keyframe);
+        jsonKey(&jw, "time");
+        jsonInt(&jw, time(NULL));
+        jsonKey(&jw, "t");
+        jsonArray(&jw);
+    }
+    for (uint8_t i=0; i<sensorsQty; i++) {
+        sensor_t *sensor = &sensors[i];
+        if (!keyframe && (sensor->version == sensor->sentVersion))
+            continue;
+        if (cbor) {
+            cborArray(&w, 2);
+            cborUint(&w, sensor->id);
+            cborInt(&w, sensor->policy.value);
+        } else {
+            jsonArray(&jw);
+            jsonInt(&jw, sensor->id);
+            jsonFixed(&jw, sensor->policy.value, 1);
+            jsonArrayEnd(&jw);
+        }
+    }
+    if (cbor)
+        return cborOverflow(&w) ? 0 : w.len;
+    jsonArrayEnd(&jw);
+    jsonObjectEnd(&jw);
+    return jsonFinish(&jw) == ESP_OK ? jw.len : 0;
 }
 
-void mqttScheduler(uint16_t curTime) {
+void publishTemperatureBatch() {
+    // called by temperature task after every sampling cycle. Keyframe is due by cycles, not by messages:
+    // empty deltas are not sent. Keyframes and deltas share one lane, delta never overtakes its keyframe
+    static uint32_t seq = 0;
+    static uint32_t sinceKeyframe = UINT16_MAX;   // first cycle sends keyframe
+    static uint8_t buf[512];
+    if (!getNetworkConfigValueBool2("temperature", "batch") || !getNetworkConfigValueBool2("mqtt", "enabled"))
+        return;
+    uint16_t keyframe = getNetworkConfigValueInt2("temperature", "keyframe");
+    if (keyframe == 0)
+        keyframe = DEF_KEYFRAME;
+    sinceKeyframe++;
+    bool isKeyframe = sinceKeyframe >= keyframe;
+    size_t len = encodeBatch(mqttClassFormat(MQTT_STATE) == MQTT_FORMAT_CBOR, isKeyframe, seq, buf, sizeof(buf));
+    if (len == 0)
+        return;
+    if (mqttPublishTopic(MQTT_STATE, isKeyframe ? TOPIC_TEMPERATURES : TOPIC_TEMPERATURES_DELTA, (char*)buf, len) != ESP_OK)
+        return;
+    for (uint8_t i=0; i<sensorsQty; i++)
+        sensors[i].sentVersion = sensors[i].version;
+    if (isKeyframe)
+        sinceKeyframe = 0;
+    seq++;
+}
+
+void mqttScheduler() {
     // Раз в минуту отправлять статус в MQTT?
-    // static uint16_t lastSchedulerTime = 0;
     if (!getNetworkConfigValueBool2("mqtt", "enabled")) {
         return;
     }
-    // general info publish
-    char topic[100];
-    char* info;
-    esp_err_t err = getDeviceInfo(&info);    
-    if (err == ESP_OK) {
-        strcpy(topic, getNetworkConfigValueString("hostname"));
-        strcat(topic, "/info\0");
-        mqttPublish(topic, info);
-        free(info);
+    if (mqttClassFormat(MQTT_BULK) == MQTT_FORMAT_CBOR) {
+        static uint8_t buf[512];
+        size_t len = encodeInfoCBOR(buf, sizeof(buf));
+        if (len > 0)
+            mqttPublishTopic(MQTT_BULK, TOPIC_INFO, (char*)buf, len);
+        // in batch mode temperatures are sent as keyframes
+        if (getNetworkConfigValueBool2("temperature", "batch"))
+            return;
+        len = encodeTemperaturesCBOR(buf, sizeof(buf));
+        if (len > 0)
+            mqttPublishTopic(MQTT_BULK, TOPIC_TEMPERATURES, (char*)buf, len);
+        else
+            ESP_LOGE(TAG, "Temperatures don't fit CBOR buffer");
+        return;
     }
+    // general info publish
+    static char payload[MQTT_JSON_SIZE];
+    jsonWriter_t w;
+    jsonInit(&w, payload, sizeof(payload), NULL, NULL);
+    writeDeviceInfo(&w);
+    if (jsonFinish(&w) == ESP_OK)
+        mqttPublishTopic(MQTT_BULK, TOPIC_INFO, payload, w.len);
+    else
+        ESP_LOGE(TAG, "Info doesn't fit MQTT payload");
     // temperatures publish
-    char *temp = cJSON_PrintUnformatted(jTemperatures);        
-    strcpy(topic, getNetworkConfigValueString("hostname"));
-    strcat(topic, "/temperatures");
-    mqttPublish(topic, temp);
-    free(temp);
-}
-
-void initScheduler() {
-    ESP_LOGI(TAG, "Initiating scheduler");
-    // сбрасываем у всех задач признак выполнения
-    cJSON *childTask = jScheduler->child;
-    while (childTask) {       
-        if (cJSON_IsBool(cJSON_GetObjectItem(childTask, "done")))
-            cJSON_ReplaceItemInObject(childTask, "done", cJSON_CreateFalse());
-        else
-            cJSON_AddItemToObject(childTask, "done", cJSON_CreateFalse());        
-        if (!cJSON_IsString(cJSON_GetObjectItem(childTask, "name"))) {
-            cJSON_AddItemToObject(childTask, "name", cJSON_CreateString("Noname task"));        
+    if (getNetworkConfigValueBool2("temperature", "batch"))
+        return;
+    jsonInit(&w, payload, sizeof(payload), NULL, NULL);
+    writeTemperatures(&w);
+    if (jsonFinish(&w) == ESP_OK)
+        mqttPublishTopic(MQTT_BULK, TOPIC_TEMPERATURES, payload, w.len);
+    else
+        ESP_LOGE(TAG, "Temperatures don't fit MQTT payload");
+}
+
+static void publishPressure(const reading_t *reading, policyState_t *state) {
+    static bool pl = false, ph = false;
+    uint16_t minPressure = getNetworkConfigValueInt2("adc", "min");
+    uint16_t maxPressure = getNetworkConfigValueInt2("adc", "max");
+    if (policyCheck(&pressurePolicy, state, reading->value))
+        mqttPublishFixed(MQTT_STATE, TOPIC_PRESSURE, reading->value * 10, 1);
+    if (reading->value < minPressure) {
+        if (!pl) {
+            mqttPublishTopic(MQTT_ALARM, TOPIC_PRESSURE_TEXT, "low", 3);
+            pl = true;
+        }
+    } else {
+        pl = false;
+    }
+    if (reading->value > maxPressure) {
+        if (!ph) {
+            mqttPublishTopic(MQTT_ALARM, TOPIC_PRESSURE_TEXT, "high", 4);
+            ph = true;
+        }
+    } else {
+        ph = false;
+    }
+}
+
+static void publishWater(const reading_t *reading, policyState_t *state) {
+    if (!policyCheck(&waterPolicy, state, reading->value))
+        return;
+    char *cValue;
+    ESP_LOGI(TAG, "water new value %d", reading->value);
+    switch (reading->value) {
+        case 0:
+            cValue = "Full";
+            break; 
+        case 1:
+            cValue = "Half";
+            break; 
+        case 3:
+            cValue = "Low";
+            break; 
+        case 7:
+            cValue = "Empty";
+            break;    
+        default:
+            cValue = "Error";
+            break;             
+    }
+    mqttPublishTopic(reading->value == 7 ? MQTT_ALARM : MQTT_STATE, TOPIC_WATER, cValue, strlen(cValue));
+}
+
+static void publisherTask(void *pvParameter) {
+    // readings to mqtt through publish policies
+    reading_t reading;
+    policyState_t pressure, water;
+    policyStateInit(&pressure);
+    policyStateInit(&water);
+    while (1) {
+        if (!busReceive(publisherSub, &reading, portMAX_DELAY))
+            continue;
+        if (sensorsReset) {
+            // sensor topics are dropped by rebuild, sensors register them on next reading
+            sensorsReset = false;
+            topicsRebuild();
+            sensorsQty = 0;
         }
-        if (!cJSON_IsBool(cJSON_GetObjectItem(childTask, "enabled")))            
-            cJSON_AddItemToObject(childTask, "enabled", cJSON_CreateFalse());        
-        childTask = childTask->next;    
-    }
-}
-
-void processScheduler() {
-    // run minutely    
-    time_t rawtime;
-    struct tm *info;
-    time(&rawtime);
-    info = localtime(&rawtime);
-    uint16_t currentTime = info->tm_hour*60 + info->tm_min;
-    uint16_t grace = 0; // период, в который еще можно запустить задачу
-    static uint16_t lastSchedulerTime = 0;
-    ESP_LOGI(TAG, "Scheduler time %d. Day of week %d", currentTime, info->tm_wday);
-    if (currentTime < lastSchedulerTime) {        
-        // когда перевалит за 0.00
-        initScheduler();
-    }
-    lastSchedulerTime = currentTime;
-    // currentTime - minutes from 0.00
-    // пройти все задачи, время которых еще не настало отметить как done = false
-    // время которых прошло или наступило проверить на грейс период, по умолчанию он 5 мин
-    // если задача со статусом done = false - выполнить ее и пометить как выполненная
-    cJSON *childTask = jScheduler->child;
-    while (childTask) {       
-        ESP_LOGD(TAG, "Scheduler task %s done is %d", 
-                 cJSON_GetObjectItem(childTask, "name")->valuestring, cJSON_IsTrue(cJSON_GetObjectItem(childTask, "done")));
-        if (cJSON_IsTrue(cJSON_GetObjectItem(childTask, "enabled")) &&
-            cJSON_IsNumber(cJSON_GetObjectItem(childTask, "time")) &&
-            (currentTime >= cJSON_GetObjectItem(childTask, "time")->valueint) &&
-            !cJSON_IsTrue(cJSON_GetObjectItem(childTask, "done"))) {
-            ESP_LOGD(TAG, "Scheduler inside loop");
-            // если время настало
-            // не будет работать в 0.00
-            if (cJSON_IsNumber(cJSON_GetObjectItem(childTask, "grace")))
-                grace = cJSON_GetObjectItem(childTask, "grace")->valueint;
-            else
-                grace = 1; // default grace time
-            ESP_LOGD(TAG, "Scheduler task %s, time %d, grace %d",
-                     cJSON_GetObjectItem(childTask, "name")->valuestring,
-                     cJSON_GetObjectItem(childTask, "time")->valueint,
-                     grace);
-            // day of week
-            if (cJSON_IsArray(cJSON_GetObjectItem(childTask, "dow"))) {
-                // есть дни недели
-                ESP_LOGD(TAG, "dow exists");
-                bool taskDow = false;
-                cJSON *iterator = NULL;    
-                cJSON_ArrayForEach(iterator, cJSON_GetObjectItem(childTask, "dow")) {
-                    if (cJSON_IsNumber(iterator)) {
-                        if (iterator->valueint == info->tm_wday) {
-                            taskDow = true;
-                            break;
-                        }                        
-                    }       
-                } 
-                if (!taskDow) {
-                    ESP_LOGD(TAG, "task %s dow not today", cJSON_GetObjectItem(childTask, "name")->valuestring);
-                    childTask = childTask->next; 
-                    continue;
-                }
-                ESP_LOGD(TAG, "task %s dow today, processing task...", cJSON_GetObjectItem(childTask, "name")->valuestring);
+        if (reading.quality == READING_GOOD) {
+            switch (reading.kind) {
+                case READING_TEMPERATURE:
+                    publishTemperature(&reading);
+                    break;
+                case READING_PRESSURE:
+                    publishPressure(&reading, &pressure);
+                    break;
+                case READING_WATER:
+                    publishWater(&reading, &water);
+                    break;
             }
-            if (currentTime - cJSON_GetObjectItem(childTask, "time")->valueint <= grace) {
-                // выполнить задачу
-                // получить действия
-                ESP_LOGD(TAG, "Scheduler. Task %s. Processing actions...",
-                         cJSON_GetObjectItem(childTask, "name")->valuestring);
-                
-                cJSON_ReplaceItemInObject(childTask, "done", cJSON_CreateTrue());                
-            }            
         }
-        childTask = childTask->next;    
+        if ((reading.kind == READING_TEMPERATURE) && (reading.flags & READING_CYCLE_END))
+            publishTemperatureBatch();
+    }
+}
+
+static void updateLevel(levelValue_t *level, const reading_t *reading, uint8_t domain) {
+    // version changes with value only
+    if (level->valid && (level->value == reading->value))
+        return;
+    seqlockWriteBegin(&levelsLock);
+    level->value = reading->value;
+    level->time = reading->time;
+    level->decimals = reading->decimals;
+    level->valid = true;
+    seqlockWriteEnd(&levelsLock);
+    stateChanged(domain);
+}
+
+static void snapshotTask(void *pvParameter) {
+    reading_t reading;
+    while (1) {
+        if (!busReceive(snapshotSub, &reading, portMAX_DELAY))
+            continue;
+        if (reading.quality == READING_GOOD) {
+            switch (reading.kind) {
+                case READING_TEMPERATURE:
+                    updateSnapshot(&reading);
+                    break;
+                case READING_PRESSURE:
+                    updateLevel(&pressureLevel, &reading, STATE_PRESSURE);
+                    break;
+                case READING_WATER:
+                    updateLevel(&waterLevel, &reading, STATE_WATER);
+                    break;
+            }
+        }
+        // temperatures get new version once per sampling cycle
+        if ((reading.kind == READING_TEMPERATURE) && (reading.flags & READING_CYCLE_END))
+            stateChanged(STATE_SENSORS);
+    }
+}
+
+static void writeLevel(jsonWriter_t *w, const char *key, const levelValue_t *level) {
+    char date[21];
+    struct tm timeinfo;
+    time_t levelTime = level->time;
+    jsonKey(w, key);
+    if (!level->valid) {
+        jsonNull(w);
+        return;
+    }
+    localtime_r(&levelTime, &timeinfo);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &timeinfo);
+    jsonObject(w);
+    jsonKey(w, "value");
+    jsonFixed(w, level->value, level->decimals);
+    jsonKey(w, "date");
+    jsonString(w, date);
+    jsonObjectEnd(w);
+}
+
+static void writeState(jsonWriter_t *w) {
+    levelValue_t water, pressure;
+    uint32_t seq;
+    do {
+        seq = seqlockReadBegin(&levelsLock);
+        water = waterLevel;
+        pressure = pressureLevel;
+    } while (seqlockReadRetry(&levelsLock, seq));
+    jsonObject(w);
+    jsonKey(w, "versions");
+    writeStateVersions(w);
+    writeLevel(w, "water", &water);
+    writeLevel(w, "pressure", &pressure);
+    jsonObjectEnd(w);
+}
+
+static void loggerTask(void *pvParameter) {
+    reading_t reading;
+    while (1) {
+        if (busReceive(loggerSub, &reading, portMAX_DELAY))
+            ESP_LOGI(TAG, "Reading kind %d id %016llx value %d/10^%d quality %d", reading.kind,
+                     reading.id, reading.value, reading.decimals, reading.quality);
+    }
+}
+
+void initReadings() {
+    // subscribers of sensor readings, before sensor tasks
+    if (getNetworkConfigValueBool2("mqtt", "enabled")) {
+        publisherSub = busSubscribe("mqtt", 16, BUS_DROP_OLDEST);
+        if (publisherSub != NULL)
+            xTaskCreate(&publisherTask, "publisherTask", 4096, NULL, 5, NULL);
+    }
+    snapshotSub = busSubscribe("snapshot", 16, BUS_DROP_OLDEST);
+    if (snapshotSub != NULL)
+        xTaskCreate(&snapshotTask, "snapshotTask", 3072, NULL, 5, NULL);
+    if (getNetworkConfigValueBool2("bus", "log")) {
+        loggerSub = busSubscribe("logger", 8, BUS_DROP_NEWEST);
+        if (loggerSub != NULL)
+            xTaskCreate(&loggerTask, "loggerTask", 3072, NULL, 4, NULL);
     }
-    mqttScheduler(currentTime);
 }
 
 void initIOasInput(uint8_t gpio) {
@@ -661,48 +1222,18 @@ void ADCTask(void *pvParameter) {
     adc1_config_width(ADC_WIDTH_BIT_12);
     adc1_config_channel_atten(ADC1_CHANNEL_0, ADC_ATTEN_DB_0);
     
-    uint16_t oldValue = 0;
-    uint8_t delta = getNetworkConfigValueInt2("adc", "delta");
-    uint16_t minPressure = getNetworkConfigValueInt2("adc", "min");
-    uint16_t maxPressure = getNetworkConfigValueInt2("adc", "max");
     uint16_t period = getNetworkConfigValueInt2("adc", "period");
     if (period == 0) 
         period = 5000;
-    char topic[100];
-    ESP_LOGI(TAG, "ADC delta %d, min %d, max %d", delta, minPressure, maxPressure);
-    bool pl = false, ph = false;
     while (1) {
         uint32_t adc_value = adc1_get_raw(ADC1_CHANNEL_0);
         printf("ADC Value: %d\n", adc_value);
-
-        if (abs(adc_value - oldValue) > delta) {
-            oldValue = adc_value;            
-            strcpy(topic, getNetworkConfigValueString("hostname"));
-            strcat(topic, "/pressure");
-            mqttPublishF(topic, adc_value);            
-        }
-
-        if (adc_value < minPressure) {
-            if (!pl) {
-                strcpy(topic, getNetworkConfigValueString("hostname"));
-                strcat(topic, "/pressureText");
-                mqttPublish(topic, "low");
-                pl = true;
-            }
-        } else {
-            pl = false;
-        }
-
-        if (adc_value > maxPressure) {
-            if (!ph) {
-                strcpy(topic, getNetworkConfigValueString("hostname"));
-                strcat(topic, "/pressureText");
-                mqttPublish(topic, "high");
-                ph = true;
-            }
-        } else {
-            ph = false;
-        }
+        reading_t reading = {
+            .kind = READING_PRESSURE,
+            .value = adc_value,
+            .time = time(NULL)
+        };
+        busPublish(&reading);
 
         vTaskDelay(period * 1000 / portTICK_RATE_MS);
 
@@ -728,6 +1259,8 @@ void ADCTask(void *pvParameter) {
 }
     
 void initADC() {
+    // adc.delta is the legacy deadband
+    policyInit(&pressurePolicy, "pressure", 1, getNetworkConfigValueInt2("adc", "delta"));
     xTaskCreate(&ADCTask, "ADCTask", 4096, NULL, 5, NULL);
 }    
 
@@ -748,45 +1281,22 @@ void waterTask(void *pvParameter) {
     initIOasInput(WS_2);
     initIOasInput(WS_3);
 
-    uint8_t oldValue = 0;
-
     while (1) {
         uint8_t value = gpio_get_level(WS_1);
         value |= gpio_get_level(WS_2) << 1;
         value |= gpio_get_level(WS_3) << 2;
-        
-        if (oldValue != value) {
-            oldValue = value;
-            char topic[100];
-            char *cValue;
-            ESP_LOGI(TAG, "water new value %d", value);
-            switch (value) {
-                case 0:
-                    cValue = "Full";
-                    break; 
-                case 1:
-                    cValue = "Half";
-                    break; 
-                case 3:
-                    cValue = "Low";
-                    break; 
-                case 7:
-                    cValue = "Empty";
-                    break;    
-                default:
-                    cValue = "Error";
-                    break;             
-            }
-            strcpy(topic, getNetworkConfigValueString("hostname"));
-            strcat(topic, "/water");
-            mqttPublish(topic, cValue);
-            //free(cValue);
-        }
+        reading_t reading = {
+            .kind = READING_WATER,
+            .value = value,
+            .time = time(NULL)
+        };
+        busPublish(&reading);
         vTaskDelay(10000 / portTICK_RATE_MS);
     }
     
 }
 
 void initWater() {
+    policyInit(&waterPolicy, "water", 1, 0);
     xTaskCreate(&waterTask, "waterTask", 4096, NULL, 5, NULL);
 }  
\ No newline at end of file
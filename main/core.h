@@ -1,24 +1,31 @@
 //core.h
 #include "webServer.h"
 #include "freertos/semphr.h"
+#include "cJSON.h"
 
 esp_err_t loadConfig();
 
+// network config getters lock the tree, strings and cJSON items are copies the caller frees
 uint16_t getNetworkConfigValueInt(const char* name);
 uint16_t getNetworkConfigValueInt2(const char* parentName, const char* name);
 bool getNetworkConfigValueBool(const char* name);
 bool getNetworkConfigValueBool2(const char* parentName, const char* name);
 char *getNetworkConfigValueString(const char* name);
 char *getNetworkConfigValueString2(const char* parentName, const char* name);
+cJSON *getNetworkConfigValueArray2(const char* parentName, const char* name);
+cJSON *getNetworkConfigValueObject2(const char* parentName, const char* name);
 
-esp_err_t uiRouter(httpd_req_t *req);
+esp_err_t initRoutes();
 bool isReboot();
+void scheduleReboot();
 
-SemaphoreHandle_t getSemaphore();
-esp_err_t createSemaphore();
+esp_err_t createLocks();
 
 void initServiceTask();
-void setTemperature(char* adr, float value);
+void initReadings();
+void publishTemperatureBatch();
+void initTemperaturePolicy();
 void initWater();
 void initADC();
-void initScheduler();
\ No newline at end of file
+cJSON *lockSchedulerConfig();
+void unlockSchedulerConfig();
\ No newline at end of file
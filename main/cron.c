@@ -0,0 +1,206 @@
+//cron.c
+// fields: minute hour day-of-month month day-of-week
+// each field supports * n a-b */s a-b/s n/s and lists a,b,c
+// day-of-week also supports d#n - n-th weekday of month, "1#1" first monday
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "cron.h"
+
+static const char *TAG = "CRON";
+
+#define MAX_SEARCH_DAYS (366 * 5) // enough for 29 of february
+
+static const char *parseNumber(const char *p, int *val) {
+    if (!isdigit((unsigned char)*p))
+        return NULL;
+    *val = 0;
+    while (isdigit((unsigned char)*p)) {
+        *val = *val * 10 + (*p - '0');
+        p++;
+    }
+    return p;
+}
+
+static esp_err_t parseField(const char *p, uint8_t min, uint8_t max, uint64_t *bits, bool *any, uint8_t *nth) {
+    // one field up to space, nth gets weeks of every value in the field
+    *bits = 0;
+    *any = false;
+    while (*p && *p != ' ') {
+        int from, to, step = 1;
+        uint8_t weeks = CRON_WEEK_ANY;
+        if (*p == '*') {
+            from = min;
+            to = max;
+            p++;
+            if (*p != '/')
+                *any = true;
+        } else {
+            p = parseNumber(p, &from);
+            if (p == NULL)
+                return ESP_FAIL;
+            to = from;
+            if (*p == '-') {
+                p = parseNumber(p + 1, &to);
+                if (p == NULL)
+                    return ESP_FAIL;
+            } else if (*p == '/') {
+                to = max;
+            }
+        }
+        if (*p == '/') {
+            p = parseNumber(p + 1, &step);
+            if ((p == NULL) || (step == 0))
+                return ESP_FAIL;
+        }
+        if (*p == '#') {
+            int n;
+            if (nth == NULL)
+                return ESP_FAIL;
+            p = parseNumber(p + 1, &n);
+            if ((p == NULL) || (n < 1) || (n > 5))
+                return ESP_FAIL;
+            weeks = 1 << n;
+        }
+        if ((from < min) || (to > max) || (from > to))
+            return ESP_FAIL;
+        for (int i=from; i<=to; i+=step) {
+            *bits |= 1ULL << i;
+            if (nth != NULL)
+                nth[i] |= weeks;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p && *p != ' ')
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t cronParse(const char *expr, cron_t *cron) {
+    const uint8_t mins[] = {0, 0, 1, 1, 0};
+    const uint8_t maxs[] = {59, 23, 31, 12, 7};
+    uint64_t bits[5];
+    bool any[5];
+    uint8_t nth[8] = {0};
+    memset(cron, 0, sizeof(cron_t));
+    const char *p = expr;
+    for (uint8_t i=0; i<5; i++) {
+        while (*p == ' ')
+            p++;
+        if ((*p == 0) || (parseField(p, mins[i], maxs[i], &bits[i], &any[i], i == 4 ? nth : NULL) != ESP_OK)) {
+            ESP_LOGE(TAG, "Wrong cron expression \"%s\" at field %d", expr, i + 1);
+            return ESP_FAIL;
+        }
+        while (*p && *p != ' ')
+            p++;
+    }
+    while (*p == ' ')
+        p++;
+    if (*p) {
+        ESP_LOGE(TAG, "Wrong cron expression \"%s\"", expr);
+        return ESP_FAIL;
+    }
+    cron->minute = bits[0];
+    cron->hour = bits[1];
+    cron->dom = bits[2];
+    cron->month = bits[3];
+    // 7 is sunday too
+    cron->dow = (bits[4] | (bits[4] >> 7)) & 0x7F;
+    for (uint8_t i=0; i<7; i++)
+        cron->nth[i] = nth[i] | (i == 0 ? nth[7] : 0);
+    if (any[2])
+        cron->flags |= CRON_DOM_ANY;
+    if (any[4])
+        cron->flags |= CRON_DOW_ANY;
+    return ESP_OK;
+}
+
+void cronFromTime(cron_t *cron, uint8_t hour, uint8_t min, uint8_t dow) {
+    // legacy scheduler task, time of day and days of week
+    memset(cron, 0, sizeof(cron_t));
+    cron->minute = 1ULL << min;
+    cron->hour = 1UL << hour;
+    cron->dom = 0xFFFFFFFE;
+    cron->month = 0x1FFE;
+    cron->dow = dow;
+    cron->flags = CRON_DOM_ANY;
+    if (dow == 0x7F)
+        cron->flags |= CRON_DOW_ANY;
+}
+
+static int nextBit(uint64_t bits, int from, int max) {
+    // first set bit >= from, -1 if none
+    if (from > max)
+        return -1;
+    bits &= ~0ULL << from;
+    if (bits == 0)
+        return -1;
+    int res = __builtin_ctzll(bits);
+    return res <= max ? res : -1;
+}
+
+static bool isDayMatch(const cron_t *cron, const struct tm *t) {
+    bool dom = (cron->dom >> t->tm_mday) & 1;
+    bool dow = ((cron->dow >> t->tm_wday) & 1) &&
+               ((cron->nth[t->tm_wday] == 0) || ((cron->nth[t->tm_wday] >> ((t->tm_mday - 1) / 7 + 1)) & 1));
+    // like vixie cron, if both fields are restricted either of them matches
+    if ((cron->flags & CRON_DOM_ANY) && (cron->flags & CRON_DOW_ANY))
+        return true;
+    if (cron->flags & CRON_DOM_ANY)
+        return dow;
+    if (cron->flags & CRON_DOW_ANY)
+        return dom;
+    return dom || dow;
+}
+
+static void nextDay(struct tm *t) {
+    t->tm_mday++;
+    t->tm_hour = 0;
+    t->tm_min = 0;
+    t->tm_isdst = -1;
+    mktime(t);
+}
+
+time_t cronNext(const cron_t *cron, time_t from) {
+    // nearest minute start >= from, 0 if never
+    struct tm t;
+    localtime_r(&from, &t);
+    if (t.tm_sec > 0) {
+        t.tm_min++;
+        t.tm_isdst = -1;
+        mktime(&t);
+    }
+    t.tm_sec = 0;
+    for (uint16_t days=0; days<MAX_SEARCH_DAYS; days++) {
+        if (!((cron->month >> (t.tm_mon + 1)) & 1)) {
+            // skip to the first day of next month
+            t.tm_mday = 0;
+            t.tm_mon++;
+            nextDay(&t);
+            continue;
+        }
+        if (!isDayMatch(cron, &t)) {
+            nextDay(&t);
+            continue;
+        }
+        int hour = nextBit(cron->hour, t.tm_hour, 23);
+        int min = -1;
+        while (hour >= 0) {
+            min = nextBit(cron->minute, hour == t.tm_hour ? t.tm_min : 0, 59);
+            if (min >= 0)
+                break;
+            hour = nextBit(cron->hour, hour + 1, 23);
+        }
+        if (hour < 0) {
+            nextDay(&t);
+            continue;
+        }
+        t.tm_hour = hour;
+        t.tm_min = min;
+        t.tm_isdst = -1;
+        return mktime(&t);
+    }
+    return 0;
+}
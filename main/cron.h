@@ -0,0 +1,23 @@
+//cron.h
+#include <stdint.h>
+#include <time.h>
+#include "esp_err.h"
+
+#define CRON_DOM_ANY    0x01
+#define CRON_DOW_ANY    0x02
+#define CRON_WEEK_ANY   0x3E    // weeks 1-5 of nth
+
+// cron expression "min hour dom month dow" compiled to bitsets
+typedef struct {
+    uint64_t minute;    // bits 0-59
+    uint32_t hour;      // bits 0-23
+    uint32_t dom;       // bits 1-31
+    uint16_t month;     // bits 1-12
+    uint8_t dow;        // bits 0-6, sunday is 0
+    uint8_t nth[7];     // per weekday, bits 1-5 for "dow#n", 0 - every week
+    uint8_t flags;
+} cron_t;
+
+esp_err_t cronParse(const char *expr, cron_t *cron);
+void cronFromTime(cron_t *cron, uint8_t hour, uint8_t min, uint8_t dow);
+time_t cronNext(const cron_t *cron, time_t from);
@@ -0,0 +1,243 @@
+//executor.c
+// executes actions of scheduler, web and mqtt in a separate task
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#include "cJSON.h"
+#include "core.h"
+#include "mqtt.h"
+#include "ota.h"
+#include "executor.h"
+#include "live.h"
+
+static const char *TAG = "EXECUTOR";
+
+#define QUEUE_LEN       10
+#define LOG_SIZE        16
+#define DEF_TIMEOUT     60000 // ms
+#define DEF_OTA_TIMEOUT 600000 // ms, whole download
+#define DEF_FEED_TIME   3000  // ms
+
+typedef struct {
+    time_t start;
+    uint32_t duration; // ms
+    actionType_t type;
+    esp_err_t result;
+    char source[32];
+} actionRecord_t;
+
+static QueueHandle_t actionsQueue = NULL;
+static actionRecord_t actionsLog[LOG_SIZE];
+static uint8_t actionsLogPos = 0;
+static uint8_t actionsLogQty = 0;
+static portMUX_TYPE actionsLogMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *actionTypes[] = {"gpio", "mqtt", "feed", "ota"};
+
+esp_err_t parseAction(cJSON *jAction, action_t *action) {
+    memset(action, 0, sizeof(action_t));
+    action->gpio = -1;
+    action->timeout = DEF_TIMEOUT;
+    if (!cJSON_IsString(cJSON_GetObjectItem(jAction, "type")))
+        return ESP_FAIL;
+    char *type = cJSON_GetObjectItem(jAction, "type")->valuestring;
+    uint8_t i;
+    for (i=0; i<sizeof(actionTypes)/sizeof(actionTypes[0]); i++) {
+        if (!strcmp(type, actionTypes[i]))
+            break;
+    }
+    if (i == sizeof(actionTypes)/sizeof(actionTypes[0])) {
+        ESP_LOGE(TAG, "Unknown action type %s", type);
+        return ESP_FAIL;
+    }
+    action->type = i;
+    if (action->type == ACTION_OTA)
+        action->timeout = DEF_OTA_TIMEOUT;
+    if (cJSON_IsNumber(cJSON_GetObjectItem(jAction, "timeout")))
+        action->timeout = cJSON_GetObjectItem(jAction, "timeout")->valueint;
+    if (cJSON_IsNumber(cJSON_GetObjectItem(jAction, "duration")))
+        action->duration = cJSON_GetObjectItem(jAction, "duration")->valueint;
+    switch (action->type) {
+        case ACTION_GPIO:
+            if (!cJSON_IsNumber(cJSON_GetObjectItem(jAction, "gpio")) ||
+                !GPIO_IS_VALID_OUTPUT_GPIO(cJSON_GetObjectItem(jAction, "gpio")->valueint)) {
+                ESP_LOGE(TAG, "Wrong gpio for action");
+                return ESP_FAIL;
+            }
+            action->gpio = cJSON_GetObjectItem(jAction, "gpio")->valueint;
+            action->level = cJSON_IsNumber(cJSON_GetObjectItem(jAction, "level")) ?
+                            cJSON_GetObjectItem(jAction, "level")->valueint : 1;
+            break;
+        case ACTION_MQTT:
+            if (!cJSON_IsString(cJSON_GetObjectItem(jAction, "topic"))) {
+                ESP_LOGE(TAG, "No topic for action");
+                return ESP_FAIL;
+            }
+            strlcpy(action->topic, cJSON_GetObjectItem(jAction, "topic")->valuestring, sizeof(action->topic));
+            if (cJSON_IsString(cJSON_GetObjectItem(jAction, "payload")))
+                strlcpy(action->payload, cJSON_GetObjectItem(jAction, "payload")->valuestring, sizeof(action->payload));
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+esp_err_t executorEnqueue(action_t *action) {
+    // never blocks caller
+    if (actionsQueue == NULL)
+        return ESP_FAIL;
+    action->queued = esp_timer_get_time();
+    if (xQueueSend(actionsQueue, action, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Actions queue is full. Action %s from %s dropped",
+                 actionTypes[action->type], action->source);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t feed(const char *source) {
+    action_t action;
+    memset(&action, 0, sizeof(action_t));
+    action.type = ACTION_FEED;
+    action.timeout = DEF_TIMEOUT;
+    strlcpy(action.source, source, sizeof(action.source));
+    return executorEnqueue(&action);
+}
+
+static esp_err_t pulseGPIO(int8_t gpio, uint8_t level, uint32_t duration, uint32_t timeout) {
+    if (!GPIO_IS_VALID_OUTPUT_GPIO(gpio))
+        return ESP_ERR_INVALID_ARG;
+    gpio_pad_select_gpio(gpio);
+    gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+    gpio_set_level(gpio, level);
+    if (duration > 0) {
+        vTaskDelay(MIN(duration, timeout) / portTICK_RATE_MS);
+        gpio_set_level(gpio, !level);
+        if (duration > timeout)
+            return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t doFeed(action_t *action, uint32_t timeout) {
+    int8_t gpio = getNetworkConfigValueInt2("feed", "gpio");
+    uint32_t duration = getNetworkConfigValueInt2("feed", "duration");
+    uint8_t level = getNetworkConfigValueBool2("feed", "inverse") ? 0 : 1;
+    if (gpio == 0) {
+        ESP_LOGE(TAG, "No feed gpio defined");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (duration == 0)
+        duration = DEF_FEED_TIME;
+    return pulseGPIO(gpio, level, duration, timeout);
+}
+
+static esp_err_t doMQTT(action_t *action, uint32_t timeout) {
+    // wait for connection up to timeout
+    uint32_t waited = 0;
+    while (!isMQTTConnected()) {
+        if (waited >= timeout)
+            return ESP_ERR_TIMEOUT;
+        vTaskDelay(100 / portTICK_RATE_MS);
+        waited += 100;
+    }
+    mqttPublish(action->topic, action->payload);
+    return ESP_OK;
+}
+
+static void addRecord(action_t *action, time_t start, uint32_t duration, esp_err_t result) {
+    portENTER_CRITICAL(&actionsLogMux);
+    actionRecord_t *rec = &actionsLog[actionsLogPos];
+    rec->start = start;
+    rec->duration = duration;
+    rec->type = action->type;
+    rec->result = result;
+    strlcpy(rec->source, action->source, sizeof(rec->source));
+    actionsLogPos = (actionsLogPos + 1) % LOG_SIZE;
+    if (actionsLogQty < LOG_SIZE)
+        actionsLogQty++;
+    portEXIT_CRITICAL(&actionsLogMux);
+}
+
+static void executorTask(void *pvParameter) {
+    action_t action;
+    while (1) {
+        if (xQueueReceive(actionsQueue, &action, portMAX_DELAY) != pdTRUE)
+            continue;
+        time_t start;
+        time(&start);
+        int64_t startTime = esp_timer_get_time();
+        // deadline counts from enqueue, action waiting behind long ones may expire in queue
+        uint32_t waited = (startTime - action.queued) / 1000;
+        uint32_t timeout = waited < action.timeout ? action.timeout - waited : 0;
+        esp_err_t err = ESP_ERR_TIMEOUT;
+        ESP_LOGI(TAG, "Action %s from %s, %d ms left", actionTypes[action.type], action.source, timeout);
+        switch (timeout > 0 ? action.type : -1) {
+            case ACTION_GPIO:
+                err = pulseGPIO(action.gpio, action.level, action.duration, timeout);
+                break;
+            case ACTION_MQTT:
+                err = doMQTT(&action, timeout);
+                break;
+            case ACTION_FEED:
+                err = doFeed(&action, timeout);
+                break;
+            case ACTION_OTA:
+                // download runs in ota task, it is aborted at deadline
+                err = startOTA(timeout);
+                break;
+            default:
+                break;
+        }
+        uint32_t duration = (esp_timer_get_time() - startTime) / 1000;
+        if (err != ESP_OK)
+            ESP_LOGE(TAG, "Action %s from %s failed %s", actionTypes[action.type], action.source, esp_err_to_name(err));
+        addRecord(&action, start, duration, err);
+        liveNotify("action", actionTypes[action.type]);
+    }
+}
+
+esp_err_t getActionsLog(char **response) {
+    actionRecord_t records[LOG_SIZE];
+    uint8_t qty, pos;
+    portENTER_CRITICAL(&actionsLogMux);
+    memcpy(records, actionsLog, sizeof(records));
+    qty = actionsLogQty;
+    pos = actionsLogPos;
+    portEXIT_CRITICAL(&actionsLogMux);
+
+    cJSON *jLog = cJSON_CreateArray();
+    char date[21];
+    for (uint8_t i=0; i<qty; i++) {
+        // newest first
+        actionRecord_t *rec = &records[(pos + LOG_SIZE - 1 - i) % LOG_SIZE];
+        struct tm timeinfo;
+        localtime_r(&rec->start, &timeinfo);
+        strftime(date, sizeof(date), "%d.%m.%Y %H:%M:%S", &timeinfo);
+        cJSON *jRec = cJSON_CreateObject();
+        cJSON_AddItemToObject(jRec, "date", cJSON_CreateString(date));
+        cJSON_AddItemToObject(jRec, "type", cJSON_CreateString(actionTypes[rec->type]));
+        cJSON_AddItemToObject(jRec, "source", cJSON_CreateString(rec->source));
+        cJSON_AddItemToObject(jRec, "duration", cJSON_CreateNumber(rec->duration));
+        cJSON_AddItemToObject(jRec, "result", cJSON_CreateString(esp_err_to_name(rec->result)));
+        cJSON_AddItemToArray(jLog, jRec);
+    }
+    *response = cJSON_Print(jLog);
+    cJSON_Delete(jLog);
+    return ESP_OK;
+}
+
+void initExecutor() {
+    actionsQueue = xQueueCreate(QUEUE_LEN, sizeof(action_t));
+    if (actionsQueue == NULL) {
+        ESP_LOGE(TAG, "Can't create actions queue");
+        return;
+    }
+    xTaskCreate(&executorTask, "executorTask", 4096, NULL, 5, NULL);
+}
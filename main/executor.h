@@ -0,0 +1,28 @@
+//executor.h
+#include "esp_err.h"
+#include "cJSON.h"
+
+typedef enum {
+    ACTION_GPIO = 0,
+    ACTION_MQTT,
+    ACTION_FEED,
+    ACTION_OTA
+} actionType_t;
+
+typedef struct {
+    actionType_t type;
+    char source[32];    // who requested action, task name, web, mqtt
+    int8_t gpio;
+    uint8_t level;
+    uint32_t duration;  // ms, 0 - just set level
+    uint32_t timeout;   // ms from enqueue, action is not started after it and is cut at it
+    int64_t queued;     // esp_timer time, set by executorEnqueue
+    char topic[64];
+    char payload[64];
+} action_t;
+
+void initExecutor();
+esp_err_t parseAction(cJSON *jAction, action_t *action);
+esp_err_t executorEnqueue(action_t *action);
+esp_err_t feed(const char *source);
+esp_err_t getActionsLog(char **response);
@@ -439,6 +439,7 @@ void initFTP(void)
         ESP_LOGI(TAG, "No need to init FTP");
         return;
     } else {
+        // copies live while server runs
         userName = getNetworkConfigValueString2("ftp", "user");
         userPass = getNetworkConfigValueString2("ftp", "pass");
     }   
@@ -0,0 +1,547 @@
+//json.c
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "json.h"
+#include "utils.h"
+
+#define MAX_DEPTH   31
+
+void jsonInit(jsonWriter_t *w, char *buf, size_t size, jsonFlush_t flush, void *ctx) {
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->flush = flush;
+    w->ctx = ctx;
+    w->comma = 0;
+    w->depth = 0;
+    w->key = false;
+    w->overflow = false;
+}
+
+static void put(jsonWriter_t *w, const char *data, size_t len) {
+    while (!w->overflow && (len > 0)) {
+        if (w->len == w->size) {
+            if ((w->flush == NULL) || (w->flush(w->ctx, w->buf, w->len) != ESP_OK)) {
+                w->overflow = true;
+                return;
+            }
+            w->len = 0;
+        }
+        size_t part = w->size - w->len < len ? w->size - w->len : len;
+        memcpy(&w->buf[w->len], data, part);
+        w->len += part;
+        data += part;
+        len -= part;
+    }
+}
+
+static void separator(jsonWriter_t *w) {
+    if (w->key) {
+        w->key = false;
+        return;
+    }
+    if (w->comma & (1UL << w->depth))
+        put(w, ",", 1);
+    else
+        w->comma |= 1UL << w->depth;
+}
+
+static void openNested(jsonWriter_t *w, const char *bracket) {
+    separator(w);
+    put(w, bracket, 1);
+    if (w->depth >= MAX_DEPTH) {
+        w->overflow = true;
+        return;
+    }
+    w->depth++;
+    w->comma &= ~(1UL << w->depth);
+}
+
+static void closeNested(jsonWriter_t *w, const char *bracket) {
+    put(w, bracket, 1);
+    if (w->depth > 0)
+        w->depth--;
+}
+
+void jsonObject(jsonWriter_t *w) {
+    openNested(w, "{");
+}
+
+void jsonObjectEnd(jsonWriter_t *w) {
+    closeNested(w, "}");
+}
+
+void jsonArray(jsonWriter_t *w) {
+    openNested(w, "[");
+}
+
+void jsonArrayEnd(jsonWriter_t *w) {
+    closeNested(w, "]");
+}
+
+static void putString(jsonWriter_t *w, const char *text) {
+    static const char hex[] = "0123456789abcdef";
+    const char *start = text;
+    put(w, "\"", 1);
+    for (; *text; text++) {
+        unsigned char c = *text;
+        if ((c >= 0x20) && (c != '"') && (c != '\\'))
+            continue;
+        // flush plain part, then escape
+        put(w, start, text - start);
+        start = text + 1;
+        char esc[6] = {'\\', c, 0, 0, 0, 0};
+        uint8_t len = 2;
+        switch (c) {
+            case '"': case '\\': break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            default:
+                memcpy(esc, "\\u00", 4);
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0x0F];
+                len = 6;
+        }
+        put(w, esc, len);
+    }
+    put(w, start, text - start);
+    put(w, "\"", 1);
+}
+
+void jsonKey(jsonWriter_t *w, const char *key) {
+    separator(w);
+    putString(w, key);
+    put(w, ":", 1);
+    w->key = true;
+}
+
+void jsonString(jsonWriter_t *w, const char *text) {
+    separator(w);
+    putString(w, text != NULL ? text : "");
+}
+
+void jsonInt(jsonWriter_t *w, int64_t value) {
+    char num[21];
+    separator(w);
+    put(w, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+void jsonFixed(jsonWriter_t *w, int32_t value, uint8_t decimals) {
+    char num[13];
+    separator(w);
+    put(w, num, fmtFixed(num, value, decimals));
+}
+
+void jsonDouble(jsonWriter_t *w, double value) {
+    char num[26];
+    if (!isfinite(value)) {
+        jsonNull(w);
+        return;
+    }
+    separator(w);
+    if ((value == (int64_t)value) && (fabs(value) < 1.0e15))
+        put(w, num, snprintf(num, sizeof(num), "%lld", (int64_t)value));
+    else
+        put(w, num, snprintf(num, sizeof(num), "%1.15g", value));
+}
+
+void jsonBool(jsonWriter_t *w, bool value) {
+    separator(w);
+    if (value)
+        put(w, "true", 4);
+    else
+        put(w, "false", 5);
+}
+
+void jsonNull(jsonWriter_t *w) {
+    separator(w);
+    put(w, "null", 4);
+}
+
+void jsonCJSON(jsonWriter_t *w, const cJSON *item) {
+    // existing tree, without printing it to heap
+    const cJSON *child;
+    if (cJSON_IsObject(item)) {
+        jsonObject(w);
+        cJSON_ArrayForEach(child, item) {
+            jsonKey(w, child->string);
+            jsonCJSON(w, child);
+        }
+        jsonObjectEnd(w);
+    } else if (cJSON_IsArray(item)) {
+        jsonArray(w);
+        cJSON_ArrayForEach(child, item)
+            jsonCJSON(w, child);
+        jsonArrayEnd(w);
+    } else if (cJSON_IsString(item)) {
+        jsonString(w, item->valuestring);
+    } else if (cJSON_IsNumber(item)) {
+        jsonDouble(w, item->valuedouble);
+    } else if (cJSON_IsBool(item)) {
+        jsonBool(w, cJSON_IsTrue(item));
+    } else {
+        jsonNull(w);
+    }
+}
+
+esp_err_t jsonFinish(jsonWriter_t *w) {
+    // rest of buffer goes to flush, otherwise it is zero terminated when fits
+    if (!w->overflow && (w->flush != NULL) && (w->len > 0)) {
+        if (w->flush(w->ctx, w->buf, w->len) != ESP_OK)
+            w->overflow = true;
+        w->len = 0;
+    } else if (!w->overflow && (w->len < w->size)) {
+        w->buf[w->len] = 0;
+    }
+    return w->overflow ? ESP_FAIL : ESP_OK;
+}
+
+bool jsonOverflow(jsonWriter_t *w) {
+    return w->overflow;
+}
+
+enum {
+    PS_VALUE = 0,       // value expected
+    PS_VALUE_OR_END,    // first array item or ]
+    PS_KEY,             // key expected after comma
+    PS_KEY_OR_END,      // first object key or }
+    PS_COLON,
+    PS_AFTER_VALUE,     // comma or closing bracket
+    PS_STRING,
+    PS_KEY_STRING,
+    PS_ESCAPE,
+    PS_UNICODE,
+    PS_NUMBER,
+    PS_LITERAL,
+    PS_DONE,
+    PS_ERROR
+};
+
+void jsonParserInit(jsonParser_t *p, jsonEventHandler_t handler, void *ctx) {
+    memset(p, 0, sizeof(jsonParser_t));
+    p->handler = handler;
+    p->ctx = ctx;
+    p->state = PS_VALUE;
+}
+
+static bool emit(jsonParser_t *p, jsonEvent_t event, const char *text) {
+    if (p->handler(p->ctx, event, text) == ESP_OK)
+        return true;
+    p->state = PS_ERROR;
+    return false;
+}
+
+static void valueDone(jsonParser_t *p) {
+    p->state = p->depth == 0 ? PS_DONE : PS_AFTER_VALUE;
+}
+
+static bool tokenPut(jsonParser_t *p, char c) {
+    if (p->tokenLen >= JSON_TOKEN_SIZE - 1) {
+        p->state = PS_ERROR;
+        return false;
+    }
+    p->token[p->tokenLen++] = c;
+    return true;
+}
+
+static void tokenPutUTF8(jsonParser_t *p, uint16_t code) {
+    if (code < 0x80) {
+        tokenPut(p, code);
+    } else if (code < 0x800) {
+        tokenPut(p, 0xC0 | (code >> 6)) && tokenPut(p, 0x80 | (code & 0x3F));
+    } else {
+        tokenPut(p, 0xE0 | (code >> 12)) && tokenPut(p, 0x80 | ((code >> 6) & 0x3F)) &&
+        tokenPut(p, 0x80 | (code & 0x3F));
+    }
+}
+
+static bool openLevel(jsonParser_t *p, bool object) {
+    if (p->depth >= JSON_MAX_DEPTH) {
+        p->state = PS_ERROR;
+        return false;
+    }
+    if (!emit(p, object ? JSON_EVENT_OBJECT : JSON_EVENT_ARRAY, NULL))
+        return false;
+    if (object)
+        p->objects |= 1 << p->depth;
+    else
+        p->objects &= ~(1 << p->depth);
+    p->depth++;
+    p->state = object ? PS_KEY_OR_END : PS_VALUE_OR_END;
+    return true;
+}
+
+static void closeLevel(jsonParser_t *p, bool object) {
+    bool isObject = p->objects & (1 << (p->depth - 1));
+    if (isObject != object) {
+        p->state = PS_ERROR;
+        return;
+    }
+    p->depth--;
+    if (emit(p, object ? JSON_EVENT_OBJECT_END : JSON_EVENT_ARRAY_END, NULL))
+        valueDone(p);
+}
+
+static void numberDone(jsonParser_t *p) {
+    // whole token has to be a number
+    char *end;
+    p->token[p->tokenLen] = 0;
+    strtod(p->token, &end);
+    if ((p->tokenLen == 0) || (*end != 0) || (p->token[0] == '+') || (p->token[0] == '.')) {
+        p->state = PS_ERROR;
+        return;
+    }
+    if (emit(p, JSON_EVENT_NUMBER, p->token))
+        valueDone(p);
+}
+
+static void startValue(jsonParser_t *p, char c) {
+    p->tokenLen = 0;
+    switch (c) {
+        case '{':
+            openLevel(p, true);
+            break;
+        case '[':
+            openLevel(p, false);
+            break;
+        case '"':
+            p->state = PS_STRING;
+            break;
+        case 't':
+            p->literal = "rue";
+            p->state = PS_LITERAL;
+            p->token[0] = c;
+            break;
+        case 'f':
+            p->literal = "alse";
+            p->state = PS_LITERAL;
+            p->token[0] = c;
+            break;
+        case 'n':
+            p->literal = "ull";
+            p->state = PS_LITERAL;
+            p->token[0] = c;
+            break;
+        default:
+            if ((c == '-') || ((c >= '0') && (c <= '9'))) {
+                tokenPut(p, c);
+                p->state = PS_NUMBER;
+            } else {
+                p->state = PS_ERROR;
+            }
+    }
+}
+
+static bool isSpace(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static void parseChar(jsonParser_t *p, char c) {
+    switch (p->state) {
+        case PS_VALUE:
+            if (!isSpace(c))
+                startValue(p, c);
+            break;
+        case PS_VALUE_OR_END:
+            if (c == ']')
+                closeLevel(p, false);
+            else if (!isSpace(c))
+                startValue(p, c);
+            break;
+        case PS_KEY:
+        case PS_KEY_OR_END:
+            if ((c == '}') && (p->state == PS_KEY_OR_END)) {
+                closeLevel(p, true);
+            } else if (c == '"') {
+                p->tokenLen = 0;
+                p->state = PS_KEY_STRING;
+            } else if (!isSpace(c)) {
+                p->state = PS_ERROR;
+            }
+            break;
+        case PS_COLON:
+            if (c == ':')
+                p->state = PS_VALUE;
+            else if (!isSpace(c))
+                p->state = PS_ERROR;
+            break;
+        case PS_AFTER_VALUE:
+            if (c == ',')
+                p->state = (p->objects & (1 << (p->depth - 1))) ? PS_KEY : PS_VALUE;
+            else if ((c == '}') || (c == ']'))
+                closeLevel(p, c == '}');
+            else if (!isSpace(c))
+                p->state = PS_ERROR;
+            break;
+        case PS_STRING:
+        case PS_KEY_STRING:
+            if (c == '"') {
+                bool key = p->state == PS_KEY_STRING;
+                p->token[p->tokenLen] = 0;
+                if (emit(p, key ? JSON_EVENT_KEY : JSON_EVENT_STRING, p->token)) {
+                    if (key)
+                        p->state = PS_COLON;
+                    else
+                        valueDone(p);
+                }
+            } else if (c == '\\') {
+                // escape keeps string kind in unicode field until it is done
+                p->unicodeLen = p->state == PS_KEY_STRING;
+                p->state = PS_ESCAPE;
+            } else if ((unsigned char)c < 0x20) {
+                p->state = PS_ERROR;
+            } else {
+                tokenPut(p, c);
+            }
+            break;
+        case PS_ESCAPE: {
+            uint8_t state = p->unicodeLen ? PS_KEY_STRING : PS_STRING;
+            const char *from = "\"\\/bfnrt";
+            const char *to = "\"\\/\b\f\n\r\t";
+            const char *esc = strchr(from, c);
+            if (c == 'u') {
+                p->unicode = 0;
+                p->unicodeLen = state == PS_KEY_STRING ? 0x80 : 0;
+                p->state = PS_UNICODE;
+            } else if ((c != 0) && (esc != NULL)) {
+                p->state = state;
+                tokenPut(p, to[esc - from]);
+            } else {
+                p->state = PS_ERROR;
+            }
+            break;
+        }
+        case PS_UNICODE: {
+            uint8_t digit;
+            if ((c >= '0') && (c <= '9'))
+                digit = c - '0';
+            else if ((c >= 'a') && (c <= 'f'))
+                digit = c - 'a' + 10;
+            else if ((c >= 'A') && (c <= 'F'))
+                digit = c - 'A' + 10;
+            else {
+                p->state = PS_ERROR;
+                break;
+            }
+            p->unicode = (p->unicode << 4) | digit;
+            p->unicodeLen++;
+            if ((p->unicodeLen & 0x7F) == 4) {
+                p->state = (p->unicodeLen & 0x80) ? PS_KEY_STRING : PS_STRING;
+                if (p->unicode == 0)
+                    p->state = PS_ERROR;
+                else
+                    tokenPutUTF8(p, p->unicode);
+            }
+            break;
+        }
+        case PS_NUMBER:
+            if (((c >= '0') && (c <= '9')) || (c == '.') || (c == 'e') || (c == 'E') || (c == '+') || (c == '-')) {
+                tokenPut(p, c);
+            } else {
+                numberDone(p);
+                if (p->state != PS_ERROR)
+                    parseChar(p, c);
+            }
+            break;
+        case PS_LITERAL:
+            if (c != *p->literal) {
+                p->state = PS_ERROR;
+                break;
+            }
+            p->literal++;
+            if (*p->literal == 0) {
+                jsonEvent_t event = p->token[0] == 't' ? JSON_EVENT_TRUE : (p->token[0] == 'f' ? JSON_EVENT_FALSE : JSON_EVENT_NULL);
+                if (emit(p, event, NULL))
+                    valueDone(p);
+            }
+            break;
+        case PS_DONE:
+            if (!isSpace(c))
+                p->state = PS_ERROR;
+            break;
+    }
+}
+
+esp_err_t jsonParse(jsonParser_t *p, const char *data, size_t len) {
+    for (size_t i=0; (i < len) && (p->state != PS_ERROR); i++) {
+        parseChar(p, data[i]);
+        if (p->state != PS_ERROR)
+            p->pos++;
+    }
+    return p->state == PS_ERROR ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t jsonParseEnd(jsonParser_t *p) {
+    // number at the end of document has no terminator
+    if ((p->state == PS_NUMBER) && (p->depth == 0))
+        numberDone(p);
+    return p->state == PS_DONE ? ESP_OK : ESP_FAIL;
+}
+
+void jsonTreeInit(jsonTree_t *t, uint16_t maxNodes) {
+    memset(t, 0, sizeof(jsonTree_t));
+    t->maxNodes = maxNodes;
+}
+
+static esp_err_t treeAdd(jsonTree_t *t, cJSON *item) {
+    if (item == NULL)
+        return ESP_ERR_NO_MEM;
+    if (++t->nodes > t->maxNodes) {
+        cJSON_Delete(item);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (t->depth == 0) {
+        t->root = item;
+    } else if (t->hasKey) {
+        cJSON_AddItemToObject(t->stack[t->depth - 1], t->key, item);
+        t->hasKey = false;
+    } else {
+        cJSON_AddItemToArray(t->stack[t->depth - 1], item);
+    }
+    return ESP_OK;
+}
+
+esp_err_t jsonTreeEvent(void *ctx, jsonEvent_t event, const char *text) {
+    jsonTree_t *t = ctx;
+    cJSON *item = NULL;
+    esp_err_t err;
+    switch (event) {
+        case JSON_EVENT_KEY:
+            strlcpy(t->key, text, sizeof(t->key));
+            t->hasKey = true;
+            return ESP_OK;
+        case JSON_EVENT_OBJECT_END:
+        case JSON_EVENT_ARRAY_END:
+            t->depth--;
+            return ESP_OK;
+        case JSON_EVENT_OBJECT:
+        case JSON_EVENT_ARRAY:
+            item = event == JSON_EVENT_OBJECT ? cJSON_CreateObject() : cJSON_CreateArray();
+            err = treeAdd(t, item);
+            if (err == ESP_OK)
+                t->stack[t->depth++] = item;
+            return err;
+        case JSON_EVENT_STRING:
+            return treeAdd(t, cJSON_CreateString(text));
+        case JSON_EVENT_NUMBER:
+            return treeAdd(t, cJSON_CreateNumber(strtod(text, NULL)));
+        case JSON_EVENT_TRUE:
+        case JSON_EVENT_FALSE:
+            return treeAdd(t, cJSON_CreateBool(event == JSON_EVENT_TRUE));
+        case JSON_EVENT_NULL:
+            return treeAdd(t, cJSON_CreateNull());
+    }
+    return ESP_FAIL;
+}
+
+cJSON *jsonTreeDetach(jsonTree_t *t) {
+    // caller owns the tree, also used to free it after error
+    cJSON *root = t->root;
+    t->root = NULL;
+    return root;
+}
@@ -0,0 +1,91 @@
+//json.h
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "cJSON.h"
+
+// streaming JSON encoder into small caller buffer, no DOM.
+// Full buffer is passed to flush (http chunk), without flush writer stops
+// and jsonOverflow() is true (mqtt payload)
+typedef esp_err_t (*jsonFlush_t)(void *ctx, const char *data, size_t len);
+
+typedef struct jsonWriter {
+    char *buf;
+    size_t size;
+    size_t len;
+    jsonFlush_t flush;
+    void *ctx;
+    uint32_t comma;     // bit per nesting level, value was written on that level
+    uint8_t depth;
+    bool key;           // key is written, value follows
+    bool overflow;
+} jsonWriter_t;
+
+void jsonInit(jsonWriter_t *w, char *buf, size_t size, jsonFlush_t flush, void *ctx);
+void jsonObject(jsonWriter_t *w);
+void jsonObjectEnd(jsonWriter_t *w);
+void jsonArray(jsonWriter_t *w);
+void jsonArrayEnd(jsonWriter_t *w);
+void jsonKey(jsonWriter_t *w, const char *key);
+void jsonString(jsonWriter_t *w, const char *text);
+void jsonInt(jsonWriter_t *w, int64_t value);
+void jsonFixed(jsonWriter_t *w, int32_t value, uint8_t decimals);
+void jsonDouble(jsonWriter_t *w, double value);
+void jsonBool(jsonWriter_t *w, bool value);
+void jsonNull(jsonWriter_t *w);
+void jsonCJSON(jsonWriter_t *w, const cJSON *item);
+esp_err_t jsonFinish(jsonWriter_t *w);
+bool jsonOverflow(jsonWriter_t *w);
+
+// incremental JSON parser, data may come in chunks of any size.
+// Events go to handler, text of key, string and number is valid during the call only
+#define JSON_TOKEN_SIZE     512     // longest key or string, OTA url is up to 256 and mqtt url carries credentials
+#define JSON_MAX_DEPTH      16
+
+typedef enum {
+    JSON_EVENT_OBJECT = 0,
+    JSON_EVENT_OBJECT_END,
+    JSON_EVENT_ARRAY,
+    JSON_EVENT_ARRAY_END,
+    JSON_EVENT_KEY,
+    JSON_EVENT_STRING,
+    JSON_EVENT_NUMBER,
+    JSON_EVENT_TRUE,
+    JSON_EVENT_FALSE,
+    JSON_EVENT_NULL
+} jsonEvent_t;
+
+typedef esp_err_t (*jsonEventHandler_t)(void *ctx, jsonEvent_t event, const char *text);
+
+typedef struct jsonParser {
+    jsonEventHandler_t handler;
+    void *ctx;
+    char token[JSON_TOKEN_SIZE];
+    uint16_t tokenLen;
+    uint16_t unicode;
+    uint8_t unicodeLen;
+    const char *literal;    // rest of true, false, null
+    uint16_t objects;       // bit per nesting level, object or array
+    uint8_t depth;
+    uint8_t state;
+    uint32_t pos;           // bytes consumed, for error messages
+} jsonParser_t;
+
+// cJSON tree built from parser events, limited by nodes count
+typedef struct jsonTree {
+    cJSON *root;
+    cJSON *stack[JSON_MAX_DEPTH];
+    char key[JSON_TOKEN_SIZE];
+    bool hasKey;
+    uint8_t depth;
+    uint16_t nodes;
+    uint16_t maxNodes;
+} jsonTree_t;
+
+void jsonParserInit(jsonParser_t *p, jsonEventHandler_t handler, void *ctx);
+esp_err_t jsonParse(jsonParser_t *p, const char *data, size_t len);
+esp_err_t jsonParseEnd(jsonParser_t *p);
+void jsonTreeInit(jsonTree_t *t, uint16_t maxNodes);
+esp_err_t jsonTreeEvent(void *ctx, jsonEvent_t event, const char *text);
+cJSON *jsonTreeDetach(jsonTree_t *t);
@@ -0,0 +1,290 @@
+//live.c
+// push of readings and state changes to web clients over websocket /ui/live.
+// Message is built once and shared by all clients, frames are sent by httpd task.
+// Client with too many unsent frames misses messages and is closed when it keeps falling behind
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "bus.h"
+#include "json.h"
+#include "live.h"
+
+static const char *TAG = "LIVE";
+
+#define LIVE_URI            "/ui/live"
+#define LIVE_MAX_CLIENTS    5
+#define LIVE_CLIENT_QUEUE   4   // frames given to httpd and not sent yet, per client
+#define LIVE_MAX_MISSED     16  // messages missed in a row, then client is closed
+#define LIVE_MSG_SIZE       192
+#define LIVE_RECV_SIZE      32  // clients only listen, frames are read and dropped
+
+typedef struct {
+    uint8_t refs;       // under clientsLock
+    uint16_t len;
+    char data[];
+} liveMsg_t;
+
+typedef struct {
+    int fd;             // -1 for free slot
+    uint16_t gen;       // changes on every connect, old frames are not counted
+    uint8_t pending;
+    uint8_t missed;
+    uint32_t sent;
+    uint32_t dropped;
+} liveClient_t;
+
+typedef struct {
+    liveMsg_t *msg;     // NULL for free slot
+    uint8_t client;
+    uint16_t gen;
+    int fd;
+} liveWork_t;
+
+static httpd_handle_t server = NULL;
+static SemaphoreHandle_t clientsLock = NULL;
+static liveClient_t clients[LIVE_MAX_CLIENTS];
+static liveWork_t works[LIVE_MAX_CLIENTS * LIVE_CLIENT_QUEUE];
+static uint8_t clientsQty = 0;
+static uint32_t evicted = 0;
+static busSubscriber_t *liveSub = NULL;
+
+static const char *readingKinds[] = {"temperature", "pressure", "water"};
+
+static void releaseMsg(liveMsg_t *msg) {
+    // under clientsLock
+    if (--msg->refs == 0)
+        free(msg);
+}
+
+static void freeClient(liveClient_t *client) {
+    // under clientsLock, queued frames see changed gen
+    client->fd = -1;
+    client->gen++;
+    client->pending = 0;
+    clientsQty--;
+}
+
+static void sendWork(void *arg) {
+    // httpd task
+    liveWork_t *work = arg;
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t*)work->msg->data,
+        .len = work->msg->len
+    };
+    esp_err_t err = ESP_FAIL;
+    if (httpd_ws_get_fd_info(server, work->fd) == HTTPD_WS_CLIENT_WEBSOCKET)
+        err = httpd_ws_send_frame_async(server, work->fd, &frame);
+    xSemaphoreTake(clientsLock, portMAX_DELAY);
+    liveClient_t *client = &clients[work->client];
+    if (client->gen == work->gen) {
+        client->pending--;
+        if (err == ESP_OK)
+            client->sent++;
+        else {
+            httpd_sess_trigger_close(server, work->fd);
+            freeClient(client);
+        }
+    }
+    releaseMsg(work->msg);
+    work->msg = NULL;
+    xSemaphoreGive(clientsLock);
+}
+
+static liveWork_t *getWork() {
+    // never runs out, every client has at most LIVE_CLIENT_QUEUE works
+    for (uint8_t i=0; i<sizeof(works)/sizeof(works[0]); i++)
+        if (works[i].msg == NULL)
+            return &works[i];
+    return NULL;
+}
+
+static void broadcast(const char *data, size_t len) {
+    liveMsg_t *msg = malloc(sizeof(liveMsg_t) + len);
+    if (msg == NULL)
+        return;
+    memcpy(msg->data, data, len);
+    msg->len = len;
+    msg->refs = 1;
+    xSemaphoreTake(clientsLock, portMAX_DELAY);
+    for (uint8_t i=0; i<LIVE_MAX_CLIENTS; i++) {
+        liveClient_t *client = &clients[i];
+        if (client->fd < 0)
+            continue;
+        if (httpd_ws_get_fd_info(server, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+            // closed by peer
+            freeClient(client);
+            continue;
+        }
+        liveWork_t *work = NULL;
+        if (client->pending < LIVE_CLIENT_QUEUE)
+            work = getWork();
+        if (work != NULL) {
+            work->msg = msg;
+            work->client = i;
+            work->gen = client->gen;
+            work->fd = client->fd;
+            if (httpd_queue_work(server, sendWork, work) == ESP_OK) {
+                msg->refs++;
+                client->pending++;
+                client->missed = 0;
+                continue;
+            }
+            work->msg = NULL;
+        }
+        client->dropped++;
+        if (++client->missed >= LIVE_MAX_MISSED) {
+            ESP_LOGW(TAG, "Client %d is too slow, closing", client->fd);
+            httpd_sess_trigger_close(server, client->fd);
+            freeClient(client);
+            evicted++;
+        }
+    }
+    releaseMsg(msg);
+    xSemaphoreGive(clientsLock);
+}
+
+static esp_err_t addClient(int fd) {
+    esp_err_t err = ESP_ERR_NO_MEM;
+    xSemaphoreTake(clientsLock, portMAX_DELAY);
+    for (uint8_t i=0; i<LIVE_MAX_CLIENTS; i++) {
+        if (clients[i].fd == fd)
+            freeClient(&clients[i]);
+    }
+    for (uint8_t i=0; i<LIVE_MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            clients[i].fd = fd;
+            clients[i].missed = 0;
+            clientsQty++;
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(clientsLock);
+    return err;
+}
+
+static esp_err_t liveHandler(httpd_req_t *req) {
+    if (req->method == HTTP_GET) {
+        // handshake is done, error closes socket
+        esp_err_t err = addClient(httpd_req_to_sockfd(req));
+        if (err != ESP_OK)
+            ESP_LOGW(TAG, "No room for client");
+        return err;
+    }
+    uint8_t buf[LIVE_RECV_SIZE];
+    httpd_ws_frame_t frame = {.payload = buf};
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if ((err != ESP_OK) || (frame.len > sizeof(buf)))
+        return ESP_FAIL;
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+
+static void writeReading(jsonWriter_t *w, const reading_t *reading) {
+    char id[17];
+    jsonObject(w);
+    jsonKey(w, "type");
+    jsonString(w, "reading");
+    jsonKey(w, "kind");
+    jsonString(w, reading->kind < sizeof(readingKinds)/sizeof(readingKinds[0]) ? readingKinds[reading->kind] : "unknown");
+    if (reading->id != 0) {
+        sprintf(id, "%016llx", reading->id);
+        jsonKey(w, "id");
+        jsonString(w, id);
+    }
+    jsonKey(w, "value");
+    jsonFixed(w, reading->value, reading->decimals);
+    jsonKey(w, "quality");
+    jsonInt(w, reading->quality);
+    jsonKey(w, "time");
+    jsonInt(w, reading->time);
+    jsonObjectEnd(w);
+}
+
+static void liveTask(void *pvParameter) {
+    // readings are formatted only when somebody listens
+    reading_t reading;
+    char buf[LIVE_MSG_SIZE];
+    jsonWriter_t w;
+    while (1) {
+        if (!busReceive(liveSub, &reading, portMAX_DELAY) || (clientsQty == 0))
+            continue;
+        jsonInit(&w, buf, sizeof(buf), NULL, NULL);
+        writeReading(&w, &reading);
+        if (jsonFinish(&w) == ESP_OK)
+            broadcast(buf, w.len);
+    }
+}
+
+void liveNotify(const char *event, const char *value) {
+    // state change from any task
+    char buf[LIVE_MSG_SIZE];
+    jsonWriter_t w;
+    if ((clientsLock == NULL) || (clientsQty == 0))
+        return;
+    jsonInit(&w, buf, sizeof(buf), NULL, NULL);
+    jsonObject(&w);
+    jsonKey(&w, "type");
+    jsonString(&w, "event");
+    jsonKey(&w, "event");
+    jsonString(&w, event);
+    jsonKey(&w, "value");
+    jsonString(&w, value);
+    jsonObjectEnd(&w);
+    if (jsonFinish(&w) == ESP_OK)
+        broadcast(buf, w.len);
+}
+
+void writeLiveStats(jsonWriter_t *w) {
+    uint32_t sent = 0, dropped = 0;
+    if (clientsLock == NULL) {
+        jsonNull(w);
+        return;
+    }
+    xSemaphoreTake(clientsLock, portMAX_DELAY);
+    for (uint8_t i=0; i<LIVE_MAX_CLIENTS; i++) {
+        sent += clients[i].sent;
+        dropped += clients[i].dropped;
+    }
+    jsonObject(w);
+    jsonKey(w, "clients");
+    jsonInt(w, clientsQty);
+    jsonKey(w, "sent");
+    jsonInt(w, sent);
+    jsonKey(w, "dropped");
+    jsonInt(w, dropped);
+    jsonKey(w, "evicted");
+    jsonInt(w, evicted);
+    jsonObjectEnd(w);
+    xSemaphoreGive(clientsLock);
+}
+
+esp_err_t registerLive(httpd_handle_t handle) {
+    // before wildcard handlers, first matching handler wins
+    httpd_uri_t live_uri = {
+        .uri = LIVE_URI,
+        .method = HTTP_GET,
+        .handler = liveHandler,
+        .is_websocket = true
+    };
+    server = handle;
+    return httpd_register_uri_handler(server, &live_uri);
+}
+
+esp_err_t initLive() {
+    // bus subscriber, before sensor tasks
+    clientsLock = xSemaphoreCreateMutex();
+    if (clientsLock == NULL)
+        return ESP_ERR_NO_MEM;
+    for (uint8_t i=0; i<LIVE_MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    liveSub = busSubscribe("live", 16, BUS_DROP_OLDEST);
+    if (liveSub == NULL)
+        return ESP_FAIL;
+    xTaskCreate(&liveTask, "liveTask", 3072, NULL, 4, NULL);
+    return ESP_OK;
+}
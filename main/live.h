@@ -0,0 +1,9 @@
+//live.h
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+esp_err_t initLive();
+esp_err_t registerLive(httpd_handle_t server);
+void liveNotify(const char *event, const char *value);
+struct jsonWriter;
+void writeLiveStats(struct jsonWriter *w);
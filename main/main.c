@@ -14,6 +14,10 @@
 #include "ftp.h"
 #include "mqtt.h"
 #include "temperature.h"
+#include "executor.h"
+#include "mqttQueue.h"
+#include "topics.h"
+#include "live.h"
 
 static const char *TAG = "MAIN";
 
@@ -23,8 +27,8 @@ void app_main(void)
         return;
     }
     
-    if (createSemaphore() != ESP_OK) {
-        ESP_LOGE(TAG, "Error while creating semaphore!");
+    if (createLocks() != ESP_OK) {
+        ESP_LOGE(TAG, "Error while creating locks!");
     }
 
     esp_err_t res = loadConfig();
@@ -33,8 +37,14 @@ void app_main(void)
     //     return;
     // }
     
+    topicsRebuild();
+    initMQTTQueue();
     initServiceTask();
+    initExecutor();
+    initReadings();
+    initLive();
     initNetwork();    
+    initRoutes();
     initWebServer();
     initTemperature();
     initADC();
@@ -1,9 +1,11 @@
 //MQTT
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <math.h>
 #include "esp_event.h"
 #include "esp_netif.h"
 
@@ -16,10 +18,63 @@
 #include "mqtt_client.h"
 #include "core.h"
 #include "cJSON.h"
+#include "executor.h"
+#include "mqttQueue.h"
+#include "mqttRouter.h"
+#include "topics.h"
+#include "mqtt.h"
+#include "utils.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "json.h"
 
 static const char *TAG = "MQTT";
 esp_mqtt_client_handle_t mqttclient;
 bool mqtt_connected = false;
+static TaskHandle_t senderTask = NULL;
+
+#define DEF_REPLAY_RATE     20 // messages per second
+#define DEF_BULK_RATE       2048 // bytes per second
+#define MAX_INFLIGHT        16
+#define DEF_INFLIGHT        8
+#define INFLIGHT_EXPIRE     30000 // ms, esp-mqtt drops outbox messages after 30 s
+
+// copy of message is kept until puback, it is queued again when client drops it
+typedef struct {
+    int msgId;
+    int64_t sent;   // ms
+    uint8_t lane;
+    uint16_t len;
+    char *topic;    // topic and data in one allocation
+} inflight_t;
+
+typedef struct {
+    uint32_t published;
+    uint32_t acked;
+    uint32_t resent;
+    uint32_t expired;
+    uint32_t ackAvg;    // ms
+    uint32_t ackMax;    // ms
+} ackStats_t;
+
+typedef struct {
+    const char *name;
+    uint8_t qos;
+    bool retain;
+    mqttFormat_t format;
+} mqttClassConfig_t;
+
+static mqttClassConfig_t classes[] = {
+    {"alarm", 1, false, MQTT_FORMAT_JSON},
+    {"state", 0, false, MQTT_FORMAT_JSON},
+    {"bulk", 0, false, MQTT_FORMAT_JSON}
+};
+
+static inflight_t inflight[MAX_INFLIGHT];
+static uint8_t inflightQty = 0;
+static uint8_t inflightMax = DEF_INFLIGHT;
+static ackStats_t ackStats;
+static portMUX_TYPE inflightMux = portMUX_INITIALIZER_UNLOCKED;
 
 static void log_error_if_nonzero(const char * message, int error_code)
 {
@@ -28,51 +83,136 @@ static void log_error_if_nonzero(const char * message, int error_code)
     }
 }
 
-void parseTopic(char* topic, char* data) {
-    ESP_LOGW(TAG, "parseTopic %s %s", topic, data);
-    
-    SemaphoreHandle_t sem = getSemaphore();
-    cJSON *jData = cJSON_Parse(data);
-    if (strstr(topic, "/json")) {
-        if (!cJSON_IsObject(jData)) {
-            ESP_LOGE(TAG, "data is not a json");
-            return;
+static void inflightAdd(int msgId, uint8_t lane, const char *topic, const char *data, uint16_t len) {
+    size_t topicLen = strlen(topic);
+    char *copy = malloc(topicLen + 1 + len);
+    if (copy != NULL) {
+        memcpy(copy, topic, topicLen + 1);
+        memcpy(copy + topicLen + 1, data, len);
+    } else {
+        ESP_LOGE(TAG, "No memory to keep %s until puback", topic);
+    }
+    portENTER_CRITICAL(&inflightMux);
+    if (inflightQty < MAX_INFLIGHT) {
+        inflight[inflightQty].msgId = msgId;
+        inflight[inflightQty].sent = esp_timer_get_time() / 1000;
+        inflight[inflightQty].lane = lane;
+        inflight[inflightQty].len = len;
+        inflight[inflightQty].topic = copy;
+        inflightQty++;
+        copy = NULL;
+    }
+    ackStats.published++;
+    portEXIT_CRITICAL(&inflightMux);
+    free(copy);
+}
+
+static void inflightAck(int msgId) {
+    int64_t now = esp_timer_get_time() / 1000;
+    char *copy = NULL;
+    portENTER_CRITICAL(&inflightMux);
+    for (uint8_t i=0; i<inflightQty; i++) {
+        if (inflight[i].msgId != msgId)
+            continue;
+        uint32_t latency = now - inflight[i].sent;
+        ackStats.acked++;
+        ackStats.ackAvg = ackStats.acked == 1 ? latency : ackStats.ackAvg + ((int32_t)latency - (int32_t)ackStats.ackAvg) / 8;
+        if (latency > ackStats.ackMax)
+            ackStats.ackMax = latency;
+        copy = inflight[i].topic;
+        inflight[i] = inflight[--inflightQty];
+        break;
+    }
+    portEXIT_CRITICAL(&inflightMux);
+    free(copy);
+}
+
+static bool takeExpired(inflight_t *expired) {
+    int64_t now = esp_timer_get_time() / 1000;
+    bool res = false;
+    portENTER_CRITICAL(&inflightMux);
+    for (uint8_t i=0; i<inflightQty; i++) {
+        if (now - inflight[i].sent > INFLIGHT_EXPIRE) {
+            *expired = inflight[i];
+            inflight[i] = inflight[--inflightQty];
+            ackStats.expired++;
+            res = true;
+            break;
         }
-        /*
-            Для JSON формата будет такой пример
-            TOPIC=Test1/in/json
-            DATA={
-             "feed": 1
-            }
-        */
-        ESP_LOGI(TAG, "it's json");
-        if (cJSON_IsBool(cJSON_GetObjectItem(jData, "feed")) && cJSON_IsTrue(cJSON_GetObjectItem(jData, "feed"))) {
-            if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-//                setFeedFlag(data);
-                xSemaphoreGive(sem);
-            }
+    }
+    portEXIT_CRITICAL(&inflightMux);
+    return res;
+}
+
+static void inflightExpire() {
+    // client gave up on them without puback, messages go back to their lanes
+    // and are published again with new id, so outage longer than outbox expiry loses nothing
+    inflight_t expired;
+    while (takeExpired(&expired)) {
+        if (expired.topic == NULL)
+            continue;
+        size_t topicLen = strlen(expired.topic);
+        if (mqttQueuePush(expired.lane, expired.topic, expired.topic + topicLen + 1, expired.len,
+                          topicFlagsByName(expired.topic)) != ESP_OK)
+            ESP_LOGE(TAG, "Can't queue again %s", expired.topic);
+        free(expired.topic);
+    }
+}
+
+static bool isInflightFull() {
+    return inflightQty >= inflightMax;
+}
+
+static esp_err_t cmdFeed(const char *data, uint16_t len) {
+    // <hostname>/in/feed ON
+    if (strcmp(data, "ON"))
+        return ESP_ERR_INVALID_ARG;
+    return feed("mqtt");
+}
+
+static esp_err_t cmdJson(const char *data, uint16_t len) {
+    /*
+        Для JSON формата будет такой пример
+        TOPIC=Test1/in/json
+        DATA={
+         "feed": true
         }
+    */
+    cJSON *jData = cJSON_Parse(data);
+    if (!cJSON_IsObject(jData)) {
+        ESP_LOGE(TAG, "data is not a json");
         cJSON_Delete(jData);
-    } else if (strstr(topic, "/feed") && strstr(data, "ON")) {
-        //setFeedFlag(NULL);
-    }                         
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = ESP_OK;
+    if (cJSON_IsTrue(cJSON_GetObjectItem(jData, "feed")))
+        err = feed("mqtt");
+    cJSON_Delete(jData);
+    return err;
 }
 
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
     esp_mqtt_client_handle_t client = event->client;
     int msg_id = 0;
+    char *hostname;
     // your_context_t *context = event->context;    
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED. Hostname %s", getNetworkConfigValueString("hostname"));            
-            //msg_id = esp_mqtt_client_subscribe(client, "/main/#", 0);
-            char stopic[100];
-            //strcpy(stopic, "/");
-            strcpy(stopic, getNetworkConfigValueString("hostname"));
-            strcat(stopic, "/in/#\0");
-            msg_id = esp_mqtt_client_subscribe(client, stopic, 0);
+            hostname = getNetworkConfigValueString("hostname");
+            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED. Hostname %s, session present %d", hostname, event->session_present);
+            free(hostname);
+            // broker keeps subscription of persistent session. Qos 0, commands sent
+            // while we are offline are not queued, otherwise feed could run late
+            if (!event->session_present)
+                msg_id = esp_mqtt_client_subscribe(client, mqttRouterTopic(), 0);
+            // unacknowledged messages are sent again by client
+            portENTER_CRITICAL(&inflightMux);
+            ackStats.resent += inflightQty;
+            portEXIT_CRITICAL(&inflightMux);
             mqtt_connected = true;
+            if (senderTask != NULL)
+                xTaskNotifyGive(senderTask);
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
@@ -88,37 +228,20 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
             ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            inflightAck(event->msg_id);
+            if (senderTask != NULL)
+                xTaskNotifyGive(senderTask);
             break;
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            // printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-            // printf("DATA=%.*s\r\n", event->data_len, event->data);            
-            // parse topic
-            // break;
-            // char topic[100];
-            // strncpy(topic, event->topic, event->topic_len);
-            // topic[event->topic_len] = 0;
-            // char data[200];
-            // strncpy(data, event->data, event->data_len);
-            // data[event->data_len] = 0;
-            char *topic = (char*)malloc(event->topic_len+1);
-            strncpy(topic, event->topic, event->topic_len);
-            topic[event->topic_len] = 0;
-            char *data = (char*)malloc(event->data_len+1);
-            strncpy(data, event->data, event->data_len);
-            data[event->data_len] = 0;            
-            parseTopic(topic, data);
-            free(topic);
-            free(data);
-            // char *topic = malloc(event->topic_len+1);
-            // strcpy(topic, event->topic);
-            // topic[event->topic_len] = 0;
-            // ESP_LOGI(TAG, "topic %s, data %s", topic, data);
-            // parseTopic(topic, data);            
-            // free(topic);
-            // free(data);
-            //parseTopic(event->topic, event->data);
+            ESP_LOGD(TAG, "MQTT_EVENT_DATA");
+            if (event->data_len != event->total_data_len) {
+                // commands are short, fragmented message is not a command
+                if (event->current_data_offset == 0)
+                    ESP_LOGE(TAG, "Fragmented message %.*s skipped", event->topic_len, event->topic);
+                break;
+            }
+            mqttRouterDispatch(event->topic, event->topic_len, event->data, event->data_len);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -142,16 +265,146 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     mqtt_event_handler_cb(event_data);
 }
 
+esp_err_t mqttPublishClass(mqttClass_t cls, char* topic, char* data) {
+    esp_err_t err = mqttQueuePush(cls, topic, data, strlen(data), topicFlagsByName(topic));
+    if (err == ESP_OK && senderTask != NULL)
+        xTaskNotifyGive(senderTask);
+    return err;
+}
+
+esp_err_t mqttPublishTopic(mqttClass_t cls, topicHandle_t topic, const char* data, uint16_t len) {
+    // registered topic, no allocations and no topic parsing
+    const char *name = topicName(topic);
+    if (name == NULL)
+        return ESP_ERR_NOT_FOUND;
+    esp_err_t err = mqttQueuePush(cls, name, data, len, topicFlags(topic));
+    if (err == ESP_OK && senderTask != NULL)
+        xTaskNotifyGive(senderTask);
+    return err;
+}
+
+void mqttPublishFixed(mqttClass_t cls, topicHandle_t topic, int32_t value, uint8_t decimals) {
+    char data[13];
+    uint8_t len = fmtFixed(data, value, decimals);
+    mqttPublishTopic(cls, topic, data, len);
+}
+
 void mqttPublish(char* topic, char* data) {
-    if (mqtt_connected)
-        esp_mqtt_client_publish(mqttclient, topic, data, 0, 0, 0);    
+    mqttPublishClass(MQTT_STATE, topic, data);
 }
 
 void mqttPublishF(char* topic, float fdata) {
-    char data[10];
-    sprintf(data, "%.1f", fdata);
-    if (mqtt_connected)
-        esp_mqtt_client_publish(mqttclient, topic, data, 0, 0, 0);    
+    char data[13];
+    fmtFixed(data, lroundf(fdata * 10), 1);
+    mqttPublish(topic, data);
+}
+
+static void mqttSenderTask(void *pvParameter) {
+    // sends queued messages while connected, lanes in priority order.
+    // Bulk lane is limited by token bucket, spool is replayed with limited rate
+    uint16_t rate = getNetworkConfigValueInt2("mqtt", "replayRate");
+    if (rate == 0)
+        rate = DEF_REPLAY_RATE;
+    int32_t bulkRate = getNetworkConfigValueInt2("mqtt", "bulkRate");
+    if (bulkRate == 0)
+        bulkRate = DEF_BULK_RATE;
+    int32_t tokens = bulkRate;
+    TickType_t lastRefill = xTaskGetTickCount();
+    char *topic, *data;
+    uint16_t len;
+    bool replay;
+    while (1) {
+        if (!mqtt_connected) {
+            ulTaskNotifyTake(pdTRUE, 1000 / portTICK_RATE_MS);
+            continue;
+        }
+        TickType_t now = xTaskGetTickCount();
+        tokens = MIN(bulkRate, tokens + (int32_t)((now - lastRefill) * portTICK_RATE_MS * bulkRate / 1000));
+        lastRefill = now;
+        uint32_t wait = 1000;
+        int8_t lane;
+        inflightExpire();
+        for (lane=MQTT_ALARM; lane<=MQTT_BULK; lane++) {
+            // qos 0 lanes go on while acks are awaited
+            if ((classes[lane].qos > 0) && isInflightFull())
+                continue;
+            if ((lane == MQTT_BULK) && (tokens <= 0)) {
+                // wait for tokens, new alarm or state message wakes us earlier
+                wait = (1 - tokens) * 1000 / bulkRate + 1;
+                lane = -1;
+                break;
+            }
+            if (mqttQueuePeek(lane, &topic, &data, &len, &replay) == ESP_OK)
+                break;
+        }
+        if ((lane < 0) || (lane > MQTT_BULK)) {
+            ulTaskNotifyTake(pdTRUE, wait / portTICK_RATE_MS);
+            continue;
+        }
+        int msgId = esp_mqtt_client_publish(mqttclient, topic, data, len, classes[lane].qos, classes[lane].retain);
+        if (msgId < 0) {
+            ESP_LOGE(TAG, "Can't publish %s", topic);
+            vTaskDelay(1000 / portTICK_RATE_MS);
+            continue;
+        }
+        if (classes[lane].qos > 0)
+            inflightAdd(msgId, lane, topic, data, len);
+        mqttQueuePop();
+        if (lane == MQTT_BULK)
+            tokens -= strlen(topic) + len;
+        if (replay)
+            ulTaskNotifyTake(pdTRUE, 1000 / rate / portTICK_RATE_MS);
+    }
+}
+
+static void loadClasses() {
+    // "mqtt": {"alarm": {"qos": 1, "retain": false}, "bulk": {"format": "cbor"}, ...}
+    for (uint8_t i=0; i<sizeof(classes)/sizeof(classes[0]); i++) {
+        cJSON *jClass = getNetworkConfigValueObject2("mqtt", classes[i].name);
+        if (jClass == NULL)
+            continue;
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jClass, "qos")))
+            classes[i].qos = MIN(cJSON_GetObjectItem(jClass, "qos")->valueint, 2);
+        if (cJSON_IsBool(cJSON_GetObjectItem(jClass, "retain")))
+            classes[i].retain = cJSON_IsTrue(cJSON_GetObjectItem(jClass, "retain"));
+        if (cJSON_IsString(cJSON_GetObjectItem(jClass, "format")) &&
+            !strcmp(cJSON_GetObjectItem(jClass, "format")->valuestring, "cbor"))
+            classes[i].format = MQTT_FORMAT_CBOR;
+        cJSON_Delete(jClass);
+    }
+}
+
+void writeMQTTStats(jsonWriter_t *w) {
+    portENTER_CRITICAL(&inflightMux);
+    ackStats_t stats = ackStats;
+    uint8_t qty = inflightQty;
+    portEXIT_CRITICAL(&inflightMux);
+    jsonObject(w);
+    jsonKey(w, "connected");
+    jsonBool(w, mqtt_connected);
+    jsonKey(w, "inflight");
+    jsonInt(w, qty);
+    jsonKey(w, "published");
+    jsonInt(w, stats.published);
+    jsonKey(w, "acked");
+    jsonInt(w, stats.acked);
+    jsonKey(w, "resent");
+    jsonInt(w, stats.resent);
+    jsonKey(w, "expired");
+    jsonInt(w, stats.expired);
+    jsonKey(w, "ackAvg");
+    jsonInt(w, stats.ackAvg);
+    jsonKey(w, "ackMax");
+    jsonInt(w, stats.ackMax);
+    jsonObjectEnd(w);
+}
+
+mqttFormat_t mqttClassFormat(mqttClass_t cls) {
+    return classes[cls].format;
+}
+
+bool isMQTTConnected() {
+    return mqtt_connected;
 }
 
 void mqtt_app_start(void)
@@ -163,19 +416,99 @@ void mqtt_app_start(void)
     esp_mqtt_client_config_t mqtt_cfg = {    
         .uri = "mqtt://"
     };
-    mqtt_cfg.uri = getNetworkConfigValueString2("mqtt", "url");
-    mqtt_cfg.client_id = getNetworkConfigValueString("hostname");
+    // client keeps own copies of strings
+    char *uri = getNetworkConfigValueString2("mqtt", "url");
+    char *clientId = getNetworkConfigValueString("hostname");
+    mqtt_cfg.uri = uri;
+    mqtt_cfg.client_id = clientId;
+    // persistent session keeps subscription and qos 1 messages for us while offline
+    mqtt_cfg.disable_clean_session = !getNetworkConfigValueBool2("mqtt", "cleanSession");
+    if (getNetworkConfigValueInt2("mqtt", "inflight") > 0)
+        inflightMax = MIN(getNetworkConfigValueInt2("mqtt", "inflight"), MAX_INFLIGHT);
     if (mqtt_cfg.uri == NULL) {
         ESP_LOGE(TAG, "No MQTT uri defined");
+        free(clientId);
         return;
     }
     
     //esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     mqttclient = esp_mqtt_client_init(&mqtt_cfg);
+    free(uri);
+    free(clientId);
     esp_mqtt_client_register_event(mqttclient, ESP_EVENT_ANY_ID, mqtt_event_handler, mqttclient);
     esp_mqtt_client_start(mqttclient);
+    xTaskCreate(&mqttSenderTask, "mqttSenderTask", 4096, NULL, 5, &senderTask);
+}
+
+static void benchmarkPublish(bool legacy, topicHandle_t topic, const char *hostname, uint32_t iterations, jsonWriter_t *w) {
+    // heap is sampled around every call, allocation freed in the same call is not seen
+    char name[100];
+    char data[13];
+    uint32_t allocs = 0;
+    uint32_t failed = 0;
+    size_t heapStart = esp_get_free_heap_size();
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i=0; i<iterations; i++) {
+        size_t heap = esp_get_free_heap_size();
+        esp_err_t err;
+        if (legacy) {
+            strcpy(name, hostname);
+            strcat(name, "/benchmark");
+            sprintf(data, "%.1f", (float)i / 10);
+            err = mqttPublishClass(MQTT_BULK, name, data);
+        } else {
+            err = mqttPublishTopic(MQTT_BULK, topic, data, fmtFixed(data, i, 1));
+        }
+        if (esp_get_free_heap_size() < heap)
+            allocs++;
+        if (err != ESP_OK)
+            failed++;
+    }
+    int64_t time = esp_timer_get_time() - start;
+    jsonObject(w);
+    jsonKey(w, "us");
+    jsonInt(w, time);
+    jsonKey(w, "heapDelta");
+    jsonInt(w, (int32_t)(heapStart - esp_get_free_heap_size()));
+    jsonKey(w, "allocs");
+    jsonInt(w, allocs);
+    jsonKey(w, "failed");
+    jsonInt(w, failed);
+    jsonObjectEnd(w);
+}
+
+esp_err_t mqttBenchmark(jsonWriter_t *w, uint32_t iterations) {
+    // steady state publish into bulk lane: old topic string building and sprintf
+    // against registered topic and fixed point formatter. Topic "benchmark" is kept
+    // latest, so the lane holds one record whatever the iterations are.
+    // Other tasks allocate meanwhile, MQTT disconnected gives clean numbers
+    char *hostname = getNetworkConfigValueString("hostname");
+    topicHandle_t topic = topicRegister("", "benchmark");
+    if ((hostname == NULL) || (topic == TOPIC_NONE) || !(topicFlags(topic) & MQ_KEEP_LATEST)) {
+        free(hostname);
+        return ESP_ERR_INVALID_STATE;
+    }
+    jsonObject(w);
+    jsonKey(w, "iterations");
+    jsonInt(w, iterations);
+    jsonKey(w, "sprintf");
+    benchmarkPublish(true, topic, hostname, iterations, w);
+    jsonKey(w, "registry");
+    benchmarkPublish(false, topic, hostname, iterations, w);
+    jsonObjectEnd(w);
+    free(hostname);
+    return ESP_OK;
 }
 
 void initMQTT() {
+    if (!getNetworkConfigValueBool2("mqtt", "enabled")) {
+        ESP_LOGI(TAG, "No need to init MQTT");
+        return;
+    }
+    mqttRouterRegister("feed", cmdFeed);
+    mqttRouterRegister("json", cmdJson);
+    if (initMQTTRouter() != ESP_OK)
+        return;
+    loadClasses();
     mqtt_app_start();
 }
@@ -1,5 +1,26 @@
 //mqtt.h
+#include "esp_err.h"
+
+// publish classes, alarms are always sent first, bulk is rate limited
+typedef enum {
+    MQTT_ALARM = 0,
+    MQTT_STATE,
+    MQTT_BULK
+} mqttClass_t;
+
+typedef enum {
+    MQTT_FORMAT_JSON = 0,
+    MQTT_FORMAT_CBOR
+} mqttFormat_t;
 
 void initMQTT();
 void mqttPublish(char* topic, char* data);
-void mqttPublishF(char* topic, float fdata);
\ No newline at end of file
+void mqttPublishF(char* topic, float fdata);
+esp_err_t mqttPublishClass(mqttClass_t cls, char* topic, char* data);
+esp_err_t mqttPublishTopic(mqttClass_t cls, uint8_t topic, const char* data, uint16_t len);
+void mqttPublishFixed(mqttClass_t cls, uint8_t topic, int32_t value, uint8_t decimals);
+bool isMQTTConnected();
+struct jsonWriter;
+esp_err_t mqttBenchmark(struct jsonWriter *w, uint32_t iterations);
+void writeMQTTStats(struct jsonWriter *w);
+mqttFormat_t mqttClassFormat(mqttClass_t cls);
\ No newline at end of file
@@ -0,0 +1,316 @@
+//mqttQueue.c
+// outbound mqtt messages. Lane per publish class, each lane has RAM ring,
+// oldest messages spill to spiffs file when ring is full,
+// spool is replayed first after connect
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "core.h"
+#include "mqttQueue.h"
+#include "json.h"
+
+static const char *TAG = "MQTTQUEUE";
+
+#define MAX_RECORD      3072
+#define DEF_SPOOL_SIZE  (64*1024)
+
+#define MQ_DEAD         0x80
+
+typedef struct __attribute__((packed)) {
+    uint8_t flags;
+    uint8_t topicLen;
+    uint16_t dataLen;
+} mqRecord_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t coalesced;
+    uint32_t spilled;
+    uint32_t replayed;
+    uint32_t dropped;
+} mqStats_t;
+
+typedef struct {
+    const char *name;
+    uint8_t *ring;
+    uint16_t size;
+    uint16_t head, tail, used;
+    uint32_t tailSeq;
+    const char *spoolPath;
+    uint32_t spoolRead, spoolSize;
+    mqStats_t stats;
+} mqLane_t;
+
+static uint8_t alarmRing[1024];
+static uint8_t stateRing[4096];
+static uint8_t bulkRing[8192];
+
+static mqLane_t lanes[MQ_LANES] = {
+    {.name = "alarm", .ring = alarmRing, .size = sizeof(alarmRing), .spoolPath = "/storage/mqtt_alarm.spool"},
+    {.name = "state", .ring = stateRing, .size = sizeof(stateRing), .spoolPath = "/storage/mqtt_state.spool"},
+    {.name = "bulk", .ring = bulkRing, .size = sizeof(bulkRing), .spoolPath = "/storage/mqtt_bulk.spool"}
+};
+
+static SemaphoreHandle_t sem_queue = NULL;
+static mqLane_t *peekLane = NULL;
+static uint32_t peekSeq = 0;
+static bool peekSpool = false;
+static uint16_t peekLen = 0;
+static char txBuf[MAX_RECORD + 2]; // topic and data, zero terminated
+static uint32_t spoolMax = DEF_SPOOL_SIZE;
+
+static void ringWrite(mqLane_t *lane, uint16_t pos, const void *src, uint16_t len) {
+    uint16_t first = MIN(len, lane->size - pos);
+    memcpy(&lane->ring[pos], src, first);
+    memcpy(lane->ring, (uint8_t*)src + first, len - first);
+}
+
+static void ringRead(mqLane_t *lane, uint16_t pos, void *dst, uint16_t len) {
+    uint16_t first = MIN(len, lane->size - pos);
+    memcpy(dst, &lane->ring[pos], first);
+    memcpy((uint8_t*)dst + first, lane->ring, len - first);
+}
+
+static uint16_t recordLen(mqRecord_t *rec) {
+    return sizeof(mqRecord_t) + rec->topicLen + rec->dataLen;
+}
+
+static void ringDropTail(mqLane_t *lane) {
+    mqRecord_t rec;
+    ringRead(lane, lane->tail, &rec, sizeof(rec));
+    lane->tail = (lane->tail + recordLen(&rec)) % lane->size;
+    lane->used -= recordLen(&rec);
+    lane->tailSeq++;
+}
+
+static void spillTail(mqLane_t *lane) {
+    // move oldest record from ring to spool, straight from ring memory
+    mqRecord_t rec;
+    ringRead(lane, lane->tail, &rec, sizeof(rec));
+    uint16_t len = recordLen(&rec);
+    if (!(rec.flags & MQ_DEAD)) {
+        FILE *f = NULL;
+        if (lane->spoolSize + len <= spoolMax)
+            f = fopen(lane->spoolPath, "a");
+        uint16_t first = MIN(len, lane->size - lane->tail);
+        if ((f != NULL) &&
+            (fwrite(&lane->ring[lane->tail], 1, first, f) == first) &&
+            (fwrite(lane->ring, 1, len - first, f) == len - first)) {
+            lane->spoolSize += len;
+            lane->stats.spilled++;
+        } else {
+            lane->stats.dropped++;
+        }
+        if (f != NULL)
+            fclose(f);
+    }
+    ringDropTail(lane);
+}
+
+static bool isTopicEqual(mqLane_t *lane, uint16_t pos, const char *topic, uint8_t topicLen) {
+    char buf[32];
+    pos = (pos + sizeof(mqRecord_t)) % lane->size;
+    for (uint8_t i=0; i<topicLen; i+=sizeof(buf)) {
+        uint8_t len = MIN(sizeof(buf), topicLen - i);
+        ringRead(lane, pos, buf, len);
+        if (memcmp(buf, topic + i, len))
+            return false;
+        pos = (pos + len) % lane->size;
+    }
+    return true;
+}
+
+static void coalesce(mqLane_t *lane, const char *topic, uint8_t topicLen) {
+    // mark older unsent records with the same topic as dead
+    uint16_t pos = lane->tail;
+    uint16_t used = 0;
+    while (used < lane->used) {
+        mqRecord_t rec;
+        ringRead(lane, pos, &rec, sizeof(rec));
+        if (!(rec.flags & MQ_DEAD) && (rec.topicLen == topicLen) && isTopicEqual(lane, pos, topic, topicLen)) {
+            rec.flags |= MQ_DEAD;
+            ringWrite(lane, pos, &rec, sizeof(rec));
+            lane->stats.coalesced++;
+        }
+        used += recordLen(&rec);
+        pos = (pos + recordLen(&rec)) % lane->size;
+    }
+}
+
+esp_err_t mqttQueuePush(uint8_t laneId, const char *topic, const char *data, uint16_t len, uint8_t flags) {
+    if ((sem_queue == NULL) || (laneId >= MQ_LANES))
+        return ESP_ERR_INVALID_STATE;
+    mqLane_t *lane = &lanes[laneId];
+    size_t topicLen = strlen(topic);
+    mqRecord_t rec = {
+        .flags = flags,
+        .topicLen = topicLen,
+        .dataLen = len
+    };
+    if ((topicLen > 255) || (recordLen(&rec) > MIN(MAX_RECORD, lane->size))) {
+        ESP_LOGE(TAG, "Message for %s is too long", topic);
+        lane->stats.dropped++;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (xSemaphoreTake(sem_queue, portMAX_DELAY) != pdTRUE)
+        return ESP_FAIL;
+    if (flags & MQ_KEEP_LATEST)
+        coalesce(lane, topic, topicLen);
+    // message of higher priority overrides the same topic waiting in lower lanes,
+    // otherwise old value could be delivered after the new one
+    for (uint8_t i=laneId+1; i<MQ_LANES; i++)
+        coalesce(&lanes[i], topic, topicLen);
+    while (lane->size - lane->used < recordLen(&rec))
+        spillTail(lane);
+    ringWrite(lane, lane->head, &rec, sizeof(rec));
+    ringWrite(lane, (lane->head + sizeof(rec)) % lane->size, topic, topicLen);
+    ringWrite(lane, (lane->head + sizeof(rec) + topicLen) % lane->size, data, len);
+    lane->head = (lane->head + recordLen(&rec)) % lane->size;
+    lane->used += recordLen(&rec);
+    lane->stats.queued++;
+    xSemaphoreGive(sem_queue);
+    return ESP_OK;
+}
+
+static esp_err_t peekSpoolRecord(mqLane_t *lane, mqRecord_t *rec) {
+    FILE *f = fopen(lane->spoolPath, "r");
+    if (f == NULL)
+        return ESP_FAIL;
+    esp_err_t err = ESP_FAIL;
+    if ((fseek(f, lane->spoolRead, SEEK_SET) == 0) &&
+        (fread(rec, 1, sizeof(mqRecord_t), f) == sizeof(mqRecord_t)) &&
+        (recordLen(rec) <= MAX_RECORD) &&
+        (fread(txBuf, 1, rec->topicLen + rec->dataLen, f) == rec->topicLen + rec->dataLen)) {
+        err = ESP_OK;
+    }
+    fclose(f);
+    return err;
+}
+
+static void resetSpool(mqLane_t *lane) {
+    unlink(lane->spoolPath);
+    lane->spoolRead = 0;
+    lane->spoolSize = 0;
+}
+
+esp_err_t mqttQueuePeek(uint8_t laneId, char **topic, char **data, uint16_t *len, bool *replay) {
+    // copy oldest message of the lane to tx buffer, spool first
+    if ((sem_queue == NULL) || (laneId >= MQ_LANES))
+        return ESP_ERR_INVALID_STATE;
+    mqLane_t *lane = &lanes[laneId];
+    if (xSemaphoreTake(sem_queue, portMAX_DELAY) != pdTRUE)
+        return ESP_FAIL;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    mqRecord_t rec;
+    if (lane->spoolRead < lane->spoolSize) {
+        if (peekSpoolRecord(lane, &rec) == ESP_OK) {
+            peekSpool = true;
+            err = ESP_OK;
+        } else {
+            ESP_LOGE(TAG, "Spool %s is corrupted, %d bytes lost", lane->name, lane->spoolSize - lane->spoolRead);
+            lane->stats.dropped++;
+            resetSpool(lane);
+        }
+    }
+    if (err != ESP_OK) {
+        while (lane->used > 0) {
+            ringRead(lane, lane->tail, &rec, sizeof(rec));
+            if (!(rec.flags & MQ_DEAD)) {
+                ringRead(lane, (lane->tail + sizeof(rec)) % lane->size, txBuf, rec.topicLen + rec.dataLen);
+                peekSpool = false;
+                peekSeq = lane->tailSeq;
+                err = ESP_OK;
+                break;
+            }
+            ringDropTail(lane);
+        }
+    }
+    if (err == ESP_OK) {
+        // topic\0data\0
+        memmove(txBuf + rec.topicLen + 1, txBuf + rec.topicLen, rec.dataLen);
+        txBuf[rec.topicLen] = 0;
+        txBuf[rec.topicLen + 1 + rec.dataLen] = 0;
+        *topic = txBuf;
+        *data = txBuf + rec.topicLen + 1;
+        *len = rec.dataLen;
+        *replay = peekSpool;
+        peekLen = recordLen(&rec);
+        peekLane = lane;
+    }
+    xSemaphoreGive(sem_queue);
+    return err;
+}
+
+void mqttQueuePop() {
+    // remove message returned by last peek
+    if ((peekLane == NULL) || (xSemaphoreTake(sem_queue, portMAX_DELAY) != pdTRUE))
+        return;
+    mqLane_t *lane = peekLane;
+    if (peekSpool) {
+        lane->spoolRead += peekLen;
+        lane->stats.replayed++;
+        if (lane->spoolRead >= lane->spoolSize)
+            resetSpool(lane);
+    } else if ((peekSeq == lane->tailSeq) && (lane->used > 0)) {
+        // record could be spilled meanwhile, then it will be sent again from spool
+        ringDropTail(lane);
+        lane->stats.sent++;
+    }
+    peekLane = NULL;
+    peekLen = 0;
+    xSemaphoreGive(sem_queue);
+}
+
+void writeMQTTQueueStats(jsonWriter_t *w) {
+    jsonObject(w);
+    for (uint8_t i=0; i<MQ_LANES; i++) {
+        mqLane_t *lane = &lanes[i];
+        jsonKey(w, lane->name);
+        jsonObject(w);
+        jsonKey(w, "queued");
+        jsonInt(w, lane->stats.queued);
+        jsonKey(w, "sent");
+        jsonInt(w, lane->stats.sent);
+        jsonKey(w, "coalesced");
+        jsonInt(w, lane->stats.coalesced);
+        jsonKey(w, "spilled");
+        jsonInt(w, lane->stats.spilled);
+        jsonKey(w, "replayed");
+        jsonInt(w, lane->stats.replayed);
+        jsonKey(w, "dropped");
+        jsonInt(w, lane->stats.dropped);
+        jsonKey(w, "ringUsed");
+        jsonInt(w, lane->used);
+        jsonKey(w, "spool");
+        jsonInt(w, lane->spoolSize - lane->spoolRead);
+        jsonObjectEnd(w);
+    }
+    jsonObjectEnd(w);
+}
+
+esp_err_t initMQTTQueue() {
+    if (!getNetworkConfigValueBool2("mqtt", "enabled"))
+        return ESP_OK;
+    sem_queue = xSemaphoreCreateMutex();
+    if (sem_queue == NULL) {
+        ESP_LOGE(TAG, "Can't create queue semaphore");
+        return ESP_FAIL;
+    }
+    if (getNetworkConfigValueInt2("mqtt", "spoolSize") > 0)
+        spoolMax = getNetworkConfigValueInt2("mqtt", "spoolSize") * 1024;
+    // messages left from previous run
+    for (uint8_t i=0; i<MQ_LANES; i++) {
+        struct stat st;
+        if (stat(lanes[i].spoolPath, &st) == 0) {
+            lanes[i].spoolSize = st.st_size;
+            ESP_LOGI(TAG, "Spool %s has %d bytes to replay", lanes[i].name, lanes[i].spoolSize);
+        }
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,12 @@
+//mqttQueue.h
+#include "esp_err.h"
+
+#define MQ_LANES        3    // same order as mqttClass_t, first lane is sent first
+#define MQ_KEEP_LATEST  0x01 // older unsent messages with the same topic are dropped
+
+esp_err_t initMQTTQueue();
+esp_err_t mqttQueuePush(uint8_t laneId, const char *topic, const char *data, uint16_t len, uint8_t flags);
+esp_err_t mqttQueuePeek(uint8_t laneId, char **topic, char **data, uint16_t *len, bool *replay);
+void mqttQueuePop();
+struct jsonWriter;
+void writeMQTTQueueStats(struct jsonWriter *w);
@@ -0,0 +1,153 @@
+//mqttRouter.c
+// inbound commands "<hostname>/in/<command>". Event handler only resolves command
+// and copies payload to the queue, handlers run in the router task
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "core.h"
+#include "mqttRouter.h"
+#include "json.h"
+
+static const char *TAG = "MQTTROUTER";
+
+#define MAX_COMMANDS    8
+#define MAX_PAYLOAD     256
+#define QUEUE_LEN       8
+
+typedef struct {
+    char name[16];
+    uint8_t nameLen;
+    mqttCommandHandler_t handler;
+} mqttCommand_t;
+
+typedef struct {
+    uint8_t command;
+    uint16_t len;
+    char data[MAX_PAYLOAD + 1];
+} mqttInbound_t;
+
+typedef struct {
+    uint32_t received;
+    uint32_t handled;
+    uint32_t unknown;
+    uint32_t tooLong;
+    uint32_t dropped;
+    uint32_t failed;
+} mqttRouterStats_t;
+
+static mqttCommand_t commands[MAX_COMMANDS];
+static uint8_t commandsQty = 0;
+static QueueHandle_t inboundQueue = NULL;
+static char prefix[64];
+static uint8_t prefixLen = 0;
+static mqttRouterStats_t stats;
+
+esp_err_t mqttRouterRegister(const char *command, mqttCommandHandler_t handler) {
+    // called on init only, before subscribe
+    if ((commandsQty >= MAX_COMMANDS) || (strlen(command) >= sizeof(commands[0].name)))
+        return ESP_ERR_NO_MEM;
+    strlcpy(commands[commandsQty].name, command, sizeof(commands[0].name));
+    commands[commandsQty].nameLen = strlen(command);
+    commands[commandsQty].handler = handler;
+    commandsQty++;
+    return ESP_OK;
+}
+
+const char *mqttRouterTopic() {
+    // subscription filter
+    return prefix;
+}
+
+static int8_t findCommand(const char *name, uint16_t len) {
+    for (uint8_t i=0; i<commandsQty; i++) {
+        if ((commands[i].nameLen == len) && !memcmp(commands[i].name, name, len))
+            return i;
+    }
+    return -1;
+}
+
+esp_err_t mqttRouterDispatch(const char *topic, uint16_t topicLen, const char *data, uint16_t dataLen) {
+    // runs in mqtt client task, never blocks
+    stats.received++;
+    int8_t command = -1;
+    if ((topicLen > prefixLen - 1) && !memcmp(topic, prefix, prefixLen - 1))
+        command = findCommand(topic + prefixLen - 1, topicLen - prefixLen + 1);
+    if (command < 0) {
+        ESP_LOGW(TAG, "Unknown command %.*s", topicLen, topic);
+        stats.unknown++;
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (dataLen > MAX_PAYLOAD) {
+        ESP_LOGE(TAG, "Payload for %s is too long %d", commands[command].name, dataLen);
+        stats.tooLong++;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    mqttInbound_t msg;
+    msg.command = command;
+    msg.len = dataLen;
+    memcpy(msg.data, data, dataLen);
+    msg.data[dataLen] = 0;
+    if ((inboundQueue == NULL) || (xQueueSend(inboundQueue, &msg, 0) != pdTRUE)) {
+        ESP_LOGE(TAG, "Inbound queue is full, %s dropped", commands[command].name);
+        stats.dropped++;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void mqttRouterTask(void *pvParameter) {
+    static mqttInbound_t msg;
+    while (1) {
+        if (xQueueReceive(inboundQueue, &msg, portMAX_DELAY) != pdTRUE)
+            continue;
+        mqttCommand_t *command = &commands[msg.command];
+        ESP_LOGI(TAG, "Command %s %s", command->name, msg.data);
+        if (command->handler(msg.data, msg.len) == ESP_OK) {
+            stats.handled++;
+        } else {
+            ESP_LOGE(TAG, "Command %s failed", command->name);
+            stats.failed++;
+        }
+    }
+}
+
+void writeMQTTRouterStats(jsonWriter_t *w) {
+    jsonObject(w);
+    jsonKey(w, "received");
+    jsonInt(w, stats.received);
+    jsonKey(w, "handled");
+    jsonInt(w, stats.handled);
+    jsonKey(w, "unknown");
+    jsonInt(w, stats.unknown);
+    jsonKey(w, "tooLong");
+    jsonInt(w, stats.tooLong);
+    jsonKey(w, "dropped");
+    jsonInt(w, stats.dropped);
+    jsonKey(w, "failed");
+    jsonInt(w, stats.failed);
+    jsonObjectEnd(w);
+}
+
+esp_err_t initMQTTRouter() {
+    char *hostname = getNetworkConfigValueString("hostname");
+    if ((hostname == NULL) || (strlen(hostname) + sizeof("/in/#") > sizeof(prefix))) {
+        ESP_LOGE(TAG, "Wrong hostname for inbound topics");
+        free(hostname);
+        return ESP_FAIL;
+    }
+    // "<hostname>/in/#", without "#" it's the command prefix
+    strcpy(prefix, hostname);
+    free(hostname);
+    strcat(prefix, "/in/#");
+    prefixLen = strlen(prefix);
+    inboundQueue = xQueueCreate(QUEUE_LEN, sizeof(mqttInbound_t));
+    if (inboundQueue == NULL) {
+        ESP_LOGE(TAG, "Can't create inbound queue");
+        return ESP_FAIL;
+    }
+    xTaskCreate(&mqttRouterTask, "mqttRouterTask", 4096, NULL, 5, NULL);
+    return ESP_OK;
+}
@@ -0,0 +1,13 @@
+//mqttRouter.h
+#include <stdint.h>
+#include "esp_err.h"
+
+// payload is zero terminated copy, valid during the call
+typedef esp_err_t (*mqttCommandHandler_t)(const char *data, uint16_t len);
+
+esp_err_t initMQTTRouter();
+esp_err_t mqttRouterRegister(const char *command, mqttCommandHandler_t handler);
+esp_err_t mqttRouterDispatch(const char *topic, uint16_t topicLen, const char *data, uint16_t dataLen);
+const char *mqttRouterTopic();
+struct jsonWriter;
+void writeMQTTRouterStats(struct jsonWriter *w);
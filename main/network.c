@@ -8,10 +8,12 @@
 #include "lwip/ip_addr.h"
 #include "freertos/event_groups.h"
 #include <string.h>
+#include <stdlib.h>
 #include "esp_sntp.h"
 #include "driver/gpio.h"
 #include "udp_logging.h"
 #include "mqtt.h"
+#include "scheduler.h"
 #include "esp_smartconfig.h"
 
 #define AP_SSID "HomeIO"
@@ -32,6 +34,13 @@ bool networkInited = false;
 wifi_config_t wifi_config;
 char ethIP[16] = "0.0.0.0", wifiIP[16] = "0.0.0.0";
 
+static void setAddr(char *value, void *addr) {
+    // takes allocated value of network config
+    if (value != NULL)
+        ipaddr_aton(value, (ip_addr_t *)addr);
+    free(value);
+}
+
 uint32_t getOwnAddr() {
     return ownAddr;
 }
@@ -84,9 +93,11 @@ void networkEvent(bool ready) {
         }
         if (getNetworkConfigValueBool2("rlog", "enabled")) {
             ESP_LOGI(TAG, "Running rlog");
-            udp_logging_init(getNetworkConfigValueString2("rlog", "server"),
+            char *server = getNetworkConfigValueString2("rlog", "server");
+            udp_logging_init(server,
                              getNetworkConfigValueInt2("rlog", "port"), 
                              udp_logging_vprintf);
+            free(server);
         }
     } else {
         ESP_LOGE(TAG, "Network down");
@@ -159,7 +170,10 @@ esp_err_t initEth() {
     netif = eth_netif; 
     // Set default handlers to process TCP/IP stuffs
     ESP_ERROR_CHECK(esp_eth_set_default_handlers(eth_netif));
-    ESP_ERROR_CHECK(esp_netif_set_hostname(eth_netif, getNetworkConfigValueString("hostname")));
+    // netif keeps own copy of hostname
+    char *hostname = getNetworkConfigValueString("hostname");
+    ESP_ERROR_CHECK(esp_netif_set_hostname(eth_netif, hostname));
+    free(hostname);
     // Register user defined event handers
     ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL));
@@ -190,14 +204,14 @@ esp_err_t initEth() {
     
     if (!getNetworkConfigValueBool2("eth", "dhcp")) {
         // static ip    
-        ESP_LOGI(TAG, "Set static IP %s", getNetworkConfigValueString2("eth", "ip"));
         esp_netif_ip_info_t ip_info;
-        ipaddr_aton(getNetworkConfigValueString2("eth", "ip"), (ip_addr_t *)&ip_info.ip);
-        ipaddr_aton(getNetworkConfigValueString2("eth", "netmask"), (ip_addr_t *)&ip_info.netmask);
-        ipaddr_aton(getNetworkConfigValueString2("eth", "gateway"), (ip_addr_t *)&ip_info.gw);
+        setAddr(getNetworkConfigValueString2("eth", "ip"), &ip_info.ip);
+        setAddr(getNetworkConfigValueString2("eth", "netmask"), &ip_info.netmask);
+        setAddr(getNetworkConfigValueString2("eth", "gateway"), &ip_info.gw);
+        ESP_LOGI(TAG, "Set static IP " IPSTR, IP2STR(&ip_info.ip));
         esp_netif_dns_info_t dns;
         //IP4_ADDR(&dns.ip.u_addr.ip4, 8, 8, 8, 8);     
-        ipaddr_aton(getNetworkConfigValueString("dns"), (ip_addr_t *)&dns.ip.u_addr.ip4);
+        setAddr(getNetworkConfigValueString("dns"), &dns.ip.u_addr.ip4);
         
         esp_netif_dhcp_status_t status;
         esp_netif_dhcpc_get_status(eth_netif, &status);
@@ -264,14 +278,17 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 }
 
 esp_err_t wifi_init_sta(void) {
-    if (getNetworkConfigValueString2("wifi", "ssid") == NULL) {
+    char *ssid = getNetworkConfigValueString2("wifi", "ssid");
+    if (ssid == NULL) {
         ESP_LOGE(TAG, "No SSID present. Changing to AP mode");
         return ESP_FAIL;
     }
     s_wifi_event_group = xEventGroupCreate();
     esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
     netif = sta_netif;
-    esp_netif_set_hostname(sta_netif, getNetworkConfigValueString("hostname"));
+    char *hostname = getNetworkConfigValueString("hostname");
+    esp_netif_set_hostname(sta_netif, hostname);
+    free(hostname);
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -283,22 +300,25 @@ esp_err_t wifi_init_sta(void) {
         // IP4_ADDR(&ip_info.ip, 192, 168, 99, 19);
         // IP4_ADDR(&ip_info.gw, 192, 168, 99, 98);
         // IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
-        ipaddr_aton(getNetworkConfigValueString2("wifi", "ip"), (ip_addr_t *)&ip_info.ip);
-        ipaddr_aton(getNetworkConfigValueString2("wifi", "netmask"), (ip_addr_t *)&ip_info.netmask);
-        ipaddr_aton(getNetworkConfigValueString2("wifi", "gateway"), (ip_addr_t *)&ip_info.gw);
+        setAddr(getNetworkConfigValueString2("wifi", "ip"), &ip_info.ip);
+        setAddr(getNetworkConfigValueString2("wifi", "netmask"), &ip_info.netmask);
+        setAddr(getNetworkConfigValueString2("wifi", "gateway"), &ip_info.gw);
         esp_netif_set_ip_info(sta_netif, &ip_info);
 
         esp_netif_dns_info_t dns;
         //IP4_ADDR(&dns.ip.u_addr.ip4, 8, 8, 8, 8);
-        ipaddr_aton(getNetworkConfigValueString("dns"), (ip_addr_t *)&dns.ip.u_addr.ip4);
+        setAddr(getNetworkConfigValueString("dns"), &dns.ip.u_addr.ip4);
         esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
     }
 
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &sta_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_got_ip_event_handler, NULL));
 
-    strcpy((char *)wifi_config.sta.ssid, getNetworkConfigValueString2("wifi", "ssid"));
-    strcpy((char *)wifi_config.sta.password, getNetworkConfigValueString2("wifi", "pass"));
+    char *pass = getNetworkConfigValueString2("wifi", "pass");
+    strlcpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+    strlcpy((char *)wifi_config.sta.password, pass != NULL ? pass : "", sizeof(wifi_config.sta.password));
+    free(ssid);
+    free(pass);
 
     // strcpy((char *)wifi_config.sta.ssid, "Alana");
     // strcpy((char *)wifi_config.sta.password, "zxcv1234");
@@ -349,11 +369,15 @@ void time_sync_notification_cb(struct timeval *tv) {
     struct tm timeinfo;
     time(&now);
     char strftime_buf[64];    
-    setenv("TZ", getNetworkConfigValueString("ntpTZ"), 1);
+    char *tz = getNetworkConfigValueString("ntpTZ");
+    if (tz != NULL)
+        setenv("TZ", tz, 1);
+    free(tz);
     tzset();
     localtime_r(&now, &timeinfo);
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
     ESP_LOGI(TAG, "The current date/time is: %s", strftime_buf);
+    schedulerTimeChanged();
     //char str[100];
     //sprintf(str, "SNTP current time is %s", strftime_buf);    
 }
@@ -372,8 +396,10 @@ void sntpInit() {
     ESP_LOGI(TAG, "Initializing SNTP");
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     //sntp_setservername(0, "pool.ntp.org");    
-    ESP_LOGI(TAG, "NTP server is %s", getNetworkConfigValueString("ntpserver"));
-    sntp_setservername(0, getNetworkConfigValueString("ntpserver"));
+    // sntp keeps the pointer, copy lives forever
+    char *server = getNetworkConfigValueString("ntpserver");
+    ESP_LOGI(TAG, "NTP server is %s", server);
+    sntp_setservername(0, server);
     sntp_set_time_sync_notification_cb(time_sync_notification_cb);
     sntp_init();
 
@@ -3,25 +3,160 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_http_client.h"
-#include "esp_https_ota.h"
+#include "esp_timer.h"
 #include "nvs.h"
 #include "nvs_flash.h"
+#include "esp_http_server.h"
+#include "mbedtls/sha256.h"
 #include "core.h"
 #include "storage.h"
+#include "json.h"
+#include "live.h"
+#include "mqtt.h"
+#include "topics.h"
+#include "chunkWriter.h"
+#include "ota.h"
 
 static const char *TAG = "OTA";
 // extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
 // extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
 #define OTA_URL_SIZE 256
+#define OTA_CHUNK           4096
+#define OTA_HEADER_SIZE     (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+#define OTA_PROGRESS_STEP   10  // percent, logged and pushed to live clients and mqtt
+#define OTA_TIMEOUTS        5
+#define OTA_RETRIES         10  // reconnects in a row without new data
+#define OTA_RETRY_DELAY     2000
+#define OTA_REDIRECTS       5
+#define OTA_MQTT_SIZE       192
 
-bool taskState = false;
+typedef struct {
+    const char *state;
+    const char *error;
+    uint32_t received;
+    uint32_t total;
+    uint32_t rate;          // KB/s from start
+    uint16_t reconnects;
+    int64_t start;
+} otaProgress_t;
+
+// network fills one chunk while other one is written to flash
+typedef struct {
+    chunkWriter_t chunks;
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    bool begun;
+    const char *error;      // first error of writer task
+    mbedtls_sha256_context sha;
+} otaWriter_t;
+
+bool taskState = false;         // owner of next partition, push upload or download task
+static int64_t deadline = 0;    // esp_timer time, 0 - download is not limited
+static otaProgress_t progress = {.state = "idle"};
+static portMUX_TYPE progressMux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool takeOTA() {
+    // httpd and executor tasks may start update at the same time
+    bool expected = false;
+    return __atomic_compare_exchange_n(&taskState, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void releaseOTA() {
+    __atomic_store_n(&taskState, false, __ATOMIC_RELEASE);
+}
+
+static void startProgress(const char *state, uint32_t total) {
+    portENTER_CRITICAL(&progressMux);
+    progress.state = state;
+    progress.error = NULL;
+    progress.received = 0;
+    progress.total = total;
+    progress.rate = 0;
+    progress.reconnects = 0;
+    progress.start = esp_timer_get_time();
+    portEXIT_CRITICAL(&progressMux);
+}
+
+static void setProgress(const char *state, const char *error, uint32_t received) {
+    uint32_t elapsed = (esp_timer_get_time() - progress.start) / 1000;
+    portENTER_CRITICAL(&progressMux);
+    progress.state = state;
+    progress.error = error;
+    progress.received = received;
+    progress.rate = elapsed > 0 ? (uint64_t)received * 1000 / 1024 / elapsed : 0;
+    portEXIT_CRITICAL(&progressMux);
+}
+
+static void setProgressTotal(uint32_t total) {
+    portENTER_CRITICAL(&progressMux);
+    progress.total = total;
+    portEXIT_CRITICAL(&progressMux);
+}
+
+static void countReconnect() {
+    portENTER_CRITICAL(&progressMux);
+    progress.reconnects++;
+    portEXIT_CRITICAL(&progressMux);
+}
+
+void writeOTAProgress(jsonWriter_t *w) {
+    otaProgress_t value;
+    portENTER_CRITICAL(&progressMux);
+    value = progress;
+    portEXIT_CRITICAL(&progressMux);
+    jsonObject(w);
+    jsonKey(w, "state");
+    jsonString(w, value.state);
+    jsonKey(w, "received");
+    jsonInt(w, value.received);
+    jsonKey(w, "total");
+    jsonInt(w, value.total);
+    jsonKey(w, "rate");
+    jsonInt(w, value.rate);
+    jsonKey(w, "reconnects");
+    jsonInt(w, value.reconnects);
+    if (value.error != NULL) {
+        jsonKey(w, "error");
+        jsonString(w, value.error);
+    }
+    jsonObjectEnd(w);
+}
+
+static void publishProgress(const char *event, bool live) {
+    // live clients get short event, mqtt gets whole progress as json in any format.
+    // Live frames are sent by httpd task, they wait while push OTA holds it
+    char payload[OTA_MQTT_SIZE];
+    jsonWriter_t w;
+    if (live)
+        liveNotify("ota", event);
+    if (!getNetworkConfigValueBool2("mqtt", "enabled"))
+        return;
+    jsonInit(&w, payload, sizeof(payload), NULL, NULL);
+    writeOTAProgress(&w);
+    if (jsonFinish(&w) == ESP_OK)
+        mqttPublishTopic(MQTT_STATE, TOPIC_OTA, payload, w.len);
+}
+
+static void notifyProgress(const char *state, uint32_t received, uint32_t total, uint8_t *step, bool live) {
+    char percent[8];
+    uint8_t value = (uint64_t)received * 100 / total;
+    setProgress(state, NULL, received);
+    if (value < *step)
+        return;
+    *step = value - value % OTA_PROGRESS_STEP + OTA_PROGRESS_STEP;
+    ESP_LOGI(TAG, "Received %d%%", value);
+    sprintf(percent, "%d", value);
+    publishProgress(percent, live);
+}
 
 char* getCurrentVersion() {
     esp_app_desc_t running_app_info;
@@ -54,100 +189,333 @@ static esp_err_t validate_image_header(esp_app_desc_t *new_app_info)
     return ESP_OK;
 }
 
+static const char *checkImageHeader(const uint8_t *data) {
+    // error text, NULL for image of other version
+    esp_app_desc_t desc;
+    if (data[0] != ESP_IMAGE_HEADER_MAGIC)
+        return "Not a firmware image";
+    memcpy(&desc, data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(desc));
+    if (desc.magic_word != ESP_APP_DESC_MAGIC_WORD)
+        return "No application description";
+    ESP_LOGI(TAG, "New firmware version: %s", desc.version);
+    if (validate_image_header(&desc) != ESP_OK)
+        return "Same version is running";
+    return NULL;
+}
+
+static const char *writeImage(otaWriter_t *writer, const chunk_t *chunk) {
+    if (!writer->begun) {
+        // first chunk holds whole header, OTA_CHUNK > OTA_HEADER_SIZE
+        const char *error = checkImageHeader((uint8_t*)chunk->data);
+        if (error != NULL)
+            return error;
+        // sectors are erased while writing, no wait for whole partition erase
+        if (esp_ota_begin(writer->partition, OTA_WITH_SEQUENTIAL_WRITES, &writer->handle) != ESP_OK)
+            return "Can't begin OTA";
+        writer->begun = true;
+    }
+    mbedtls_sha256_update_ret(&writer->sha, (uint8_t*)chunk->data, chunk->len);
+    if (esp_ota_write(writer->handle, chunk->data, chunk->len) != ESP_OK)
+        return "Failed to write image";
+    return NULL;
+}
+
+static esp_err_t writeChunk(void *ctx, const chunk_t *chunk) {
+    // writer task
+    otaWriter_t *writer = ctx;
+    writer->error = writeImage(writer, chunk);
+    return writer->error == NULL ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t startWriter(otaWriter_t *writer, const esp_partition_t *partition) {
+    memset(writer, 0, sizeof(otaWriter_t));
+    writer->partition = partition;
+    mbedtls_sha256_init(&writer->sha);
+    mbedtls_sha256_starts_ret(&writer->sha, 0);
+    esp_err_t err = chunkWriterStart(&writer->chunks, "otaWriter", OTA_CHUNK, writeChunk, writer);
+    if (err != ESP_OK)
+        mbedtls_sha256_free(&writer->sha);
+    return err;
+}
+
+static const char *finishWriter(otaWriter_t *writer, const char *error, const char *expected, char *hash) {
+    // waits for queued chunks, checks and activates image. hash gets hex SHA-256 of written data
+    uint8_t digest[32];
+    if (chunkWriterFinish(&writer->chunks) != ESP_OK)
+        error = writer->error;
+    mbedtls_sha256_finish_ret(&writer->sha, digest);
+    mbedtls_sha256_free(&writer->sha);
+    for (uint8_t i=0; i<sizeof(digest); i++)
+        sprintf(hash + i * 2, "%02x", digest[i]);
+    if ((error == NULL) && (expected != NULL) && (expected[0] != 0) && strcasecmp(expected, hash))
+        error = "SHA-256 mismatch";
+    if (writer->begun) {
+        // also releases handle of failed update
+        esp_err_t err = esp_ota_end(writer->handle);
+        if ((error == NULL) && (err != ESP_OK))
+            error = "Image validation failed";
+    } else if (error == NULL)
+        error = "Empty image";
+    if ((error == NULL) && (esp_ota_set_boot_partition(writer->partition) != ESP_OK))
+        error = "Can't set boot partition";
+    return error;
+}
+
+static void finishProgress(const char *error, uint32_t received, const char *hash) {
+    if (error != NULL) {
+        ESP_LOGE(TAG, "OTA failed: %s", error);
+        setProgress("failed", error, received);
+        publishProgress("failed", true);
+        return;
+    }
+    ESP_LOGI(TAG, "OTA done, %d bytes, %d KB/s, %d reconnects, sha256 %s. Rebooting ...",
+             received, progress.rate, progress.reconnects, hash);
+    setProgress("done", NULL, received);
+    publishProgress("done", true);
+}
+
+static int openImage(esp_http_client_handle_t client, uint32_t offset, uint32_t total, uint32_t *skip,
+                     const char **error) {
+    // one connection, continues from offset. Returns image bytes left in response,
+    // 0 for temporary failure and -1 with error when retry does not help
+    char range[32];
+    int len, status;
+    *skip = 0;
+    if (offset > 0) {
+        snprintf(range, sizeof(range), "bytes=%u-", offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    for (uint8_t redirects=0; ; redirects++) {
+        if (esp_http_client_open(client, 0) != ESP_OK)
+            return 0;
+        len = esp_http_client_fetch_headers(client);
+        status = esp_http_client_get_status_code(client);
+        if ((status < 300) || (status >= 400) || (status == 304))
+            break;
+        // Location becomes url of client, reconnects go there directly. Range header is kept
+        if ((redirects >= OTA_REDIRECTS) || (esp_http_client_set_redirection(client) != ESP_OK)) {
+            *error = "Wrong redirect";
+            return -1;
+        }
+        ESP_LOGI(TAG, "Redirected, %d", status);
+        esp_http_client_close(client);
+    }
+    if (esp_http_client_is_chunked_response(client)) {
+        *error = "Image size is unknown, chunked response";
+        return -1;
+    }
+    if (len < 0)
+        return 0;
+    if ((status == 206) && (offset > 0) && (offset + len == total))
+        return len;
+    if ((status == 200) && (len > 0) && ((total == 0) || (len == total))) {
+        // whole image, server without Range support, received part is skipped
+        *skip = offset;
+        return len;
+    }
+    ESP_LOGE(TAG, "Unexpected response %d, %d bytes from %d", status, len, offset);
+    if (status >= 500)
+        return 0;
+    *error = "Wrong server response";
+    return -1;
+}
+
+static bool isExpired() {
+    return (deadline != 0) && (esp_timer_get_time() >= deadline);
+}
+
+static const char *downloadImage(esp_http_client_handle_t client, otaWriter_t *writer) {
+    // reconnects with Range after network errors, data in hand is not downloaded again.
+    // received counts queued chunks and current partial chunk
+    chunk_t chunk = {.data = NULL, .len = 0};
+    uint32_t received = 0;
+    uint32_t total = 0;
+    uint32_t skip;
+    uint8_t retries = 0;
+    uint8_t step = 0;
+    const char *error = NULL;
+    while (1) {
+        int len = openImage(client, received, total, &skip, &error);
+        if (len < 0)
+            return error;
+        if ((len > 0) && (total == 0)) {
+            total = len;
+            if ((total < OTA_HEADER_SIZE) || (total > writer->partition->size))
+                return "Wrong image size";
+            setProgressTotal(total);
+        }
+        uint32_t start = received;
+        while ((len > 0) && (received < total)) {
+            if (isExpired())
+                return "Timeout";
+            if ((chunk.data == NULL) && !chunkWriterGet(&writer->chunks, &chunk))
+                return NULL;
+            size_t size = OTA_CHUNK - chunk.len;
+            if (skip > 0)
+                size = skip < size ? skip : size;
+            else if (total - received < size)
+                size = total - received;
+            int read = esp_http_client_read(client, chunk.data + chunk.len, size);
+            if (read <= 0)
+                break;
+            if (skip > 0) {
+                skip -= read;
+                continue;
+            }
+            chunk.len += read;
+            received += read;
+            if ((chunk.len == OTA_CHUNK) || (received == total)) {
+                chunkWriterPut(&writer->chunks, &chunk);
+                chunk.data = NULL;
+                notifyProgress("downloading", received, total, &step, true);
+            }
+        }
+        esp_http_client_close(client);
+        if ((total > 0) && (received == total))
+            return NULL;
+        if (received > start)
+            retries = 0;
+        if (++retries > OTA_RETRIES)
+            return "Connection lost";
+        if (isExpired())
+            return "Timeout";
+        countReconnect();
+        ESP_LOGW(TAG, "Connection lost at %d of %d, reconnect %d", received, total, retries);
+        setProgress("reconnecting", NULL, received);
+        vTaskDelay(OTA_RETRY_DELAY * retries / portTICK_PERIOD_MS);
+    }
+}
+
 void otaTask(void *pvParameter)
 {
     // wait 20 seconds for network ready
     vTaskDelay(5000 / portTICK_RATE_MS);
     ESP_LOGI(TAG, "Starting OTA update");
+    char hash[65];
+    char *buffer = NULL;
+    const char *error = NULL;
+    otaWriter_t writer;
+    const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
     char* url = getNetworkConfigValueString("otaurl");
-    if (url == NULL) {
-        ESP_LOGE(TAG, "No URL for OTA defined!");
-        taskState = false;
-        vTaskDelete(NULL);
-        goto ota_end2;
-    }
-    esp_err_t ota_finish_err = ESP_OK;
-    char * buffer;
-    if (loadTextFile("/config/ca_cert.pem", &buffer) != ESP_OK) {
-        ESP_LOGE(TAG, "Can't load certificate!");
-        taskState = false;
+    startProgress("downloading", 0);
+    if (url == NULL)
+        error = "No URL for OTA defined";
+    else if (loadTextFile("/config/ca_cert.pem", &buffer) != ESP_OK)
+        error = "Can't load certificate";
+    else if ((next == NULL) || (startWriter(&writer, next) != ESP_OK))
+        error = "Can't start OTA";
+    if (error != NULL) {
+        free(buffer);
+        free(url);
+        finishProgress(error, 0, NULL);
+        releaseOTA();
         vTaskDelete(NULL);
-        goto ota_end2;
+        return;
     }
     esp_http_client_config_t config = {
         .url = url,
         // .cert_pem = (char *)server_cert_pem_start,
         .cert_pem = buffer,
         .timeout_ms = 5000,
+        .keep_alive_enable = true,
     };
-
     config.skip_cert_common_name_check = true;
 
-    esp_https_ota_config_t ota_config = {
-        .http_config = &config,
-    };
-
-    esp_https_ota_handle_t https_ota_handle = NULL;
-    esp_err_t err = esp_https_ota_begin(&ota_config, &https_ota_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "ESP HTTPS OTA Begin failed");
-        taskState = false;
-        vTaskDelete(NULL);
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL)
+        error = "Can't init HTTP client";
+    else {
+        error = downloadImage(client, &writer);
+        esp_http_client_cleanup(client);
     }
+    error = finishWriter(&writer, error, NULL, hash);
+    free(buffer);
+    free(url);
+    finishProgress(error, progress.received, hash);
+    releaseOTA();
+    if (error == NULL)
+        scheduleReboot();
+    vTaskDelete(NULL);
+}
 
-    esp_app_desc_t app_desc;
-    err = esp_https_ota_get_img_desc(https_ota_handle, &app_desc);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_https_ota_read_img_desc failed");
-        goto ota_end;
-    }    
-    err = validate_image_header(&app_desc);
-    if (err != ESP_OK) {
-        //ESP_LOGE(TAG, "image header verification failed");
-        // TODO : reset or restore normal mode???
-        goto ota_end;
+static esp_err_t receiveChunk(httpd_req_t *req, chunk_t *chunk, size_t size) {
+    uint8_t timeouts = 0;
+    while (chunk->len < size) {
+        int received = httpd_req_recv(req, chunk->data + chunk->len, size - chunk->len);
+        if ((received == HTTPD_SOCK_ERR_TIMEOUT) && (++timeouts < OTA_TIMEOUTS))
+            continue;
+        if (received <= 0)
+            return ESP_FAIL;
+        chunk->len += received;
     }
+    return ESP_OK;
+}
 
-    while (1) {
-        err = esp_https_ota_perform(https_ota_handle);
-        if (err != ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
+esp_err_t receiveOTA(httpd_req_t *req) {
+    // POST /service/ota, image goes straight to next ota partition.
+    // SHA-256 of body is counted on the fly and checked against X-SHA256 header when it is given.
+    // Handler holds httpd task until image is written, progress goes to mqtt only
+    char expected[65] = {0};
+    char hash[65];
+    char response[160];
+    uint8_t step = 0;
+    const char *error = NULL;
+    otaWriter_t writer;
+    chunk_t chunk;
+    const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
+
+    if (!takeOTA()) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "OTA already running");
+        return ESP_FAIL;
+    }
+    if ((next == NULL) || (req->content_len < OTA_HEADER_SIZE) || (req->content_len > next->size)) {
+        releaseOTA();
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Wrong image size");
+        return ESP_FAIL;
+    }
+    if (startWriter(&writer, next) != ESP_OK) {
+        releaseOTA();
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Can't allocate buffer");
+        return ESP_FAIL;
+    }
+    httpd_req_get_hdr_value_str(req, "X-SHA256", expected, sizeof(expected));
+    ESP_LOGI(TAG, "Receiving %d bytes to %s", req->content_len, next->label);
+    startProgress("receiving", req->content_len);
+    size_t received = 0;
+    while ((received < req->content_len) && chunkWriterGet(&writer.chunks, &chunk)) {
+        size_t len = req->content_len - received < OTA_CHUNK ? req->content_len - received : OTA_CHUNK;
+        if (receiveChunk(req, &chunk, len) != ESP_OK) {
+            error = "Failed to receive image";
             break;
         }
-        // esp_https_ota_perform returns after every read operation which gives user the ability to
-        // monitor the status of OTA upgrade by calling esp_https_ota_get_image_len_read, which gives length of image
-        // data read so far.
-        ESP_LOGD(TAG, "Image bytes read: %d", esp_https_ota_get_image_len_read(https_ota_handle));
-    }
-
-    if (esp_https_ota_is_complete_data_received(https_ota_handle) != true) {
-        // the OTA image was not completely received and user can customise the response to this situation.
-        ESP_LOGE(TAG, "Complete data was not received.");
-    }
-
-ota_end:
-    taskState = false;
-    ota_finish_err = esp_https_ota_finish(https_ota_handle);
-    if ((err == ESP_OK) && (ota_finish_err == ESP_OK)) {
-        ESP_LOGI(TAG, "ESP_HTTPS_OTA upgrade successful. Rebooting ...");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        esp_restart();
-    } else {
-        if (ota_finish_err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
-        }
-        ESP_LOGE(TAG, "ESP_HTTPS_OTA upgrade failed %d", ota_finish_err);
-        vTaskDelete(NULL);
+        chunkWriterPut(&writer.chunks, &chunk);
+        received += len;
+        notifyProgress("receiving", received, req->content_len, &step, false);
     }
-ota_end2:    
-    vTaskDelete(NULL);
+    error = finishWriter(&writer, error, expected, hash);
+    finishProgress(error, received, hash);
+    releaseOTA();
+    if (error != NULL) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+        return ESP_FAIL;
+    }
+    snprintf(response, sizeof(response), "{\"result\":\"OK\",\"sha256\":\"%s\"}", hash);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, response);
+    scheduleReboot();
+    return ESP_OK;
 }
 
-void startOTA() {
-    if (taskState) {
+esp_err_t startOTA(uint32_t timeout) {
+    // timeout ms for whole update, 0 - no limit
+    if (!takeOTA()) {
         ESP_LOGE(TAG, "OTA update already running");
-        return;
+        return ESP_ERR_INVALID_STATE;
+    }
+    deadline = timeout > 0 ? esp_timer_get_time() + (int64_t)timeout * 1000 : 0;
+    if (xTaskCreate(&otaTask, "otaTask", 1024 * 8, NULL, 5, NULL) != pdPASS) {
+        releaseOTA();
+        return ESP_ERR_NO_MEM;
     }
-    taskState = true;    
-    xTaskCreate(&otaTask, "otaTask", 1024 * 8, NULL, 5, NULL);
+    return ESP_OK;
 }
-
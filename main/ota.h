@@ -1,4 +1,9 @@
 // ota.h
 
-void startOTA();
-char* getCurrentVersion();
\ No newline at end of file
+#include "esp_http_server.h"
+
+esp_err_t startOTA(uint32_t timeout);
+char* getCurrentVersion();
+esp_err_t receiveOTA(httpd_req_t *req);
+struct jsonWriter;
+void writeOTAProgress(struct jsonWriter *w);
\ No newline at end of file
@@ -0,0 +1,96 @@
+//policy.c
+// single place deciding whether sample should be published.
+// "policy": {"<name>": {"deadband": 0.5, "relative": 2, "minInterval": 10, "heartbeat": 600}}
+// relative is percent, intervals are seconds
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "core.h"
+#include "policy.h"
+#include "json.h"
+
+static const char *TAG = "POLICY";
+
+#define MAX_POLICIES    8
+
+static policy_t *policies[MAX_POLICIES];
+static uint8_t policiesQty = 0;
+
+void policyInit(policy_t *policy, const char *name, int32_t scale, int32_t defDeadband) {
+    memset(policy, 0, sizeof(policy_t));
+    policy->name = name;
+    policy->scale = scale;
+    policy->deadband = defDeadband;
+    cJSON *jPolicy = getNetworkConfigValueObject2("policy", name);
+    if (jPolicy != NULL) {
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jPolicy, "deadband")))
+            policy->deadband = lround(cJSON_GetObjectItem(jPolicy, "deadband")->valuedouble * scale);
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jPolicy, "relative")))
+            policy->relative = lround(cJSON_GetObjectItem(jPolicy, "relative")->valuedouble * 10);
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jPolicy, "minInterval")))
+            policy->minInterval = cJSON_GetObjectItem(jPolicy, "minInterval")->valueint * 1000;
+        if (cJSON_IsNumber(cJSON_GetObjectItem(jPolicy, "heartbeat")))
+            policy->heartbeat = cJSON_GetObjectItem(jPolicy, "heartbeat")->valueint * 1000;
+        cJSON_Delete(jPolicy);
+    }
+    if (policiesQty < MAX_POLICIES)
+        policies[policiesQty++] = policy;
+    ESP_LOGI(TAG, "Policy %s deadband %d relative %d permille, min interval %d ms heartbeat %d ms", name,
+             policy->deadband, policy->relative, policy->minInterval, policy->heartbeat);
+}
+
+void policyStateInit(policyState_t *state) {
+    state->valid = false;
+    state->deadband = -1;
+}
+
+bool policyCheck(policy_t *policy, policyState_t *state, int32_t value) {
+    // true if value has to be published, state is updated then
+    int64_t now = esp_timer_get_time() / 1000;
+    bool forward;
+    if (!state->valid) {
+        forward = true;
+    } else {
+        int32_t threshold = state->deadband >= 0 ? state->deadband : policy->deadband;
+        int32_t relative = (int64_t)abs(state->value) * policy->relative / 1000;
+        if (relative > threshold)
+            threshold = relative;
+        forward = abs(value - state->value) > threshold;
+        if (forward && (now - state->time < policy->minInterval)) {
+            forward = false;
+            policy->limited++;
+        } else if (!forward && (policy->heartbeat > 0) && (now - state->time >= policy->heartbeat)) {
+            forward = true;
+            policy->heartbeats++;
+        }
+    }
+    if (!forward) {
+        policy->suppressed++;
+        return false;
+    }
+    state->value = value;
+    state->time = now;
+    state->valid = true;
+    policy->forwarded++;
+    return true;
+}
+
+void writePolicyStats(jsonWriter_t *w) {
+    jsonObject(w);
+    for (uint8_t i=0; i<policiesQty; i++) {
+        jsonKey(w, policies[i]->name);
+        jsonObject(w);
+        jsonKey(w, "forwarded");
+        jsonInt(w, policies[i]->forwarded);
+        jsonKey(w, "suppressed");
+        jsonInt(w, policies[i]->suppressed);
+        jsonKey(w, "limited");
+        jsonInt(w, policies[i]->limited);
+        jsonKey(w, "heartbeats");
+        jsonInt(w, policies[i]->heartbeats);
+        jsonObjectEnd(w);
+    }
+    jsonObjectEnd(w);
+}
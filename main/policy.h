@@ -0,0 +1,31 @@
+//policy.h
+#include <stdint.h>
+#include <stdbool.h>
+
+// publish policy of sensor kind, values are integers scaled by "scale"
+typedef struct {
+    const char *name;
+    int32_t scale;          // config values are multiplied by scale
+    int32_t deadband;       // absolute, scaled
+    uint16_t relative;      // permille of last value
+    uint32_t minInterval;   // ms between publishes
+    uint32_t heartbeat;     // ms of silence forcing publish, 0 - never
+    uint32_t forwarded;
+    uint32_t suppressed;
+    uint32_t limited;       // changed but suppressed by min interval
+    uint32_t heartbeats;
+} policy_t;
+
+// state of one sensor
+typedef struct {
+    int32_t value;          // last forwarded value
+    int32_t deadband;       // overrides policy deadband if >= 0
+    int64_t time;           // ms of last forwarded value
+    bool valid;
+} policyState_t;
+
+void policyInit(policy_t *policy, const char *name, int32_t scale, int32_t defDeadband);
+void policyStateInit(policyState_t *state);
+bool policyCheck(policy_t *policy, policyState_t *state, int32_t value);
+struct jsonWriter;
+void writePolicyStats(struct jsonWriter *w);
@@ -0,0 +1,38 @@
+//routes.h
+// included by .c files only
+#include <stdint.h>
+#include "esp_http_server.h"
+#include "cJSON.h"
+
+struct jsonWriter;
+
+#define QUERY_SIZE      128
+#define QUERY_PARAMS    8
+
+#define ROUTE_MUTATES   0x01 // changes device state, logged
+#define ROUTE_CONTENT   0x02 // request body is parsed as JSON before handler, handler owns the tree
+
+// url query split in place, lives on caller stack
+typedef struct {
+    char buf[QUERY_SIZE];
+    const char *keys[QUERY_PARAMS];
+    const char *values[QUERY_PARAMS];
+    uint8_t count;
+} query_t;
+
+typedef esp_err_t (*routeHandler_t)(httpd_req_t *req, const query_t *query, cJSON *body, char **response);
+// writes response into streaming writer, it is sent by chunks
+typedef esp_err_t (*routeJsonHandler_t)(httpd_req_t *req, const query_t *query, struct jsonWriter *w);
+
+typedef struct {
+    const char *path;
+    httpd_method_t method;
+    uint8_t flags;
+    const char *type;       // NULL keeps httpd default
+    routeHandler_t handler;
+    routeJsonHandler_t json;    // instead of handler
+    uint8_t state;          // state domains of json response, it is cached and handler gets NULL request
+} route_t;
+
+const char *getQueryValue(const query_t *query, const char *name);
+esp_err_t registerRoutes(const route_t *table, uint8_t qty);
@@ -0,0 +1,262 @@
+//scheduler.c
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "cJSON.h"
+#include "core.h"
+#include "executor.h"
+#include "cron.h"
+#include "scheduler.h"
+
+static const char *TAG = "SCHEDULER";
+
+#define DEF_GRACE       60  // seconds, task still may be started within this period
+#define MAX_DELAY_SEC   3600 // re-check at least once an hour
+#define MIN_VALID_YEAR  (2020 - 1900)
+
+// compiled scheduler task
+typedef struct {
+    char name[32];
+    cron_t cron;
+    uint8_t sec;
+    uint16_t grace; // seconds
+    time_t next;    // next fire time
+    action_t *actions;
+    uint8_t actionsQty;
+} schedulerEntry_t;
+
+static schedulerEntry_t *entries = NULL;
+static uint16_t entriesQty = 0;
+static time_t lastProcessed = 0;
+static esp_timer_handle_t schedulerTimer = NULL;
+static SemaphoreHandle_t sem_scheduler = NULL;
+
+static bool isTimeValid(time_t now) {
+    struct tm timeinfo;
+    localtime_r(&now, &timeinfo);
+    return timeinfo.tm_year >= MIN_VALID_YEAR;
+}
+
+static time_t getNextTime(schedulerEntry_t *entry, time_t from) {
+    // nearest time >= from
+    time_t res = cronNext(&entry->cron, from - entry->sec);
+    if (res == 0)
+        return 0;
+    return res + entry->sec;
+}
+
+static time_t getFromTime(schedulerEntry_t *entry, time_t now) {
+    // catch up tasks missed within grace period, but never fire twice
+    time_t from = now - entry->grace;
+    if (from <= lastProcessed)
+        from = lastProcessed + 1;
+    return from;
+}
+
+static void sortEntry(uint16_t idx) {
+    // entries are sorted by next fire time, move one entry to its place
+    schedulerEntry_t tmp = entries[idx];
+    while ((idx > 0) && (entries[idx-1].next > tmp.next)) {
+        entries[idx] = entries[idx-1];
+        idx--;
+    }
+    while ((idx < entriesQty-1) && (entries[idx+1].next < tmp.next)) {
+        entries[idx] = entries[idx+1];
+        idx++;
+    }
+    entries[idx] = tmp;
+}
+
+static void armTimer(time_t now) {
+    esp_timer_stop(schedulerTimer);
+    if (entriesQty == 0)
+        return;
+    time_t delay = entries[0].next - now;
+    if (delay < 0)
+        delay = 0;
+    if (delay > MAX_DELAY_SEC)
+        delay = MAX_DELAY_SEC;
+    ESP_LOGD(TAG, "Next task %s in %ld sec", entries[0].name, (long)delay);
+    esp_timer_start_once(schedulerTimer, (uint64_t)delay * 1000000);
+}
+
+static void processEntry(schedulerEntry_t *entry) {
+    // actions are executed by executor task, never wait here
+    ESP_LOGI(TAG, "Task %s. Processing %d actions", entry->name, entry->actionsQty);
+    for (uint8_t i=0; i<entry->actionsQty; i++) {
+        action_t action = entry->actions[i];
+        strlcpy(action.source, entry->name, sizeof(action.source));
+        executorEnqueue(&action);
+    }
+}
+
+static void freeEntries(schedulerEntry_t *table, uint16_t qty) {
+    for (uint16_t i=0; i<qty; i++)
+        free(table[i].actions);
+    free(table);
+}
+
+static void processScheduler() {
+    time_t now;
+    time(&now);
+    if (!isTimeValid(now))
+        return;
+    while ((entriesQty > 0) && (entries[0].next != 0) && (entries[0].next <= now)) {
+        processEntry(&entries[0]);
+        entries[0].next = getNextTime(&entries[0], now + 1);
+        if (entries[0].next == 0) {
+            // never fires again
+            free(entries[0].actions);
+            entries[0] = entries[--entriesQty];
+        }
+        if (entriesQty > 0)
+            sortEntry(0);
+    }
+    lastProcessed = now;
+    armTimer(now);
+}
+
+static void schedulerTimerCb(void *arg) {
+    if (xSemaphoreTake(sem_scheduler, portMAX_DELAY) == pdTRUE) {
+        processScheduler();
+        xSemaphoreGive(sem_scheduler);
+    }
+}
+
+static bool compileEntry(cJSON *task, schedulerEntry_t *entry) {
+    if (!cJSON_IsTrue(cJSON_GetObjectItem(task, "enabled")))
+        return false;
+    memset(entry, 0, sizeof(schedulerEntry_t));
+    if (cJSON_IsString(cJSON_GetObjectItem(task, "name")))
+        strlcpy(entry->name, cJSON_GetObjectItem(task, "name")->valuestring, sizeof(entry->name));
+    else
+        strcpy(entry->name, "Noname task");
+    if (cJSON_IsNumber(cJSON_GetObjectItem(task, "sec")))
+        entry->sec = cJSON_GetObjectItem(task, "sec")->valueint % 60;
+    // grace in minutes
+    if (cJSON_IsNumber(cJSON_GetObjectItem(task, "grace")))
+        entry->grace = cJSON_GetObjectItem(task, "grace")->valueint * 60;
+    else
+        entry->grace = DEF_GRACE;
+    if (cJSON_IsString(cJSON_GetObjectItem(task, "cron"))) {
+        if (cronParse(cJSON_GetObjectItem(task, "cron")->valuestring, &entry->cron) != ESP_OK) {
+            ESP_LOGE(TAG, "Task %s has wrong cron", entry->name);
+            return false;
+        }
+    } else if (cJSON_IsNumber(cJSON_GetObjectItem(task, "time"))) {
+        // time in minutes from 0:00 and optional days of week
+        uint16_t minutes = cJSON_GetObjectItem(task, "time")->valueint;
+        if (minutes >= 24*60) {
+            ESP_LOGE(TAG, "Task %s has wrong time", entry->name);
+            return false;
+        }
+        uint8_t dow = 0x7F;
+        if (cJSON_IsArray(cJSON_GetObjectItem(task, "dow"))) {
+            dow = 0;
+            cJSON *iterator = NULL;
+            cJSON_ArrayForEach(iterator, cJSON_GetObjectItem(task, "dow")) {
+                if (cJSON_IsNumber(iterator) && (iterator->valueint >= 0) && (iterator->valueint < 7))
+                    dow |= 1 << iterator->valueint;
+            }
+            if (dow == 0)
+                return false;
+        }
+        cronFromTime(&entry->cron, minutes / 60, minutes % 60, dow);
+    } else {
+        return false;
+    }
+    // actions
+    cJSON *jActions = cJSON_GetObjectItem(task, "actions");
+    if (cJSON_GetArraySize(jActions) > 0) {
+        entry->actions = malloc(cJSON_GetArraySize(jActions) * sizeof(action_t));
+        if (entry->actions == NULL) {
+            ESP_LOGE(TAG, "Can't allocate actions for task %s", entry->name);
+            return false;
+        }
+        cJSON *jAction = NULL;
+        cJSON_ArrayForEach(jAction, jActions) {
+            if (parseAction(jAction, &entry->actions[entry->actionsQty]) == ESP_OK)
+                entry->actionsQty++;
+            else
+                ESP_LOGE(TAG, "Task %s has wrong action", entry->name);
+        }
+    }
+    return true;
+}
+
+esp_err_t schedulerRebuild() {
+    if (sem_scheduler == NULL)
+        return ESP_FAIL;
+    // entries copy everything they need, config is not referenced after compile
+    cJSON *jScheduler = lockSchedulerConfig();
+    int qty = cJSON_GetArraySize(jScheduler);
+    schedulerEntry_t *newEntries = NULL;
+    if (qty > 0) {
+        newEntries = malloc(qty * sizeof(schedulerEntry_t));
+        if (newEntries == NULL) {
+            unlockSchedulerConfig();
+            ESP_LOGE(TAG, "Can't allocate scheduler table");
+            return ESP_FAIL;
+        }
+    }
+    uint16_t newQty = 0;
+    cJSON *childTask = NULL;
+    cJSON_ArrayForEach(childTask, jScheduler) {
+        if ((newQty < qty) && compileEntry(childTask, &newEntries[newQty]))
+            newQty++;
+    }
+    unlockSchedulerConfig();
+
+    if (xSemaphoreTake(sem_scheduler, portMAX_DELAY) != pdTRUE) {
+        free(newEntries);
+        return ESP_FAIL;
+    }
+    freeEntries(entries, entriesQty);
+    entries = newEntries;
+    entriesQty = 0;
+    time_t now;
+    time(&now);
+    if (isTimeValid(now)) {
+        for (uint16_t i=0; i<newQty; i++) {
+            entries[i].next = getNextTime(&entries[i], getFromTime(&entries[i], now));
+            if (entries[i].next != 0) {
+                entries[entriesQty++] = entries[i];
+                sortEntry(entriesQty-1);
+            } else {
+                free(entries[i].actions);
+            }
+        }
+        armTimer(now);
+    } else {
+        // timeline will be built after time sync, compiled entries are not kept
+        for (uint16_t i=0; i<newQty; i++)
+            free(entries[i].actions);
+        esp_timer_stop(schedulerTimer);
+    }
+    xSemaphoreGive(sem_scheduler);
+    ESP_LOGI(TAG, "Scheduler rebuilt. Active tasks %d", entriesQty);
+    return ESP_OK;
+}
+
+void schedulerTimeChanged() {
+    schedulerRebuild();
+}
+
+void initScheduler() {
+    ESP_LOGI(TAG, "Initiating scheduler");
+    if (sem_scheduler == NULL) {
+        sem_scheduler = xSemaphoreCreateMutex();
+        esp_timer_create_args_t timerArgs = {
+            .callback = &schedulerTimerCb,
+            .name = "scheduler"
+        };
+        if ((sem_scheduler == NULL) || (esp_timer_create(&timerArgs, &schedulerTimer) != ESP_OK)) {
+            ESP_LOGE(TAG, "Can't create scheduler timer");
+            return;
+        }
+    }
+    schedulerRebuild();
+}
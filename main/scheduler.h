@@ -0,0 +1,6 @@
+//scheduler.h
+#include "esp_err.h"
+
+void initScheduler();
+esp_err_t schedulerRebuild();
+void schedulerTimeChanged();
@@ -0,0 +1,26 @@
+//seqlock.c
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "seqlock.h"
+
+void seqlockWriteBegin(seqlock_t *lock) {
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlockWriteEnd(seqlock_t *lock) {
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t seqlockReadBegin(const seqlock_t *lock) {
+    uint32_t seq;
+    // writer may be preempted by reader on the same core, so reader sleeps instead of spinning
+    while ((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1)
+        vTaskDelay(1);
+    return seq;
+}
+
+bool seqlockReadRetry(const seqlock_t *lock, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != start;
+}
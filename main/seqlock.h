@@ -0,0 +1,15 @@
+//seqlock.h
+// included by .c files only
+#include <stdint.h>
+#include <stdbool.h>
+
+// sequence lock for small structures with one writer. Readers never block,
+// they copy data and retry when writer was active meanwhile
+typedef struct {
+    volatile uint32_t seq;  // odd while writer is active
+} seqlock_t;
+
+void seqlockWriteBegin(seqlock_t *lock);
+void seqlockWriteEnd(seqlock_t *lock);
+uint32_t seqlockReadBegin(const seqlock_t *lock);
+bool seqlockReadRetry(const seqlock_t *lock, uint32_t start);
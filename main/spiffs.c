@@ -35,3 +35,11 @@ esp_err_t initSPIFFS(char *mount_point)
     }
     return ESP_OK;
 }
+
+esp_err_t getSPIFFSFree(size_t *free)
+{
+    size_t total = 0, used = 0;
+    esp_err_t ret = esp_spiffs_info(NULL, &total, &used);
+    *free = (ret == ESP_OK) && (total > used) ? total - used : 0;
+    return ret;
+}
@@ -1,2 +1,3 @@
 //spiffs.h
 esp_err_t initSPIFFS(char *mount_point);
+esp_err_t getSPIFFSFree(size_t *free);
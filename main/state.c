@@ -0,0 +1,47 @@
+//state.c
+// versions of state domains, version of several domains is sum of their versions,
+// so it grows when any of them changes
+#include "freertos/FreeRTOS.h"
+#include "json.h"
+#include "state.h"
+
+#define STATE_DOMAINS   5
+
+static const char *domainNames[STATE_DOMAINS] = {"sensors", "water", "pressure", "config", "scheduler"};
+static uint32_t versions[STATE_DOMAINS] = {1, 1, 1, 1, 1};
+static portMUX_TYPE versionsMux = portMUX_INITIALIZER_UNLOCKED;
+static stateNotify_t stateNotify = NULL;
+
+void stateChanged(uint8_t domain) {
+    // any task
+    portENTER_CRITICAL(&versionsMux);
+    for (uint8_t i=0; i<STATE_DOMAINS; i++)
+        if (domain & (1 << i))
+            versions[i]++;
+    portEXIT_CRITICAL(&versionsMux);
+    if (stateNotify != NULL)
+        stateNotify();
+}
+
+uint32_t stateVersion(uint8_t domains) {
+    uint32_t version = 0;
+    portENTER_CRITICAL(&versionsMux);
+    for (uint8_t i=0; i<STATE_DOMAINS; i++)
+        if (domains & (1 << i))
+            version += versions[i];
+    portEXIT_CRITICAL(&versionsMux);
+    return version;
+}
+
+void stateSetNotify(stateNotify_t notify) {
+    stateNotify = notify;
+}
+
+void writeStateVersions(jsonWriter_t *w) {
+    jsonObject(w);
+    for (uint8_t i=0; i<STATE_DOMAINS; i++) {
+        jsonKey(w, domainNames[i]);
+        jsonInt(w, stateVersion(1 << i));
+    }
+    jsonObjectEnd(w);
+}
@@ -0,0 +1,19 @@
+//state.h
+#include <stdint.h>
+
+// state domains with monotonic versions, cached api responses and
+// long-polling clients depend on them
+#define STATE_SENSORS       0x01 // temperature values and temperatures config
+#define STATE_WATER         0x02
+#define STATE_PRESSURE      0x04
+#define STATE_CONFIG        0x08
+#define STATE_SCHEDULER     0x10
+#define STATE_ALL           0x1F
+
+typedef void (*stateNotify_t)();
+
+void stateChanged(uint8_t domain);
+uint32_t stateVersion(uint8_t domains);
+void stateSetNotify(stateNotify_t notify);
+struct jsonWriter;
+void writeStateVersions(struct jsonWriter *w);
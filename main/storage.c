@@ -9,14 +9,26 @@
 #include "spiffs.h"
 #include "webServer.h"
 #include "utils.h"
+#include "assets.h"
+#include "transfer.h"
+#include "chunkWriter.h"
 #include "lwip/sockets.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "core.h"
 
 //#define USE_SD
 #define PATH_SIZE 100
 #define BUF_SIZE 2048
 #define MOUNT_POINT "/storage"
-#define MAX_FILE_SIZE   (200*1024) // 200 KB
-#define MAX_FILE_SIZE_STR "200KB"
+#define UPLOAD_CHUNK        4096
+#define UPLOAD_CHUNK_MIN    1024
+#define UPLOAD_CHUNK_MAX    16384
+#define UPLOAD_TIMEOUTS     5
+#define UPLOAD_RESERVE      8192    // spiffs needs some free pages
+#define UPLOAD_BENCH_FILE   "bench.tmp"
 
 static const char *TAG = "STORAGE";
 
@@ -173,59 +185,85 @@ esp_err_t saveTextFile(char * filename, char * buffer) {
     return ESP_OK;
 }
 
-esp_err_t getFileWebPath(httpd_req_t *req, char* path) {    
-    ESP_LOGI(TAG, "Opening file path %s", path);
-    
-    FILE* f = fopen(path, "r");    
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file %s for reading", req->uri);
-        return ESP_FAIL;
+static esp_err_t sendAsset(httpd_req_t *req, const asset_t *asset, bool gzip, const char *path, const char *data, size_t size) {
+    // whole file or requested range, long responses go to transfer workers so httpd task stays free for api
+    char head[TRANSFER_HEAD_SIZE];
+    char contentRange[40];
+    size_t offset, len;
+    uint16_t status = getAssetRange(req, asset, size, &offset, &len);
+    if (status == 416) {
+        snprintf(contentRange, sizeof(contentRange), "bytes */%d", size);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", contentRange);
+        return httpd_resp_send(req, NULL, 0);
     }
-
-    char *buffer = malloc(BUF_SIZE);    
-    if (buffer == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate buffer");
-        return ESP_FAIL;
+    int headLen = formatAssetHeaders(head, sizeof(head), asset, gzip);
+    if ((status == 206) && (headLen < sizeof(head)))
+        headLen += snprintf(head + headLen, sizeof(head) - headLen, "Content-Range: bytes %d-%d/%d\r\n",
+                            offset, offset + len - 1, size);
+    if (headLen >= sizeof(head)) {
+        ESP_LOGE(TAG, "Headers of %s are too long", req->uri);
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Headers are too long");
     }
+    esp_err_t err = transferStart(req, status == 206 ? "206 Partial Content" : "200 OK", path, data, offset, len, head);
+    if (err == ESP_ERR_NO_MEM) {
+        ESP_LOGW(TAG, "No free transfer for %s", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "2");
+        return httpd_resp_sendstr(req, "Too many transfers");
+    }
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "File sending failed %s", req->uri);
+    return err;
+}
 
-    set_content_type_from_file(req, path);
-    size_t chunksize;
-    do {
-        /* Read file in chunks into the scratch buffer */
-        //chunksize = fread(buffer, 1, SCRATCH_BUFSIZE, f);
-        chunksize = fread(buffer, 1, BUF_SIZE, f);
-
-        if (chunksize > 0) {
-            /* Send the buffer contents as HTTP response chunk */
-            if (httpd_resp_send_chunk(req, buffer, chunksize) != ESP_OK) {
-                fclose(f);
-                ESP_LOGE(TAG, "File sending failed!");
-                /* Abort sending file */
-                httpd_resp_sendstr_chunk(req, NULL);
-                /* Respond with 500 Internal Server Error */
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-                free(buffer);
-                return ESP_FAIL;
-            }
-        }
+static esp_err_t sendFile(httpd_req_t *req, char* path, asset_t *asset, bool gzip) {
+    // size and modification time come from file
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0) {
+        ESP_LOGE(TAG, "Failed to open file %s for reading", req->uri);
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+    }
+    asset->mtime = file_stat.st_mtime;
+    return sendAsset(req, asset, gzip, path, NULL, file_stat.st_size);
+}
 
-        /* Keep looping till the whole file is sent */
-    } while (chunksize != 0);
-    
-    fclose(f);
-    httpd_resp_send_chunk(req, NULL, 0);
-    free(buffer);
-    return ESP_OK;
+esp_err_t getFileWebPath(httpd_req_t *req, char* path) {    
+    asset_t asset = {.type = getContentType(path)};
+    return sendFile(req, path, &asset, false);
 }
 
 esp_err_t getFileWeb(httpd_req_t *req) {    
+    char uri[PATH_SIZE - 20];
     char path[PATH_SIZE];
+    size_t len = strcspn(req->uri, "?");
+    if (len >= sizeof(uri) - sizeof("index.html"))
+        return ESP_FAIL;
+    memcpy(uri, req->uri, len);
+    uri[len] = 0;
+    if (uri[len - 1] == '/') 
+        strcat(uri, "index.html");
     strcpy(path, getWWWroot());    
-    if (req->uri[strlen(req->uri) - 1] == '/') 
-        strcat(path, "/index.html");
-    else   
-        strcat(path, req->uri);    
-    return getFileWebPath(req, path);
+    strcat(path, uri);    
+
+    // known files get validators and gzip variant
+    asset_t asset;
+    if (!assetsFind(uri, &asset))
+        return sendFile(req, path, &asset, false);
+    if (isAssetNotModified(req, &asset)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", asset.etag);
+        return httpd_resp_send(req, NULL, 0);
+    }
+    // ranges are of plain file, gzip variant has same etag
+    bool gzip = asset.gzip && (httpd_req_get_hdr_value_len(req, "Range") == 0) && isGzipAccepted(req);
+    // image files are sent straight from mapped flash
+    if (asset.data != NULL)
+        return gzip ? sendAsset(req, &asset, gzip, NULL, asset.gzData, asset.gzSize) :
+                      sendAsset(req, &asset, gzip, NULL, asset.data, asset.size);
+    if (gzip)
+        strcat(path, ".gz");
+    return sendFile(req, path, &asset, gzip);
 }    
 
 esp_err_t getLogFile(httpd_req_t *req) {    
@@ -283,115 +321,157 @@ esp_err_t getLogFile(httpd_req_t *req) {
 //     return ESP_OK;
 // }
 
-esp_err_t setFileWeb(httpd_req_t *req) {
-    char filepath[PATH_SIZE];
-    FILE *fd = NULL;
-    struct stat file_stat;
-    strcpy(filepath, req->uri + sizeof("/service/upload"));
-    
-    /* Filename cannot have a trailing '/' */
-    if (filepath[strlen(filepath) - 1] == '/') {
-        ESP_LOGE(TAG, "Invalid filepath : %s", filepath);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filepath");
-        return ESP_FAIL;
-    }
+static esp_err_t writeUploadChunk(void *ctx, const chunk_t *chunk) {
+    // writer task
+    return fwrite(chunk->data, 1, chunk->len, (FILE*)ctx) == chunk->len ? ESP_OK : ESP_ERR_NO_MEM;
+}
 
-    if (stat(filepath, &file_stat) == 0) {
-        ESP_LOGE(TAG, "File already exists : %s", filepath);
-        /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
-        return ESP_FAIL;
-    }
+static size_t getUploadChunkSize(httpd_req_t *req) {
+    // ?chunk=N overrides config, for benchmark
+    char query[32];
+    char value[8];
+    size_t size = getNetworkConfigValueInt2("upload", "chunk");
+    if ((httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) &&
+        (httpd_query_key_value(query, "chunk", value, sizeof(value)) == ESP_OK))
+        size = atoi(value);
+    if (size == 0)
+        size = UPLOAD_CHUNK;
+    return size < UPLOAD_CHUNK_MIN ? UPLOAD_CHUNK_MIN : (size > UPLOAD_CHUNK_MAX ? UPLOAD_CHUNK_MAX : size);
+}
 
-    /* File cannot be larger than a limit */
-    if (req->content_len > MAX_FILE_SIZE) {
-        ESP_LOGE(TAG, "File too large : %d bytes", req->content_len);
-        /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
-                            "File size must be less than "
-                            MAX_FILE_SIZE_STR "!");
-        /* Return failure to close underlying connection else the
-         * incoming file content will keep the socket busy */
-        return ESP_FAIL;
+static esp_err_t fillChunk(httpd_req_t *req, chunk_t *chunk, size_t size) {
+    uint8_t timeouts = 0;
+    while (chunk->len < size) {
+        int received = httpd_req_recv(req, chunk->data + chunk->len, size - chunk->len);
+        if ((received == HTTPD_SOCK_ERR_TIMEOUT) && (++timeouts < UPLOAD_TIMEOUTS))
+            continue;
+        if (received <= 0)
+            return ESP_FAIL;
+        chunk->len += received;
     }
+    return ESP_OK;
+}
 
-    char fileFullPath[PATH_SIZE];    
-    strcpy(fileFullPath, getWWWroot()); 
-    //strcpy(fileFullPath, sdmount);
-    strcat(fileFullPath, "/");
-    strcat(fileFullPath, filepath);
+static esp_err_t receiveFile(httpd_req_t *req, const char *path, size_t chunkSize) {
+    // httpd task receives next chunk while writer task writes previous one to flash
+    chunkWriter_t writer;
+    chunk_t chunk;
+    FILE *f = fopen(path, "w");
+    if ((f == NULL) || (chunkWriterStart(&writer, "uploadWriter", chunkSize, writeUploadChunk, f) != ESP_OK)) {
+        ESP_LOGE(TAG, "Can't start upload of %s", path);
+        if (f != NULL)
+            fclose(f);
+        unlink(path);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    size_t remaining = req->content_len;
+    while ((remaining > 0) && (err == ESP_OK) && chunkWriterGet(&writer, &chunk)) {
+        err = fillChunk(req, &chunk, remaining < chunkSize ? remaining : chunkSize);
+        if (err == ESP_OK) {
+            remaining -= chunk.len;
+            chunkWriterPut(&writer, &chunk);
+        }
+    }
+    esp_err_t writeErr = chunkWriterFinish(&writer);
+    if (err == ESP_OK)
+        err = writeErr;
+    fclose(f);
+    if (err != ESP_OK)
+        unlink(path);
+    return err;
+}
 
-    fd = fopen(fileFullPath, "w");
-    if (!fd) {
-        ESP_LOGE(TAG, "Failed to create file : %s", fileFullPath);
-        /* Respond with 500 Internal Server Error */
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
-        return ESP_FAIL;
+static esp_err_t checkUploadSpace(httpd_req_t *req, const char *path) {
+    // replaced file gives its space back, benchmark has no path
+    size_t freeSize;
+    struct stat file_stat;
+    if (getSPIFFSFree(&freeSize) != ESP_OK)
+        return ESP_OK;
+    if ((path != NULL) && (stat(path, &file_stat) == 0))
+        freeSize += file_stat.st_size;
+    if (req->content_len + UPLOAD_RESERVE > freeSize) {
+        ESP_LOGE(TAG, "No space for %d bytes, %d free", req->content_len, freeSize);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not enough space on storage");
+        return ESP_ERR_NO_MEM;
     }
+    return ESP_OK;
+}
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    //char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
-    char *buf = malloc(BUF_SIZE);
-    if (buf == NULL) {
-        ESP_LOGE(TAG, "Cannot malloc buf!");
+static esp_err_t uploadFile(httpd_req_t *req, const char *path, const char *tmpPath, uint32_t *rate) {
+    // body goes to temporary file, it replaces file only when complete.
+    // Error response is sent here
+    size_t chunkSize = getUploadChunkSize(req);
+    int64_t start = esp_timer_get_time();
+    if (checkUploadSpace(req, path) != ESP_OK)
+        return ESP_FAIL;
+    esp_err_t err = receiveFile(req, tmpPath, chunkSize);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "File reception failed %s", esp_err_to_name(err));
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            err == ESP_ERR_NO_MEM ? "Failed to write file to storage" : "Failed to receive file");
         return ESP_FAIL;
     }
-    int received;
-
-    /* Content length of the request gives
-     * the size of the file being uploaded */
-    int remaining = req->content_len;
-
-    while (remaining > 0) {
-
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
-        /* Receive the file part by part into a buffer */
-        if ((received = httpd_req_recv(req, buf, MIN(remaining, BUF_SIZE))) <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Retry if timeout occurred */
-                continue;
-            }
-
-            /* In case of unrecoverable error,
-             * close and delete the unfinished file*/
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File reception failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file");
-            free(buf);
-            return ESP_FAIL;
-        }
-
-        /* Write buffer content to file on storage */
-        if (received && (received != fwrite(buf, 1, received, fd))) {
-            /* Couldn't write everything to file!
-             * Storage may be full? */
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File write failed!");
-            /* Respond with 500 Internal Server Error */
+    if (path != NULL) {
+        unlink(path);
+        if (rename(tmpPath, path) != 0) {
+            ESP_LOGE(TAG, "Can't rename %s", tmpPath);
+            unlink(tmpPath);
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
-            free(buf);
             return ESP_FAIL;
         }
+    }
+    uint32_t elapsed = (esp_timer_get_time() - start) / 1000;
+    *rate = elapsed > 0 ? (uint64_t)req->content_len * 1000 / 1024 / elapsed : 0;
+    ESP_LOGI(TAG, "Received %d bytes in %d ms, %d KB/s, chunk %d", req->content_len, elapsed, *rate, chunkSize);
+    return ESP_OK;
+}
 
-        /* Keep track of remaining size of
-         * the file left to be uploaded */
-        remaining -= received;
+esp_err_t setFileWeb(httpd_req_t *req) {
+    char filepath[PATH_SIZE];
+    char fileFullPath[PATH_SIZE];
+    char tmpPath[PATH_SIZE + 4];
+    char response[64];
+    uint32_t rate;
+    size_t len = strcspn(req->uri + sizeof("/service/upload"), "?");
+    if (len >= sizeof(filepath) - strlen(getWWWroot()) - 1) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid filepath");
+        return ESP_FAIL;
+    }
+    memcpy(filepath, req->uri + sizeof("/service/upload"), len);
+    filepath[len] = 0;
+    
+    /* Filename cannot have a trailing '/' */
+    if ((len == 0) || (filepath[len - 1] == '/')) {
+        ESP_LOGE(TAG, "Invalid filepath : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid filepath");
+        return ESP_FAIL;
     }
 
-    /* Close file upon upload completion */
-    fclose(fd);
-    ESP_LOGI(TAG, "File reception complete");
+    sprintf(fileFullPath, "%s/%s", getWWWroot(), filepath);
+    sprintf(tmpPath, "%s.tmp", fileFullPath);
+    if (uploadFile(req, fileFullPath, tmpPath, &rate) != ESP_OK)
+        return ESP_FAIL;
+    if (strcmp(filepath, "manifest.json") == 0)
+        assetsLoad();
 
-    /* Redirect onto root to see the updated file list */
-    // httpd_resp_set_status(req, "303 See Other");
-    // httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_sendstr(req, "File uploaded successfully");
-    free(buf);
+    snprintf(response, sizeof(response), "File uploaded successfully, %d KB/s", rate);
+    httpd_resp_sendstr(req, response);
+    return ESP_OK;
+}
+
+esp_err_t benchmarkUpload(httpd_req_t *req) {
+    // same pipeline as setFileWeb, file is removed
+    char tmpPath[PATH_SIZE];
+    char response[96];
+    uint32_t rate;
+    sprintf(tmpPath, "%s/%s", MOUNT_POINT, UPLOAD_BENCH_FILE);
+    if (uploadFile(req, NULL, tmpPath, &rate) != ESP_OK)
+        return ESP_FAIL;
+    unlink(tmpPath);
+    snprintf(response, sizeof(response), "{\"bytes\":%d,\"chunk\":%d,\"rate\":%d}", req->content_len, getUploadChunkSize(req), rate);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, response);
     return ESP_OK;
 }
 
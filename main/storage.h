@@ -6,6 +6,7 @@ esp_err_t loadTextFile(char * filename, char ** buffer);
 esp_err_t saveTextFile(char * filename, char * buffer);
 esp_err_t getFileWeb(httpd_req_t *req);
 esp_err_t setFileWeb(httpd_req_t *req);
+esp_err_t benchmarkUpload(httpd_req_t *req);
 esp_err_t writeLog(char* type, char* buffer);
 esp_err_t getLogFile(httpd_req_t *req);
 esp_err_t listDirectory(int socket, const char *dirpath);
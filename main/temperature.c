@@ -1,3 +1,6 @@
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
@@ -7,6 +10,7 @@
 #include "owb_rmt.h"
 #include "ds18b20.h"
 #include "core.h"
+#include "bus.h"
 
 static const char *TAG = "TEMPERATURE";
 #define GPIO_DS18B20_0       14
@@ -136,7 +140,16 @@ void temperatureTask(void *pvParameter) {
                     printf("  %d: %s %.1f    %d errors\n", i, rom_code_s, readings[i], errors_count[i]);
                 }
                 //printf("  %d: %.1f    %d errors\n", i, readings[i], errors_count[i]);
-                setTemperature(rom_code_s, readings[i]);    
+                reading_t reading = {
+                    .kind = READING_TEMPERATURE,
+                    .value = lroundf(readings[i] * 10),
+                    .decimals = 1,
+                    .time = time(NULL),
+                    .quality = errors[i] == DS18B20_OK ? READING_GOOD : READING_BAD,
+                    .flags = i == num_devices - 1 ? READING_CYCLE_END : 0
+                };
+                memcpy(&reading.id, device_rom_codes[i].bytes, sizeof(reading.id));
+                busPublish(&reading);
             }
 
             //vTaskDelayUntil(&last_wake_time, SAMPLE_PERIOD / portTICK_PERIOD_MS);
@@ -156,5 +169,6 @@ void initTemperature() {
     if (waitPeriod == 0)
         waitPeriod = 60;
     debug = getNetworkConfigValueBool2("temperature", "debug");
+    initTemperaturePolicy();
     xTaskCreate(&temperatureTask, "temperatureTask", 4096, NULL, 5, NULL);
 }
\ No newline at end of file
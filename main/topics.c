@@ -0,0 +1,166 @@
+//topics.c
+// registry of outbound topics "<hostname>/<suffix>". Strings are built once per
+// config load into a static pool, publishers keep handles
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "core.h"
+#include "mqttQueue.h"
+#include "topics.h"
+
+static const char *TAG = "TOPICS";
+
+#define POOL_SIZE           1024
+#define MAX_TOPICS          32
+#define MAX_LATEST_TOPICS   8
+#define DEF_LATEST_TOPICS   3
+
+typedef struct {
+    uint16_t offset;
+    uint8_t len;
+    uint8_t flags;
+} topic_t;
+
+// rebuild fills the other pool, names taken before stay valid until the next rebuild
+static char pools[2][POOL_SIZE];
+static char *pool = pools[0];
+static uint16_t poolUsed = 0;
+static topic_t topics[MAX_TOPICS];
+static uint8_t topicsQty = 0;
+static portMUX_TYPE topicsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *fixedTopics[TOPIC_FIXED_QTY] = {
+    "info", "temperatures", "temperatures/delta", "pressure", "pressureText", "water", "ota"
+};
+
+static const char defaultLatestTopics[DEF_LATEST_TOPICS][32] = {"info", "temperatures", "benchmark"};
+static char latestTopics[MAX_LATEST_TOPICS][32] = {"info", "temperatures", "benchmark"};
+static uint8_t latestTopicsQty = DEF_LATEST_TOPICS;
+
+static uint8_t loadLatestTopics(char latest[][32]) {
+    // defaults when config has no list
+    cJSON *jLatest = getNetworkConfigValueArray2("mqtt", "latest");
+    if (!cJSON_IsArray(jLatest)) {
+        memcpy(latest, defaultLatestTopics, sizeof(defaultLatestTopics));
+        return DEF_LATEST_TOPICS;
+    }
+    uint8_t qty = 0;
+    cJSON *iterator = NULL;
+    cJSON_ArrayForEach(iterator, jLatest) {
+        if (cJSON_IsString(iterator) && (qty < MAX_LATEST_TOPICS))
+            strlcpy(latest[qty++], iterator->valuestring, 32);
+    }
+    cJSON_Delete(jLatest);
+    return qty;
+}
+
+uint8_t topicFlagsByName(const char *topic) {
+    // topic suffix after hostname
+    const char *suffix = strchr(topic, '/');
+    if (suffix == NULL)
+        return 0;
+    suffix++;
+    for (uint8_t i=0; i<latestTopicsQty; i++) {
+        if (!strcmp(suffix, latestTopics[i]))
+            return MQ_KEEP_LATEST;
+    }
+    return 0;
+}
+
+static topicHandle_t addTopic(const char *hostname, const char *prefix, const char *name) {
+    // caller holds topicsMux
+    size_t hostLen = strlen(hostname);
+    size_t prefixLen = prefix != NULL ? strlen(prefix) : 0;
+    size_t nameLen = strlen(name);
+    size_t len = hostLen + 1 + prefixLen + nameLen;
+    if ((topicsQty >= MAX_TOPICS) || (len > 255) || (poolUsed + len + 1 > POOL_SIZE))
+        return TOPIC_NONE;
+    char *p = &pool[poolUsed];
+    memcpy(p, hostname, hostLen);
+    p[hostLen] = '/';
+    memcpy(p + hostLen + 1, prefix, prefixLen);
+    memcpy(p + hostLen + 1 + prefixLen, name, nameLen);
+    p[len] = 0;
+    topic_t *topic = &topics[topicsQty];
+    topic->offset = poolUsed;
+    topic->len = len;
+    topic->flags = topicFlagsByName(p);
+    poolUsed += len + 1;
+    return topicsQty++;
+}
+
+esp_err_t topicsRebuild() {
+    // on boot and when hostname or latest list could change. Handles above fixed topics
+    // are dropped, their owners register again
+    char latest[MAX_LATEST_TOPICS][32];
+    char *hostname = getNetworkConfigValueString("hostname");
+    if (hostname == NULL) {
+        ESP_LOGE(TAG, "No hostname defined");
+        return ESP_FAIL;
+    }
+    uint8_t latestQty = loadLatestTopics(latest);
+    esp_err_t err = ESP_OK;
+    portENTER_CRITICAL(&topicsMux);
+    memcpy(latestTopics, latest, sizeof(latest));
+    latestTopicsQty = latestQty;
+    pool = pool == pools[0] ? pools[1] : pools[0];
+    poolUsed = 0;
+    topicsQty = 0;
+    for (uint8_t i=0; i<TOPIC_FIXED_QTY; i++) {
+        if (addTopic(hostname, NULL, fixedTopics[i]) == TOPIC_NONE)
+            err = ESP_ERR_NO_MEM;
+    }
+    portEXIT_CRITICAL(&topicsMux);
+    free(hostname);
+    return err;
+}
+
+topicHandle_t topicRegister(const char *prefix, const char *name) {
+    // "<hostname>/<prefix><name>", existing handle is returned for the same topic.
+    // Not for the publish path, sensors register once
+    char *hostname = getNetworkConfigValueString("hostname");
+    if (hostname == NULL)
+        return TOPIC_NONE;
+    size_t hostLen = strlen(hostname);
+    size_t prefixLen = strlen(prefix);
+    topicHandle_t res = TOPIC_NONE;
+    portENTER_CRITICAL(&topicsMux);
+    for (uint8_t i=TOPIC_FIXED_QTY; i<topicsQty; i++) {
+        char *p = &pool[topics[i].offset];
+        if ((topics[i].len == hostLen + 1 + prefixLen + strlen(name)) &&
+            !strncmp(p + hostLen + 1, prefix, prefixLen) &&
+            !strcmp(p + hostLen + 1 + prefixLen, name)) {
+            res = i;
+            break;
+        }
+    }
+    if (res == TOPIC_NONE)
+        res = addTopic(hostname, prefix, name);
+    portEXIT_CRITICAL(&topicsMux);
+    free(hostname);
+    if (res == TOPIC_NONE)
+        ESP_LOGE(TAG, "No room for topic %s%s", prefix, name);
+    return res;
+}
+
+const char *topicName(topicHandle_t topic) {
+    portENTER_CRITICAL(&topicsMux);
+    const char *res = topic < topicsQty ? &pool[topics[topic].offset] : NULL;
+    portEXIT_CRITICAL(&topicsMux);
+    return res;
+}
+
+uint8_t topicLength(topicHandle_t topic) {
+    portENTER_CRITICAL(&topicsMux);
+    uint8_t res = topic < topicsQty ? topics[topic].len : 0;
+    portEXIT_CRITICAL(&topicsMux);
+    return res;
+}
+
+uint8_t topicFlags(topicHandle_t topic) {
+    portENTER_CRITICAL(&topicsMux);
+    uint8_t res = topic < topicsQty ? topics[topic].flags : 0;
+    portEXIT_CRITICAL(&topicsMux);
+    return res;
+}
@@ -0,0 +1,26 @@
+//topics.h
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef uint8_t topicHandle_t;
+
+#define TOPIC_NONE  0xFF
+
+// fixed topics, interned on every config load
+enum {
+    TOPIC_INFO = 0,
+    TOPIC_TEMPERATURES,
+    TOPIC_TEMPERATURES_DELTA,
+    TOPIC_PRESSURE,
+    TOPIC_PRESSURE_TEXT,
+    TOPIC_WATER,
+    TOPIC_OTA,
+    TOPIC_FIXED_QTY
+};
+
+esp_err_t topicsRebuild();
+topicHandle_t topicRegister(const char *prefix, const char *name);
+const char *topicName(topicHandle_t topic);
+uint8_t topicLength(topicHandle_t topic);
+uint8_t topicFlags(topicHandle_t topic);
+uint8_t topicFlagsByName(const char *topic);
@@ -0,0 +1,235 @@
+//transfer.c
+// file responses with Content-Length, written as raw http. Short ones are sent by
+// httpd task, long ones are taken by a small pool of workers. Handler returns without
+// response and worker writes it to the socket, so httpd keeps serving other sessions.
+// Socket closed by httpd meanwhile is closed by worker
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "json.h"
+#include "transfer.h"
+
+static const char *TAG = "TRANSFER";
+
+#define TRANSFER_WORKERS    2
+#define TRANSFER_QUEUE      2
+#define TRANSFER_SLOTS      (TRANSFER_WORKERS + TRANSFER_QUEUE)
+#define TRANSFER_BUF_SIZE   2048
+#define TRANSFER_PATH_SIZE  100
+
+typedef struct {
+    httpd_handle_t server;
+    int fd;
+    const char *status;
+    const char *data;   // mapped flash, NULL for file
+    size_t offset;
+    size_t size;        // bytes to send from offset
+    char path[TRANSFER_PATH_SIZE];
+    char head[TRANSFER_HEAD_SIZE];
+} transferJob_t;
+
+typedef esp_err_t (*transferSend_t)(void *ctx, const char *data, size_t len);
+
+typedef struct {
+    int fd;             // -1 for free slot
+    bool closed;        // session is closed by httpd, socket is closed by worker
+} transferSlot_t;
+
+static QueueHandle_t jobs = NULL;
+static transferSlot_t slots[TRANSFER_SLOTS];
+static portMUX_TYPE slotsMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t done = 0, failed = 0, rejected = 0;
+
+static bool takeSlot(int fd) {
+    bool res = false;
+    portENTER_CRITICAL(&slotsMux);
+    for (uint8_t i=0; i<TRANSFER_SLOTS; i++) {
+        if (slots[i].fd < 0) {
+            slots[i].fd = fd;
+            slots[i].closed = false;
+            res = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&slotsMux);
+    return res;
+}
+
+static bool releaseSlot(int fd) {
+    // true if socket has to be closed
+    bool closed = false;
+    portENTER_CRITICAL(&slotsMux);
+    for (uint8_t i=0; i<TRANSFER_SLOTS; i++) {
+        if (slots[i].fd == fd) {
+            closed = slots[i].closed;
+            slots[i].fd = -1;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&slotsMux);
+    return closed;
+}
+
+bool transferSessionClosed(int fd) {
+    // close_fn of httpd, socket stays open until worker is done
+    bool owned = false;
+    portENTER_CRITICAL(&slotsMux);
+    for (uint8_t i=0; i<TRANSFER_SLOTS; i++) {
+        if (slots[i].fd == fd) {
+            slots[i].closed = true;
+            owned = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&slotsMux);
+    return owned;
+}
+
+static esp_err_t sendSocket(void *ctx, const char *data, size_t len) {
+    // worker, socket has send timeout of httpd
+    int fd = *(int*)ctx;
+    while (len > 0) {
+        int sent = send(fd, data, len, 0);
+        if (sent <= 0)
+            return ESP_FAIL;
+        data += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sendRequest(void *ctx, const char *data, size_t len) {
+    // httpd task
+    while (len > 0) {
+        int sent = httpd_send((httpd_req_t*)ctx, data, len);
+        if (sent <= 0)
+            return ESP_FAIL;
+        data += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sendJob(const transferJob_t *job, char *buf, transferSend_t send, void *ctx) {
+    int len = snprintf(buf, TRANSFER_BUF_SIZE, "HTTP/1.1 %s\r\n%sContent-Length: %d\r\n\r\n", job->status, job->head, job->size);
+    if (send(ctx, buf, len) != ESP_OK)
+        return ESP_FAIL;
+    if (job->data != NULL)
+        return send(ctx, job->data + job->offset, job->size);
+    FILE *f = fopen(job->path, "r");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s", job->path);
+        return ESP_FAIL;
+    }
+    if (fseek(f, job->offset, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "Failed to seek file %s", job->path);
+        fclose(f);
+        return ESP_FAIL;
+    }
+    size_t remaining = job->size;
+    while (remaining > 0) {
+        size_t chunk = fread(buf, 1, remaining < TRANSFER_BUF_SIZE ? remaining : TRANSFER_BUF_SIZE, f);
+        if ((chunk == 0) || (send(ctx, buf, chunk) != ESP_OK))
+            break;
+        remaining -= chunk;
+    }
+    fclose(f);
+    // short body breaks Content-Length, session is closed
+    return remaining == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static void transferTask(void *pvParameter) {
+    transferJob_t job;
+    char *buf = malloc(TRANSFER_BUF_SIZE);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Can't allocate buffer");
+        vTaskDelete(NULL);
+        return;
+    }
+    while (1) {
+        if (xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE)
+            continue;
+        esp_err_t err = sendJob(&job, buf, sendSocket, &job.fd);
+        portENTER_CRITICAL(&slotsMux);
+        if (err == ESP_OK)
+            done++;
+        else
+            failed++;
+        portEXIT_CRITICAL(&slotsMux);
+        if (releaseSlot(job.fd))
+            close(job.fd);
+        else if (err != ESP_OK)
+            httpd_sess_trigger_close(job.server, job.fd);
+    }
+}
+
+esp_err_t transferStart(httpd_req_t *req, const char *status, const char *path, const char *data,
+                        size_t offset, size_t size, const char *head) {
+    // head is header lines without Content-Length.
+    // ESP_ERR_NO_MEM when all workers are busy, caller answers
+    transferJob_t job = {
+        .server = req->handle,
+        .fd = httpd_req_to_sockfd(req),
+        .status = status,
+        .data = data,
+        .offset = offset,
+        .size = size
+    };
+    if (path != NULL)
+        strlcpy(job.path, path, sizeof(job.path));
+    if (strlcpy(job.head, head, sizeof(job.head)) >= sizeof(job.head))
+        return ESP_ERR_INVALID_SIZE;
+    if ((size < TRANSFER_MIN_SIZE) || (jobs == NULL)) {
+        char *buf = malloc(TRANSFER_BUF_SIZE);
+        if (buf == NULL)
+            return ESP_FAIL;
+        esp_err_t err = sendJob(&job, buf, sendRequest, req);
+        free(buf);
+        return err;
+    }
+    if (takeSlot(job.fd)) {
+        if (xQueueSend(jobs, &job, 0) == pdTRUE)
+            return ESP_OK;
+        releaseSlot(job.fd);
+    }
+    portENTER_CRITICAL(&slotsMux);
+    rejected++;
+    portEXIT_CRITICAL(&slotsMux);
+    return ESP_ERR_NO_MEM;
+}
+
+void writeTransferStats(jsonWriter_t *w) {
+    uint8_t active = 0;
+    portENTER_CRITICAL(&slotsMux);
+    for (uint8_t i=0; i<TRANSFER_SLOTS; i++)
+        active += slots[i].fd >= 0;
+    portEXIT_CRITICAL(&slotsMux);
+    jsonObject(w);
+    jsonKey(w, "active");
+    jsonInt(w, active);
+    jsonKey(w, "done");
+    jsonInt(w, done);
+    jsonKey(w, "failed");
+    jsonInt(w, failed);
+    jsonKey(w, "rejected");
+    jsonInt(w, rejected);
+    jsonObjectEnd(w);
+}
+
+esp_err_t initTransfers() {
+    for (uint8_t i=0; i<TRANSFER_SLOTS; i++)
+        slots[i].fd = -1;
+    jobs = xQueueCreate(TRANSFER_QUEUE, sizeof(transferJob_t));
+    if (jobs == NULL) {
+        ESP_LOGE(TAG, "Can't create jobs queue");
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint8_t i=0; i<TRANSFER_WORKERS; i++)
+        xTaskCreate(&transferTask, "transferTask", 3072, NULL, 5, NULL);
+    return ESP_OK;
+}
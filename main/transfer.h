@@ -0,0 +1,16 @@
+//transfer.h
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+// smaller responses are sent by httpd task itself
+#define TRANSFER_MIN_SIZE   16384
+#define TRANSFER_HEAD_SIZE  256
+
+esp_err_t initTransfers();
+esp_err_t transferStart(httpd_req_t *req, const char *status, const char *path, const char *data,
+                        size_t offset, size_t size, const char *head);
+bool transferSessionClosed(int fd);
+struct jsonWriter;
+void writeTransferStats(struct jsonWriter *w);
@@ -82,4 +82,25 @@ void ltrim( char * string, char * trim )
      {
          memmove( &string[0], &string[1], strlen(string) );
      }
-}
\ No newline at end of file
+}
+uint8_t fmtFixed(char *buf, int32_t value, uint8_t decimals) {
+    // value scaled by 10^decimals, "-12.5" for -125 with 1 decimal. No printf, buf at least 13 bytes
+    char tmp[12];
+    uint8_t len = 0, pos = 0;
+    uint32_t v = value < 0 ? -(int64_t)value : value;
+    if (decimals > 9)
+        decimals = 9;
+    do {
+        tmp[len++] = '0' + v % 10;
+        v /= 10;
+    } while ((v > 0) || (len <= decimals));
+    if (value < 0)
+        buf[pos++] = '-';
+    while (len > 0) {
+        if (len == decimals)
+            buf[pos++] = '.';
+        buf[pos++] = tmp[--len];
+    }
+    buf[pos] = 0;
+    return pos;
+}
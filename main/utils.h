@@ -4,4 +4,5 @@ char *getUpTime();
 char *getCurrentDateTime(const char *format);
 uint8_t isIp_v4(char *ip);
 void rtrim( char * string, char * trim );
-void ltrim( char * string, char * trim );
\ No newline at end of file
+void ltrim( char * string, char * trim );
+uint8_t fmtFixed(char *buf, int32_t value, uint8_t decimals);
\ No newline at end of file
@@ -5,88 +5,98 @@
 #include "esp_log.h"
 #include "cJSON.h"
 #include "storage.h"
+#include "ota.h"
 #include "core.h"
+#include "assets.h"
+#include "routes.h"
+#include "json.h"
+#include "live.h"
+#include "state.h"
+#include "transfer.h"
 //#include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "lwip/sockets.h"
 
 static const char *TAG = "WEB";
 
 #define MAXCONTENTSIZE 32768
+#define BODY_CHUNK     256
+#define BODY_MAX_NODES 512
+#define JSON_CHUNK     512
+#define MAX_SNAPSHOTS  6
+#define MAX_PARKED     4
+#define MAX_WAIT       60  // s, long-poll limit
+#define ETAG_SIZE      32
+#define RAW_HEAD_SIZE  192
 
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 128)
 // #define SCRATCH_BUFSIZE (10240)
 
-#define IS_FILE_EXT(filename, ext) \
-    (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 char * wwwroot;
 
 esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename) {
-    if (IS_FILE_EXT(filename, ".pdf")) {
-        return httpd_resp_set_type(req, "application/pdf");
-    } else if (IS_FILE_EXT(filename, ".html")) {
-        return httpd_resp_set_type(req, "text/html");
-    } else if (IS_FILE_EXT(filename, ".jpeg")) {
-        return httpd_resp_set_type(req, "image/jpeg");
-    } else if (IS_FILE_EXT(filename, ".ico")) {
-        return httpd_resp_set_type(req, "image/x-icon");    
-    } else if (IS_FILE_EXT(filename, ".js")) {        
-        httpd_resp_set_hdr(req, "Date", "Fri, 07 Feb 2020 16:07:54 GMT");
-        httpd_resp_set_hdr(req, "Cache-Control", "max-age=2628000, public");
-        return httpd_resp_set_type(req, "application/javascript");
-    } else if (IS_FILE_EXT(filename, ".css")) {
-        return httpd_resp_set_type(req, "text/css");
-    } else if (IS_FILE_EXT(filename, ".png")) {
-        return httpd_resp_set_type(req, "image/png");    
-    } else if (IS_FILE_EXT(filename, ".json")) {
-        return httpd_resp_set_type(req, "application/json; charset=utf-8");        
-    } else {
-        return httpd_resp_set_type(req, "text/plain");
-    }
-    /* This is a limited set only */
-    /* For any other type always set as plain text */
-    return httpd_resp_set_type(req, "text/plain");
+    return httpd_resp_set_type(req, getContentType(filename));
 }
 
-char* getClearURI(const char * uri) {
-    char *newuri; 
-    const char *delim_pos = strchr(uri, '?');
-    if (delim_pos != NULL) {
-        newuri = malloc(delim_pos - uri + 1);    
-        memcpy(newuri, uri, delim_pos - uri);
-        newuri[delim_pos - uri] = 0;
-    } else {
-        newuri = malloc(strlen(uri)+1);
-        memcpy(newuri, uri, strlen(uri)+1);
+// last serialized response of versioned route
+typedef struct {
+    const route_t *route;
+    uint32_t version;
+    char *data;
+    size_t len;
+    size_t size;
+} snapshot_t;
+
+// long-poll request waiting for next version, answered directly to socket
+typedef struct {
+    const route_t *route;   // NULL for free slot
+    int fd;
+    uint32_t version;
+    TickType_t deadline;
+} parked_t;
+
+static const route_t *routes = NULL;
+static uint8_t routesQty = 0;
+// versions restart on boot, etag of previous boot must not match
+static uint32_t bootNonce;
+static httpd_handle_t server = NULL;
+// snapshots and parked requests are used by httpd task only
+static snapshot_t snapshots[MAX_SNAPSHOTS];
+static parked_t parked[MAX_PARKED];
+static uint8_t parkedQty = 0;
+static TimerHandle_t parkedTimer = NULL;
+
+// anything under these prefixes is api, unknown paths get 404 instead of file lookup
+static const char *apiPrefixes[] = {"/service/", "/ui/", "/v1.0", "/alice/"};
+
+static void parseQuery(httpd_req_t *req, query_t *query) {
+    query->count = 0;
+    if (httpd_req_get_url_query_str(req, query->buf, sizeof(query->buf)) != ESP_OK)
+        return;
+    char *pos = query->buf;
+    while ((*pos != 0) && (query->count < QUERY_PARAMS)) {
+        char *next = strchr(pos, '&');
+        if (next != NULL)
+            *next++ = 0;
+        char *value = strchr(pos, '=');
+        if (value != NULL)
+            *value++ = 0;
+        query->keys[query->count] = pos;
+        query->values[query->count] = value != NULL ? value : "";
+        query->count++;
+        if (next == NULL)
+            break;
+        pos = next;
     }
-    ESP_LOGD(TAG, "URI %s", newuri);
-    return newuri;
 }
 
-char* getParamValue(httpd_req_t *req, char *paramName) {    
-    char*  buf;
-    size_t buf_len;
-    char *value = calloc(sizeof(char), 32);
-    if (value == NULL) {
-        ESP_LOGE(TAG, "Can't calloc value");
-        return NULL;
-    }
-    
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1) {
-        buf = malloc(buf_len);
-        if (buf == NULL) {
-            ESP_LOGE(TAG, "Can't malloc buf");            
-            return NULL;
-        }
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            ESP_LOGD(TAG, "Found URL query => %s", buf);            
-            if (httpd_query_key_value(buf, paramName, value, 32) == ESP_OK) {
-                ESP_LOGD(TAG, "Found URL query parameter => %s", value);
-            }            
-        }
-        free(buf);
-    }
-    return value;
+const char *getQueryValue(const query_t *query, const char *name) {
+    // NULL if parameter is absent
+    for (uint8_t i=0; i<query->count; i++)
+        if (!strcmp(query->keys[i], name))
+            return query->values[i];
+    return NULL;
 }
 
 esp_err_t toDecimal(char *src, uint8_t *val) {
@@ -100,68 +110,347 @@ esp_err_t toDecimal(char *src, uint8_t *val) {
     return err;
 }
 
-esp_err_t getContent(char **dst, httpd_req_t *req) {
+typedef struct {
+    jsonParser_t parser;
+    jsonTree_t tree;
+} bodyReader_t;
+
+static esp_err_t readJsonBody(httpd_req_t *req, cJSON **body) {
+    // body goes through parser by small chunks, only resulting tree is kept in memory.
+    // Parser and tree hold token buffers, they are on heap to spare httpd stack
+    char buf[BODY_CHUNK];
+    char error[48];
+    esp_err_t err = ESP_OK;
+    *body = NULL;
     if (req->content_len > MAXCONTENTSIZE) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Content too long");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Content too long");
         return ESP_FAIL;
     }
-    *dst = (char*)malloc(req->content_len+1);
-    if (*dst == NULL) {
-        ESP_LOGE(TAG, "Can't allocate content buffer");
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Can't allocate content buffer");
+    bodyReader_t *reader = malloc(sizeof(bodyReader_t));
+    if (reader == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
         return ESP_FAIL;
     }
-    int cur_len = 0;
-    int received = 0;
-    while (cur_len < req->content_len) {
-        received = httpd_req_recv(req, *dst + cur_len, req->content_len);
-        if (received <= 0) {            
+    jsonParser_t *parser = &reader->parser;
+    jsonTree_t *tree = &reader->tree;
+    jsonTreeInit(tree, BODY_MAX_NODES);
+    jsonParserInit(parser, jsonTreeEvent, tree);
+    size_t remaining = req->content_len;
+    while ((remaining > 0) && (err == ESP_OK)) {
+        int received = httpd_req_recv(req, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if (received == HTTPD_SOCK_ERR_TIMEOUT)
+            continue;
+        if (received <= 0) {
+            cJSON_Delete(jsonTreeDetach(tree));
+            free(reader);
             httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to get content");
             return ESP_FAIL;
         }
-        cur_len += received;
+        remaining -= received;
+        err = jsonParse(parser, buf, received);
+    }
+    if (err == ESP_OK)
+        err = jsonParseEnd(parser);
+    if (err != ESP_OK) {
+        cJSON_Delete(jsonTreeDetach(tree));
+        ESP_LOGE(TAG, "Wrong JSON at %u", parser->pos);
+        snprintf(error, sizeof(error), tree->nodes > tree->maxNodes ? "JSON is too large at %d" : "Wrong JSON at %u", parser->pos);
+        free(reader);
+        // rest of body is dropped with connection
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+        return ESP_FAIL;
     }
-    //*dst[req->content_len] = '\0';
-    return ESP_OK;    
+    *body = jsonTreeDetach(tree);
+    free(reader);
+    return ESP_OK;
 }
 
 static esp_err_t file_get_handler(httpd_req_t *req) {
     return getFileWeb(req);
 }
 
-static esp_err_t ui_handler(httpd_req_t *req) {
-    //ESP_LOGI(TAG, "Test ui %s", req->uri);
-    SemaphoreHandle_t sem = getSemaphore();
-    if (xSemaphoreTake(sem, portMAX_DELAY) == pdTRUE) {
-        uiRouter(req);
-        xSemaphoreGive(sem);
+static int compareRoute(const char *path, size_t len, httpd_method_t method, const route_t *route) {
+    int res = strncmp(path, route->path, len);
+    if ((res == 0) && (route->path[len] != 0))
+        res = -1;
+    return res != 0 ? res : (int)method - (int)route->method;
+}
+
+static const route_t *findRoute(const char *uri, httpd_method_t method) {
+    // routes are sorted by path and method
+    size_t len = strcspn(uri, "?");
+    int16_t lo = 0, hi = routesQty - 1;
+    while (lo <= hi) {
+        int16_t mid = (lo + hi) / 2;
+        int res = compareRoute(uri, len, method, &routes[mid]);
+        if (res == 0)
+            return &routes[mid];
+        if (res < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+static esp_err_t sendChunk(void *req, const char *data, size_t len) {
+    return httpd_resp_send_chunk((httpd_req_t*)req, data, len);
+}
+
+static esp_err_t appendSnapshot(void *ctx, const char *data, size_t len) {
+    snapshot_t *snapshot = ctx;
+    if (snapshot->len + len > snapshot->size) {
+        size_t size = (snapshot->len + len) * 2;
+        char *buf = realloc(snapshot->data, size);
+        if (buf == NULL)
+            return ESP_ERR_NO_MEM;
+        snapshot->data = buf;
+        snapshot->size = size;
+    }
+    memcpy(snapshot->data + snapshot->len, data, len);
+    snapshot->len += len;
+    return ESP_OK;
+}
+
+static snapshot_t *getSnapshot(const route_t *route, uint32_t version) {
+    // serialized again only when version has changed
+    snapshot_t *snapshot = NULL;
+    for (uint8_t i=0; (i < MAX_SNAPSHOTS) && (snapshot == NULL); i++)
+        if ((snapshots[i].route == route) || (snapshots[i].route == NULL))
+            snapshot = &snapshots[i];
+    if (snapshot == NULL)
+        return NULL;
+    if ((snapshot->route == route) && (snapshot->version == version) && (snapshot->data != NULL))
+        return snapshot;
+    char buf[JSON_CHUNK];
+    jsonWriter_t w;
+    query_t query = {.count = 0};
+    snapshot->route = route;
+    snapshot->len = 0;
+    jsonInit(&w, buf, sizeof(buf), appendSnapshot, snapshot);
+    if ((route->json(NULL, &query, &w) != ESP_OK) || (jsonFinish(&w) != ESP_OK)) {
+        ESP_LOGE(TAG, "Can't build snapshot of %s", route->path);
+        free(snapshot->data);
+        snapshot->data = NULL;
+        snapshot->size = 0;
+        return NULL;
+    }
+    snapshot->version = version;
+    return snapshot;
+}
+
+static void formatEtag(char *etag, const route_t *route, uint32_t version) {
+    snprintf(etag, ETAG_SIZE, "\"%08x-%d-%u\"", bootNonce, route - routes, version);
+}
+
+static bool isEtagMatch(httpd_req_t *req, const char *etag) {
+    char value[64];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK)
+        return false;
+    return strstr(value, etag) != NULL;
+}
+
+static esp_err_t socketSend(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        int sent = httpd_socket_send(server, fd, data, len, 0);
+        if (sent <= 0)
+            return ESP_FAIL;
+        data += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sendRaw(int fd, const char *status, const route_t *route, const char *etag, const char *data, size_t len) {
+    // handler of parked request has returned, so response is written without httpd_req_t
+    char head[RAW_HEAD_SIZE];
+    int headLen = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nETag: %s\r\n"
+                           "Cache-Control: no-cache\r\nContent-Length: %d\r\n\r\n",
+                           status, route->type != NULL ? route->type : "application/json", etag, len);
+    if ((headLen >= sizeof(head)) || (socketSend(fd, head, headLen) != ESP_OK))
+        return ESP_FAIL;
+    return socketSend(fd, data, len);
+}
+
+static void answerParked(parked_t *p, uint32_t version) {
+    char etag[ETAG_SIZE];
+    esp_err_t err;
+    formatEtag(etag, p->route, version);
+    if (version == p->version) {
+        err = sendRaw(p->fd, "304 Not Modified", p->route, etag, NULL, 0);
+    } else {
+        snapshot_t *snapshot = getSnapshot(p->route, version);
+        if (snapshot != NULL)
+            err = sendRaw(p->fd, "200 OK", p->route, etag, snapshot->data, snapshot->len);
+        else
+            err = sendRaw(p->fd, "500 Internal Server Error", p->route, etag, NULL, 0);
     }
+    if (err != ESP_OK)
+        httpd_sess_trigger_close(server, p->fd);
+    p->route = NULL;
+    parkedQty--;
+}
+
+static void checkParked(void *arg) {
+    // httpd task, on state change and every second while somebody waits
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i=0; i<MAX_PARKED; i++) {
+        if (parked[i].route == NULL)
+            continue;
+        uint32_t version = stateVersion(parked[i].route->state);
+        if ((version != parked[i].version) || ((int32_t)(now - parked[i].deadline) >= 0))
+            answerParked(&parked[i], version);
+    }
+    if (parkedQty == 0)
+        xTimerStop(parkedTimer, 0);
+}
+
+static void parkedTimerCallback(TimerHandle_t timer) {
+    httpd_queue_work(server, checkParked, NULL);
+}
+
+static void wakeParked() {
+    // any task, missed wake up is caught by timer
+    if (parkedQty > 0)
+        httpd_queue_work(server, checkParked, NULL);
+}
+
+static esp_err_t parkRequest(httpd_req_t *req, const route_t *route, uint32_t version, uint16_t wait) {
+    for (uint8_t i=0; i<MAX_PARKED; i++) {
+        if (parked[i].route != NULL)
+            continue;
+        parked[i].route = route;
+        parked[i].fd = httpd_req_to_sockfd(req);
+        parked[i].version = version;
+        parked[i].deadline = xTaskGetTickCount() + pdMS_TO_TICKS(wait * 1000);
+        parkedQty++;
+        xTimerStart(parkedTimer, 0);
+        return ESP_OK;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static void sessionClosed(httpd_handle_t hd, int fd) {
+    // fd of closed session could be reused, its parked request is dropped
+    for (uint8_t i=0; i<MAX_PARKED; i++) {
+        if ((parked[i].route != NULL) && (parked[i].fd == fd)) {
+            parked[i].route = NULL;
+            parkedQty--;
+        }
+    }
+    if (!transferSessionClosed(fd))
+        close(fd);
+}
+
+static esp_err_t routeStateHandler(httpd_req_t *req, const route_t *route) {
+    // cached response, 304 for known version, ?wait=N holds request until version changes
+    query_t query;
+    char etag[ETAG_SIZE];
+    parseQuery(req, &query);
+    uint32_t version = stateVersion(route->state);
+    formatEtag(etag, route, version);
+    bool match = isEtagMatch(req, etag);
+    const char *wait = getQueryValue(&query, "wait");
+    if (match && (wait != NULL) && (atoi(wait) > 0) &&
+        (parkRequest(req, route, version, atoi(wait) < MAX_WAIT ? atoi(wait) : MAX_WAIT) == ESP_OK))
+        return ESP_OK;
+    httpd_resp_set_type(req, route->type != NULL ? route->type : "application/json");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (match) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+    snapshot_t *snapshot = getSnapshot(route, version);
+    if (snapshot == NULL)
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Can't build response");
+    return httpd_resp_send(req, snapshot->data, snapshot->len);
+}
+
+static esp_err_t routeJsonHandler(httpd_req_t *req, const route_t *route) {
+    // constant memory for any response size, status can't change once first chunk is sent
+    query_t query;
+    char buf[JSON_CHUNK];
+    jsonWriter_t w;
+    parseQuery(req, &query);
+    httpd_resp_set_type(req, route->type != NULL ? route->type : "application/json");
+    httpd_resp_set_status(req, "200");
+    jsonInit(&w, buf, sizeof(buf), sendChunk, req);
+    if ((route->json(req, &query, &w) != ESP_OK) || (jsonFinish(&w) != ESP_OK)) {
+        ESP_LOGE(TAG, "Streaming %s failed", route->path);
+        // connection is closed, client sees truncated response
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t routeHandler(httpd_req_t *req, const route_t *route) {
+    query_t query;
+    char *response = NULL;
+    cJSON *body = NULL;
+    esp_err_t err = ESP_OK;
+
+    parseQuery(req, &query);
+    if (route->type != NULL)
+        httpd_resp_set_type(req, route->type);
+    if (route->flags & ROUTE_CONTENT)
+        err = readJsonBody(req, &body);
+    if (err != ESP_OK)
+        return ESP_OK; // error is sent already
+    // handlers lock their own config domain
+    if (route->flags & ROUTE_MUTATES)
+        ESP_LOGI(TAG, "Changing %s", route->path);
+    err = route->handler(req, &query, body, &response);
+    httpd_resp_set_status(req, err == ESP_OK ? "200" : "400");
+    if (response != NULL) {
+        httpd_resp_send(req, response, -1);
+        free(response);
+    }   
     return ESP_OK;
 }
 
-// static esp_err_t ui_handler(httpd_req_t *req) {
-//     uiRouter(req);
-//     return ESP_OK;
-// }
+esp_err_t registerRoutes(const route_t *table, uint8_t qty) {
+    for (uint8_t i=1; i<qty; i++) {
+        if (compareRoute(table[i].path, strlen(table[i].path), table[i].method, &table[i-1]) <= 0) {
+            ESP_LOGE(TAG, "Routes are not sorted at %s", table[i].path);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    routes = table;
+    routesQty = qty;
+    return ESP_OK;
+}
+
+static bool isApiURI(const char *uri) {
+    for (uint8_t i=0; i<sizeof(apiPrefixes)/sizeof(apiPrefixes[0]); i++)
+        if (!strncmp(uri, apiPrefixes[i], strlen(apiPrefixes[i])))
+            return true;
+    return false;
+}
 
 static esp_err_t http_router(httpd_req_t *req) {
     // main http router
+    const route_t *route = findRoute(req->uri, req->method);
+    if (route != NULL) {
+        if (route->json == NULL)
+            return routeHandler(req, route);
+        return route->state != 0 ? routeStateHandler(req, route) : routeJsonHandler(req, route);
+    }
     if (!strncmp(req->uri, "/service/upload/", 16) && req->method == HTTP_POST) {
         return setFileWeb(req);
     } 
-    if (!strncmp(req->uri, "/service/", 9)) {
-        return ui_handler(req);
-    }  
-    if (!strncmp(req->uri, "/ui/", 4)) {
-        return ui_handler(req);
-    }  
-    if (!strncmp(req->uri, "/v1.0", 5)) {
-        return ui_handler(req);
-    }  
-    if (!strncmp(req->uri, "/alice/", 7)) {
-        return ui_handler(req);
-    }  
-    
+    if (!strncmp(req->uri, "/service/benchmark/upload", 25) && (req->method == HTTP_POST))
+        return benchmarkUpload(req);
+    if (!strcmp(req->uri, "/service/ota") && (req->method == HTTP_POST))
+        return receiveOTA(req);
+    // current log, collectors fetch its tail with Range
+    if ((strcspn(req->uri, "?") == 12) && !strncmp(req->uri, "/service/log", 12) && (req->method == HTTP_GET))
+        return getLogFile(req);
+    if (isApiURI(req->uri)) {
+        ESP_LOGE(TAG, "Method not found %s", req->uri);
+        httpd_resp_set_status(req, "404");
+        return httpd_resp_sendstr(req, "Method not found!");
+    }
     return file_get_handler(req);
 }
 
@@ -172,10 +461,12 @@ esp_err_t startWebserver()
     // REST_CHECK(rest_context, "No memory for rest context", err);
     // strlcpy(rest_context->wwwroot, wwwroot, sizeof(rest_context->wwwroot));
 
-    httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
     config.core_id = 0;
+    // live clients keep their sockets open
+    config.max_open_sockets = 10;
+    config.close_fn = sessionClosed;
 
     ESP_LOGI(TAG, "Starting HTTP Server");
     if (httpd_start(&server, &config) != ESP_OK) {
@@ -183,6 +474,8 @@ esp_err_t startWebserver()
         return ESP_FAIL;
     }
     
+    registerLive(server);
+
     httpd_uri_t get_uri = {
         .uri = "/*",
         .method = HTTP_GET,
@@ -259,5 +552,11 @@ char* getWWWroot() {
 esp_err_t initWebServer() {
     wwwroot = calloc(1, 30);
     strcpy(wwwroot, "/storage/web");
+    bootNonce = esp_random();
+    initAssets();
+    assetsLoad();
+    parkedTimer = xTimerCreate("parked", pdMS_TO_TICKS(1000), pdTRUE, NULL, parkedTimerCallback);
+    stateSetNotify(wakeParked);
+    initTransfers();
     return startWebserver();
 }
\ No newline at end of file
@@ -10,7 +10,4 @@
 char *getWWWroot();
 esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename);
 esp_err_t initWebServer();
-char *getClearURI(const char *uri);
-char *getParamValue(httpd_req_t *req, char *paramName);
 esp_err_t toDecimal(char *src, uint8_t *val);
-esp_err_t getContent(char **dst, httpd_req_t *req);
\ No newline at end of file
@@ -0,0 +1,100 @@
+//cJSON.c
+// host shim, subset of cJSON used by json.c and the test
+#include <stdlib.h>
+#include <string.h>
+#include "cJSON.h"
+
+static cJSON *create(int type) {
+    cJSON *item = calloc(1, sizeof(cJSON));
+    if (item != NULL)
+        item->type = type;
+    return item;
+}
+
+cJSON *cJSON_CreateObject() {
+    return create(cJSON_Object);
+}
+
+cJSON *cJSON_CreateArray() {
+    return create(cJSON_Array);
+}
+
+cJSON *cJSON_CreateString(const char *string) {
+    cJSON *item = create(cJSON_String);
+    if (item != NULL)
+        item->valuestring = strdup(string);
+    return item;
+}
+
+cJSON *cJSON_CreateNumber(double num) {
+    cJSON *item = create(cJSON_Number);
+    if (item != NULL) {
+        item->valuedouble = num;
+        item->valueint = (int)num;
+    }
+    return item;
+}
+
+cJSON *cJSON_CreateBool(bool boolean) {
+    return create(boolean ? cJSON_True : cJSON_False);
+}
+
+cJSON *cJSON_CreateNull() {
+    return create(cJSON_NULL);
+}
+
+void cJSON_AddItemToArray(cJSON *array, cJSON *item) {
+    cJSON **last = &array->child;
+    while (*last != NULL)
+        last = &(*last)->next;
+    *last = item;
+}
+
+void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item) {
+    item->string = strdup(string);
+    cJSON_AddItemToArray(object, item);
+}
+
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string) {
+    cJSON *item;
+    cJSON_ArrayForEach(item, object) {
+        if (!strcmp(item->string, string))
+            return item;
+    }
+    return NULL;
+}
+
+void cJSON_Delete(cJSON *item) {
+    while (item != NULL) {
+        cJSON *next = item->next;
+        cJSON_Delete(item->child);
+        free(item->valuestring);
+        free(item->string);
+        free(item);
+        item = next;
+    }
+}
+
+bool cJSON_IsObject(const cJSON *item) {
+    return (item != NULL) && (item->type == cJSON_Object);
+}
+
+bool cJSON_IsArray(const cJSON *item) {
+    return (item != NULL) && (item->type == cJSON_Array);
+}
+
+bool cJSON_IsString(const cJSON *item) {
+    return (item != NULL) && (item->type == cJSON_String);
+}
+
+bool cJSON_IsNumber(const cJSON *item) {
+    return (item != NULL) && (item->type == cJSON_Number);
+}
+
+bool cJSON_IsBool(const cJSON *item) {
+    return (item != NULL) && (item->type & (cJSON_True | cJSON_False));
+}
+
+bool cJSON_IsTrue(const cJSON *item) {
+    return (item != NULL) && (item->type == cJSON_True);
+}
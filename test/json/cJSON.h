@@ -0,0 +1,41 @@
+//cJSON.h
+// host shim, subset of cJSON used by json.c and the test
+#pragma once
+#include <stdbool.h>
+
+#define cJSON_False     (1 << 0)
+#define cJSON_True      (1 << 1)
+#define cJSON_NULL      (1 << 2)
+#define cJSON_Number    (1 << 3)
+#define cJSON_String    (1 << 4)
+#define cJSON_Array     (1 << 5)
+#define cJSON_Object    (1 << 6)
+
+typedef struct cJSON {
+    struct cJSON *next;
+    struct cJSON *child;
+    int type;
+    char *valuestring;
+    int valueint;
+    double valuedouble;
+    char *string;
+} cJSON;
+
+#define cJSON_ArrayForEach(element, array) for (element = (array != NULL) ? (array)->child : NULL; element != NULL; element = element->next)
+
+cJSON *cJSON_CreateObject();
+cJSON *cJSON_CreateArray();
+cJSON *cJSON_CreateString(const char *string);
+cJSON *cJSON_CreateNumber(double num);
+cJSON *cJSON_CreateBool(bool boolean);
+cJSON *cJSON_CreateNull();
+void cJSON_AddItemToArray(cJSON *array, cJSON *item);
+void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item);
+cJSON *cJSON_GetObjectItem(const cJSON *object, const char *string);
+void cJSON_Delete(cJSON *item);
+bool cJSON_IsObject(const cJSON *item);
+bool cJSON_IsArray(const cJSON *item);
+bool cJSON_IsString(const cJSON *item);
+bool cJSON_IsNumber(const cJSON *item);
+bool cJSON_IsBool(const cJSON *item);
+bool cJSON_IsTrue(const cJSON *item);
@@ -0,0 +1,8 @@
+//esp_err.h
+// host shim, codes used by json.c
+#pragma once
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_SIZE    0x104
@@ -0,0 +1,88 @@
+//jsonLongString.c
+// host test of main/json.c parser: long keys and strings of config upload survive any chunking,
+// string over JSON_TOKEN_SIZE is rejected. Exits with 1 on failure.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+
+// utils.c parts used by json.c
+uint8_t fmtFixed(char *buf, int32_t value, uint8_t decimals) {
+    return sprintf(buf, "%d", value);
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+    return len;
+}
+
+static cJSON *parse(const char *body, size_t chunk) {
+    jsonParser_t parser;
+    jsonTree_t tree;
+    size_t len = strlen(body);
+    esp_err_t err = ESP_OK;
+    jsonTreeInit(&tree, 512);
+    jsonParserInit(&parser, jsonTreeEvent, &tree);
+    for (size_t pos=0; (pos < len) && (err == ESP_OK); pos+=chunk)
+        err = jsonParse(&parser, body + pos, len - pos < chunk ? len - pos : chunk);
+    if (err == ESP_OK)
+        err = jsonParseEnd(&parser);
+    if (err != ESP_OK) {
+        cJSON_Delete(jsonTreeDetach(&tree));
+        return NULL;
+    }
+    return jsonTreeDetach(&tree);
+}
+
+static void fill(char *buf, size_t len) {
+    for (size_t i=0; i<len; i++)
+        buf[i] = 'a' + i % 26;
+    buf[len] = 0;
+}
+
+int main() {
+    char url[201], key[201], expected[208];
+    static char body[2048];
+    int failed = 0;
+    // 200 characters with escaped quote in the middle, as mqtt url with credentials could have
+    fill(url, 200);
+    fill(key, 200);
+    snprintf(body, sizeof(body), "{\"otaurl\": \"https://%.100s\\\"%.91s\", \"%s\": true, \"mqtt\": {\"url\": \"%s\"}}",
+             url, url + 100, key, url);
+    snprintf(expected, sizeof(expected), "https://%.100s\"%.91s", url, url + 100);
+    for (size_t chunk=1; chunk<=strlen(body); chunk++) {
+        cJSON *root = parse(body, chunk);
+        cJSON *otaurl = cJSON_GetObjectItem(root, "otaurl");
+        cJSON *mqttUrl = cJSON_GetObjectItem(cJSON_GetObjectItem(root, "mqtt"), "url");
+        if (!cJSON_IsString(otaurl) || strcmp(otaurl->valuestring, expected) ||
+            !cJSON_IsTrue(cJSON_GetObjectItem(root, key)) ||
+            !cJSON_IsString(mqttUrl) || strcmp(mqttUrl->valuestring, url)) {
+            printf("FAIL: 200 characters are not parsed by chunks of %zu\n", chunk);
+            failed = 1;
+        }
+        cJSON_Delete(root);
+    }
+    // token buffer keeps terminator
+    static char tooLong[JSON_TOKEN_SIZE + 1];
+    fill(tooLong, JSON_TOKEN_SIZE);
+    snprintf(body, sizeof(body), "{\"otaurl\": \"%s\"}", tooLong);
+    if (parse(body, 64) != NULL) {
+        printf("FAIL: string of %d characters is accepted\n", JSON_TOKEN_SIZE);
+        failed = 1;
+    }
+    tooLong[JSON_TOKEN_SIZE - 1] = 0;
+    snprintf(body, sizeof(body), "{\"otaurl\": \"%s\"}", tooLong);
+    cJSON *root = parse(body, 64);
+    if (!cJSON_IsString(cJSON_GetObjectItem(root, "otaurl"))) {
+        printf("FAIL: string of %d characters is rejected\n", JSON_TOKEN_SIZE - 1);
+        failed = 1;
+    }
+    cJSON_Delete(root);
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,408 @@
+//shim.c
+// host implementation of shim.h: FreeRTOS on pthreads, OTA partition in memory,
+// esp_http_client and sha256 on OpenSSL
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include "shim.h"
+
+#define HTTP_HEAD_SIZE  2048
+
+static pthread_mutex_t criticalLock = PTHREAD_MUTEX_INITIALIZER;
+
+void shimEnterCritical() {
+    pthread_mutex_lock(&criticalLock);
+}
+
+void shimExitCritical() {
+    pthread_mutex_unlock(&criticalLock);
+}
+
+int64_t esp_timer_get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+    void (*task)(void*);
+    void *arg;
+} taskStart_t;
+
+static void *taskThread(void *arg) {
+    taskStart_t start = *(taskStart_t*)arg;
+    free(arg);
+    start.task(start.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(void (*task)(void*), const char *name, uint32_t stack, void *arg, int prio, TaskHandle_t *handle) {
+    pthread_t thread;
+    taskStart_t *start = malloc(sizeof(taskStart_t));
+    start->task = task;
+    start->arg = arg;
+    if (pthread_create(&thread, NULL, taskThread, start) != 0)
+        return pdFALSE;
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000);
+}
+
+struct shimQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint32_t len;
+    uint32_t itemSize;
+    uint32_t head;
+    uint32_t qty;
+    uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(uint32_t len, uint32_t itemSize) {
+    QueueHandle_t queue = calloc(1, sizeof(struct shimQueue) + len * itemSize);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->len = len;
+    queue->itemSize = itemSize;
+    return queue;
+}
+
+static bool waitQueue(QueueHandle_t queue, bool full, TickType_t wait) {
+    // under queue lock, false on timeout
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += wait / 1000;
+    until.tv_nsec += (wait % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    while (full ? queue->qty == queue->len : queue->qty == 0) {
+        if (wait == 0)
+            return false;
+        if (wait == portMAX_DELAY)
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        else if (pthread_cond_timedwait(&queue->changed, &queue->lock, &until) != 0)
+            return false;
+    }
+    return true;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+    pthread_mutex_lock(&queue->lock);
+    bool ok = waitQueue(queue, true, wait);
+    if (ok) {
+        memcpy(queue->items + ((queue->head + queue->qty) % queue->len) * queue->itemSize, item, queue->itemSize);
+        queue->qty++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    pthread_mutex_lock(&queue->lock);
+    bool ok = waitQueue(queue, false, wait);
+    if (ok) {
+        if (item != NULL)
+            memcpy(item, queue->items + queue->head * queue->itemSize, queue->itemSize);
+        queue->head = (queue->head + 1) % queue->len;
+        queue->qty--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    free(queue);
+}
+
+// ota partition
+uint8_t *shimWritten = NULL;
+size_t shimWrittenLen = 0;
+bool shimBootSet = false;
+static bool otaOpen = false;
+static const esp_partition_t running = {"ota_0", 0x1E0000};
+static const esp_partition_t next = {"ota_1", 0x1E0000};
+
+const esp_partition_t *esp_ota_get_running_partition() {
+    return &running;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start) {
+    return &next;
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *desc) {
+    memset(desc, 0, sizeof(esp_app_desc_t));
+    desc->magic_word = ESP_APP_DESC_MAGIC_WORD;
+    strcpy(desc->version, "test-old");
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t size, esp_ota_handle_t *handle) {
+    if (otaOpen)
+        return ESP_ERR_INVALID_STATE;
+    free(shimWritten);
+    shimWritten = malloc(partition->size);
+    shimWrittenLen = 0;
+    otaOpen = true;
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size) {
+    if (!otaOpen || (shimWrittenLen + size > next.size))
+        return ESP_FAIL;
+    memcpy(shimWritten + shimWrittenLen, data, size);
+    shimWrittenLen += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle) {
+    if (!otaOpen)
+        return ESP_ERR_INVALID_ARG;
+    otaOpen = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) {
+    shimBootSet = true;
+    return ESP_OK;
+}
+
+// http client, one request per connection
+struct shimHttpClient {
+    char url[256];
+    char location[256];
+    char range[32];
+    int timeout;
+    int sock;
+    SSL_CTX *ctx;
+    SSL *ssl;
+    char head[HTTP_HEAD_SIZE];
+    size_t headLen;
+    size_t bodyPos;         // first body byte in head
+    int status;
+    int contentLength;
+    int remaining;
+    bool chunked;
+};
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config) {
+    esp_http_client_handle_t client = calloc(1, sizeof(struct shimHttpClient));
+    strncpy(client->url, config->url, sizeof(client->url) - 1);
+    client->timeout = config->timeout_ms;
+    client->sock = -1;
+    // test certificate is self-signed, it is not verified
+    client->ctx = SSL_CTX_new(TLS_client_method());
+    return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value) {
+    if (strcasecmp(key, "Range"))
+        return ESP_ERR_NOT_FOUND;
+    strncpy(client->range, value, sizeof(client->range) - 1);
+    return ESP_OK;
+}
+
+static bool splitUrl(const char *url, char *host, char *port, const char **path) {
+    // https://host:port/path, path points into url
+    const char *start = strstr(url, "://");
+    if (start == NULL)
+        return false;
+    start += 3;
+    *path = strchr(start, '/');
+    if ((*path == NULL) || (*path - start >= 128))
+        return false;
+    const char *colon = memchr(start, ':', *path - start);
+    const char *hostEnd = colon != NULL ? colon : *path;
+    memcpy(host, start, hostEnd - start);
+    host[hostEnd - start] = 0;
+    strcpy(port, "443");
+    if (colon != NULL) {
+        memcpy(port, colon + 1, *path - colon - 1);
+        port[*path - colon - 1] = 0;
+    }
+    return true;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int writeLen) {
+    char host[128], port[8], request[512];
+    const char *path;
+    struct addrinfo *addr;
+    esp_http_client_close(client);
+    if (!splitUrl(client->url, host, port, &path) || (getaddrinfo(host, port, NULL, &addr) != 0))
+        return ESP_FAIL;
+    client->sock = socket(addr->ai_family, SOCK_STREAM, 0);
+    struct timeval tv = {.tv_sec = client->timeout / 1000, .tv_usec = (client->timeout % 1000) * 1000};
+    setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int err = connect(client->sock, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+    if (err != 0)
+        return ESP_FAIL;
+    client->ssl = SSL_new(client->ctx);
+    SSL_set_fd(client->ssl, client->sock);
+    if (SSL_connect(client->ssl) != 1)
+        return ESP_FAIL;
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n", path, host);
+    if (client->range[0] != 0)
+        len += snprintf(request + len, sizeof(request) - len, "Range: %s\r\n", client->range);
+    len += snprintf(request + len, sizeof(request) - len, "\r\n");
+    return SSL_write(client->ssl, request, len) == len ? ESP_OK : ESP_FAIL;
+}
+
+static const char *findHeader(esp_http_client_handle_t client, const char *name) {
+    // value of response header, head is zero terminated
+    size_t nameLen = strlen(name);
+    for (char *line = strstr(client->head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, name, nameLen) && (line[2 + nameLen] == ':'))
+            return line + 3 + nameLen + strspn(line + 3 + nameLen, " ");
+    }
+    return NULL;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+    client->headLen = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        int len = SSL_read(client->ssl, client->head + client->headLen, sizeof(client->head) - 1 - client->headLen);
+        if (len <= 0)
+            return ESP_FAIL;
+        client->headLen += len;
+        client->head[client->headLen] = 0;
+        end = strstr(client->head, "\r\n\r\n");
+    }
+    client->bodyPos = end + 4 - client->head;
+    *end = 0;
+    client->status = atoi(client->head + 9);
+    const char *value = findHeader(client, "Transfer-Encoding");
+    client->chunked = (value != NULL) && !strncasecmp(value, "chunked", 7);
+    value = findHeader(client, "Content-Length");
+    client->contentLength = (value != NULL) && !client->chunked ? atoi(value) : -1;
+    client->remaining = client->contentLength;
+    value = findHeader(client, "Location");
+    client->location[0] = 0;
+    if ((value != NULL) && (strcspn(value, "\r") < sizeof(client->location))) {
+        memcpy(client->location, value, strcspn(value, "\r"));
+        client->location[strcspn(value, "\r")] = 0;
+    }
+    return client->contentLength;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buf, int len) {
+    // 0 after whole body or when peer closes, -1 on timeout
+    if (client->remaining == 0)
+        return 0;
+    if ((client->remaining > 0) && (len > client->remaining))
+        len = client->remaining;
+    int read;
+    if (client->bodyPos < client->headLen) {
+        read = client->headLen - client->bodyPos < (size_t)len ? client->headLen - client->bodyPos : (size_t)len;
+        memcpy(buf, client->head + client->bodyPos, read);
+        client->bodyPos += read;
+    } else {
+        read = SSL_read(client->ssl, buf, len);
+        if (read <= 0)
+            return SSL_get_error(client->ssl, read) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    if (client->remaining > 0)
+        client->remaining -= read;
+    return read;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+    return client->status;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client) {
+    return client->chunked;
+}
+
+esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t client) {
+    // absolute url or path on the same server, like esp_http_client_set_url
+    char host[128], port[8];
+    const char *path;
+    if (client->location[0] == 0)
+        return ESP_ERR_INVALID_ARG;
+    if (client->location[0] != '/') {
+        strcpy(client->url, client->location);
+        return ESP_OK;
+    }
+    if (!splitUrl(client->url, host, port, &path))
+        return ESP_FAIL;
+    snprintf(client->url + (path - client->url), sizeof(client->url) - (path - client->url), "%s", client->location);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+    if (client->ssl != NULL)
+        SSL_free(client->ssl);
+    if (client->sock >= 0)
+        close(client->sock);
+    client->ssl = NULL;
+    client->sock = -1;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+    esp_http_client_close(client);
+    SSL_CTX_free(client->ctx);
+    free(client);
+    return ESP_OK;
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+    ctx->md = EVP_MD_CTX_new();
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224) {
+    return EVP_DigestInit_ex(ctx->md, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *data, size_t len) {
+    return EVP_DigestUpdate(ctx->md, data, len) == 1 ? 0 : -1;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char *digest) {
+    return EVP_DigestFinal_ex(ctx->md, digest, NULL) == 1 ? 0 : -1;
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {
+    EVP_MD_CTX_free(ctx->md);
+}
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t len) {
+    return -1;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *req, const char *field, char *val, size_t len) {
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg) {
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type) {
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *req, const char *str) {
+    return ESP_OK;
+}
@@ -0,0 +1,146 @@
+//shim.h
+// host shim of ESP-IDF and FreeRTOS for ota.c, every IDF header of the build includes only this file
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_TIMEOUT         0x107
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do {} while (0)
+
+// FreeRTOS on pthreads, one tick is 1 ms
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef void *TaskHandle_t;
+typedef struct shimQueue *QueueHandle_t;
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef int portMUX_TYPE;
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define portMAX_DELAY           0xFFFFFFFF
+#define portTICK_PERIOD_MS      1
+#define portTICK_RATE_MS        1
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) shimEnterCritical()
+#define portEXIT_CRITICAL(mux)  shimExitCritical()
+
+void shimEnterCritical();
+void shimExitCritical();
+BaseType_t xTaskCreate(void (*task)(void*), const char *name, uint32_t stack, void *arg, int prio, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+QueueHandle_t xQueueCreate(uint32_t len, uint32_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait);
+void vQueueDelete(QueueHandle_t queue);
+#define xSemaphoreCreateBinary()        xQueueCreate(1, 0)
+#define xSemaphoreTake(sem, wait)       xQueueReceive(sem, NULL, wait)
+#define xSemaphoreGive(sem)             xQueueSend(sem, NULL, 0)
+#define vSemaphoreDelete(sem)           vQueueDelete(sem)
+
+int64_t esp_timer_get_time();
+
+// ota partitions, written image is kept in memory
+typedef struct {
+    char label[17];
+    uint32_t size;
+} esp_partition_t;
+typedef uint32_t esp_ota_handle_t;
+typedef struct {
+    uint8_t bytes[24];
+} esp_image_header_t;
+typedef struct {
+    uint8_t bytes[8];
+} esp_image_segment_header_t;
+typedef struct {
+    uint32_t magic_word;
+    uint32_t secure_version;
+    uint32_t reserv1[2];
+    char version[32];
+    char project_name[32];
+    char time[16];
+    char date[16];
+    char idf_ver[32];
+    uint8_t app_elf_sha256[32];
+    uint32_t reserv2[20];
+} esp_app_desc_t;
+#define ESP_IMAGE_HEADER_MAGIC      0xE9
+#define ESP_APP_DESC_MAGIC_WORD     0xABCD5432
+#define OTA_WITH_SEQUENTIAL_WRITES  0xfffffffe
+
+const esp_partition_t *esp_ota_get_running_partition();
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start);
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *desc);
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t size, esp_ota_handle_t *handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+// esp_http_client on OpenSSL, only calls of ota.c
+typedef struct shimHttpClient *esp_http_client_handle_t;
+typedef struct {
+    const char *url;
+    const char *cert_pem;
+    int timeout_ms;
+    bool skip_cert_common_name_check;
+    bool keep_alive_enable;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int writeLen);
+int esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char *buf, int len);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client);
+esp_err_t esp_http_client_set_redirection(esp_http_client_handle_t client);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+// sha256 on OpenSSL
+typedef struct {
+    void *md;
+} mbedtls_sha256_context;
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224);
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *data, size_t len);
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char *digest);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+
+// httpd, push OTA is not run by the test
+typedef void *httpd_handle_t;
+typedef struct {
+    httpd_handle_t handle;
+    int method;
+    const char *uri;
+    size_t content_len;
+} httpd_req_t;
+typedef enum {
+    HTTPD_400_BAD_REQUEST,
+    HTTPD_500_INTERNAL_SERVER_ERROR
+} httpd_err_code_t;
+#define HTTPD_SOCK_ERR_TIMEOUT  -3
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t len);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *req, const char *field, char *val, size_t len);
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg);
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type);
+esp_err_t httpd_resp_sendstr(httpd_req_t *req, const char *str);
+
+typedef struct cJSON cJSON;
@@ -0,0 +1,3 @@
+//FreeRTOS.h
+// host shim, only what seqlock.c uses
+#include <stdint.h>
@@ -0,0 +1,5 @@
+//task.h
+// host shim, reader gives the core to writer like vTaskDelay(1) on device
+#include <sched.h>
+
+#define vTaskDelay(ticks) sched_yield()
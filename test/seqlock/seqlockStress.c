@@ -0,0 +1,87 @@
+//seqlockStress.c
+// host stress test of seqlock.c: one writer keeps rewriting a snapshot, readers check every copy
+// is consistent. Exits with 1 on torn read.
+// usage: seqlockStress [seconds] [readers]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "seqlock.h"
+
+#define VALUES  16
+
+typedef struct {
+    uint32_t gen;
+    int32_t values[VALUES];     // all equal gen, last one is checksum
+} snapshot_t;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t retries;
+    uint64_t torn;
+} readerStats_t;
+
+static seqlock_t lock;
+static snapshot_t shared;
+static volatile int running = 1;
+
+static void *writerThread(void *arg) {
+    uint32_t gen = 0;
+    while (running) {
+        gen++;
+        seqlockWriteBegin(&lock);
+        shared.gen = gen;
+        for (int i=0; i<VALUES - 1; i++)
+            shared.values[i] = gen;
+        shared.values[VALUES - 1] = ~gen;
+        seqlockWriteEnd(&lock);
+    }
+    return NULL;
+}
+
+static void *readerThread(void *arg) {
+    readerStats_t *stats = arg;
+    snapshot_t copy;
+    uint32_t start;
+    while (running) {
+        do {
+            start = seqlockReadBegin(&lock);
+            memcpy(&copy, (const void*)&shared, sizeof(copy));
+            stats->retries++;
+        } while (seqlockReadRetry(&lock, start));
+        stats->retries--;
+        stats->reads++;
+        for (int i=0; i<VALUES - 1; i++)
+            if (copy.values[i] != (int32_t)copy.gen)
+                stats->torn++;
+        if (copy.values[VALUES - 1] != (int32_t)~copy.gen)
+            stats->torn++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    int readersQty = argc > 2 ? atoi(argv[2]) : 2;
+    pthread_t writer;
+    pthread_t readers[readersQty];
+    readerStats_t stats[readersQty];
+    memset(stats, 0, sizeof(stats));
+    pthread_create(&writer, NULL, writerThread, NULL);
+    for (int i=0; i<readersQty; i++)
+        pthread_create(&readers[i], NULL, readerThread, &stats[i]);
+    sleep(seconds);
+    running = 0;
+    pthread_join(writer, NULL);
+    uint64_t reads = 0, retries = 0, torn = 0;
+    for (int i=0; i<readersQty; i++) {
+        pthread_join(readers[i], NULL);
+        reads += stats[i].reads;
+        retries += stats[i].retries;
+        torn += stats[i].torn;
+    }
+    printf("readers %d, reads %llu, retries %llu, torn %llu\n", readersQty,
+           (unsigned long long)reads, (unsigned long long)retries, (unsigned long long)torn);
+    return (torn == 0) && (reads > 0) ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+# Builds read-only web image for "www" partition, mapped by assets.c
+# usage: mkwww.py <web dir> <image file> <partition size>
+#
+# header:  magic "WWW1", count, image size, reserved
+# entries: sorted by path, offsets are from image start
+#   path, data, size, gzData, gzSize, flags, etag[24] (quoted, zero terminated)
+# then paths and data, 4 byte aligned
+import os
+import struct
+import sys
+
+from webpack import scan, etag
+
+MAGIC = 0x31575757  # "WWW1"
+HEADER = struct.Struct('<IIII')
+ENTRY = struct.Struct('<IIIIII24s')
+FLAG_IMMUTABLE = 0x01
+
+
+def align(blob):
+    blob.extend(b'\0' * (-len(blob) % 4))
+
+
+def build(src, size):
+    files = list(scan(src)) if os.path.isdir(src) else []
+    base = HEADER.size + ENTRY.size * len(files)
+    blob = bytearray()
+    entries = []
+    for uri, data, packed, immutable in files:
+        path = base + len(blob)
+        blob.extend(uri.encode() + b'\0')
+        align(blob)
+        offset = base + len(blob)
+        blob.extend(data)
+        align(blob)
+        gzOffset = 0
+        if packed is not None:
+            gzOffset = base + len(blob)
+            blob.extend(packed)
+            align(blob)
+        entries.append(ENTRY.pack(path, offset, len(data), gzOffset, len(packed) if packed else 0,
+                                  FLAG_IMMUTABLE if immutable else 0, ('"%s"' % etag(data)).encode()))
+    image = HEADER.pack(MAGIC, len(files), base + len(blob), 0) + b''.join(entries) + bytes(blob)
+    if len(image) > size:
+        sys.exit('web image %d bytes does not fit partition %d' % (len(image), size))
+    return image, len(files)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 4:
+        sys.exit('usage: mkwww.py <web dir> <image file> <partition size>')
+    image, count = build(sys.argv[1], int(sys.argv[3], 0))
+    with open(sys.argv[2], 'wb') as f:
+        f.write(image)
+    print('web image: %d files, %d bytes' % (count, len(image)))
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# HTTPS server of firmware image for OTA tests, supports Range and breaks connections on purpose
+# usage: otaserver.py <image> <cert.pem> <key.pem> [port] [drop KB] [drop count]
+#
+# every response is cut after <drop KB> (default 256) until <drop count> (default 3) connections are broken,
+# device should resume with Range and finish the update. Test certificate:
+#   openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=ota -keyout key.pem -out cert.pem
+# cert.pem goes to /config/ca_cert.pem on device, otaurl is https://<this host>:<port>/<any path>,
+# /redirect/<path> answers 302 to /<path>
+import http.server
+import re
+import ssl
+import sys
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        if self.path.startswith('/redirect/'):
+            self.send_response(302)
+            self.send_header('Location', self.path[len('/redirect'):])
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        image = self.server.image
+        start = 0
+        match = re.match(r'bytes=(\d+)-$', self.headers.get('Range', ''))
+        if match:
+            start = int(match.group(1))
+            if start >= len(image):
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % len(image))
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, len(image) - 1, len(image)))
+        else:
+            self.send_response(200)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(len(image) - start))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.end_headers()
+        end = len(image)
+        if self.server.drops > 0:
+            end = min(end, start + self.server.dropSize)
+        self.wfile.write(image[start:end])
+        if end < len(image):
+            self.server.drops -= 1
+            self.log_message('dropped at %d, %d drops left', end, self.server.drops)
+            self.close_connection = True
+            self.connection.close()
+        else:
+            self.log_message('sent %d-%d', start, end)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 4:
+        sys.exit('usage: otaserver.py <image> <cert.pem> <key.pem> [port] [drop KB] [drop count]')
+    port = int(sys.argv[4]) if len(sys.argv) > 4 else 8443
+    server = http.server.ThreadingHTTPServer(('', port), Handler)
+    with open(sys.argv[1], 'rb') as f:
+        server.image = f.read()
+    server.dropSize = (int(sys.argv[5]) if len(sys.argv) > 5 else 256) * 1024
+    server.drops = int(sys.argv[6]) if len(sys.argv) > 6 else 3
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(sys.argv[2], sys.argv[3])
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+    print('serving %s, %d bytes on port %d' % (sys.argv[1], len(server.image), port))
+    server.serve_forever()
@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# Measures upload throughput of /service/benchmark/upload, body is written to storage and removed
+# usage: uploadbench.py <host> [size KB] [chunk sizes...]
+import json
+import os
+import sys
+import time
+import urllib.request
+
+
+def upload(host, data, chunk):
+    url = 'http://%s/service/benchmark/upload' % host
+    if chunk:
+        url += '?chunk=%d' % chunk
+    req = urllib.request.Request(url, data=data, method='POST', headers={'Content-Type': 'application/octet-stream'})
+    start = time.time()
+    with urllib.request.urlopen(req, timeout=120) as resp:
+        result = json.loads(resp.read())
+    return result, len(data) / 1024 / (time.time() - start)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        sys.exit('usage: uploadbench.py <host> [size KB] [chunk sizes...]')
+    size = int(sys.argv[2]) if len(sys.argv) > 2 else 256
+    chunks = [int(c) for c in sys.argv[3:]] or [0]
+    data = os.urandom(size * 1024)
+    print('%8s %8s %12s %12s' % ('chunk', 'KB', 'device KB/s', 'client KB/s'))
+    for chunk in chunks:
+        result, rate = upload(sys.argv[1], data, chunk)
+        print('%8d %8d %12d %12.1f' % (result['chunk'], size, result['rate'], rate))
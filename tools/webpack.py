@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# Prepares web files for /storage/web: gzip variants, ETags and manifest.json
+# usage: webpack.py <source dir> <output dir>
+# then upload output dir content with FTP or /service/upload, manifest.json last
+import gzip
+import hashlib
+import json
+import os
+import re
+import sys
+
+COMPRESS = ('.html', '.htm', '.js', '.css', '.json', '.svg', '.txt', '.map', '.ico')
+HASHED = re.compile(r'\.[0-9a-f]{8,}\.')
+
+
+def scan(src):
+    # yields (uri, data, gzip data or None, immutable) sorted by uri
+    files = []
+    for root, _, names in os.walk(src):
+        for name in names:
+            full = os.path.join(root, name)
+            files.append(('/' + os.path.relpath(full, src).replace(os.sep, '/'), full))
+    for uri, full in sorted(files):
+        with open(full, 'rb') as f:
+            data = f.read()
+        packed = None
+        if uri.lower().endswith(COMPRESS):
+            packed = gzip.compress(data, 9, mtime=0)
+            if len(packed) >= len(data):
+                packed = None
+        yield uri, data, packed, bool(HASHED.search(os.path.basename(uri)))
+
+
+def etag(data):
+    return hashlib.sha256(data).hexdigest()[:16]
+
+
+def pack(src, dst):
+    manifest = []
+    for uri, data, packed, immutable in scan(src):
+        out = os.path.join(dst, uri[1:])
+        os.makedirs(os.path.dirname(out), exist_ok=True)
+        with open(out, 'wb') as f:
+            f.write(data)
+        entry = {'path': uri, 'size': len(data), 'etag': etag(data), 'gzip': packed is not None, 'immutable': immutable}
+        if packed is not None:
+            with open(out + '.gz', 'wb') as f:
+                f.write(packed)
+            entry['gzSize'] = len(packed)
+        manifest.append(entry)
+    with open(os.path.join(dst, 'manifest.json'), 'w') as f:
+        json.dump(manifest, f, separators=(',', ':'))
+    return manifest
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit('usage: webpack.py <source dir> <output dir>')
+    for e in pack(sys.argv[1], sys.argv[2]):
+        print('%-40s %7d %7s %s' % (e['path'], e['size'], e.get('gzSize', '-'), 'immutable' if e['immutable'] else ''))